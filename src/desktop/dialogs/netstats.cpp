@@ -20,6 +20,14 @@
 #include "netstats.h"
 #include "ui_netstats.h"
 
+#include "net/latencytracer.h"
+#include "../libshared/net/trafficstats.h"
+
+#include <QFileDialog>
+#include <QJsonDocument>
+#include <QMessageBox>
+#include <QSaveFile>
+
 namespace dialogs {
 
 static QString formatKb(int bytes)
@@ -32,11 +40,36 @@ static QString formatKb(int bytes)
 		return QStringLiteral("%1 Mb").arg(bytes/float(1024*1024), 0, 'f', 1);
 }
 
+static QString formatUsecs(qint64 usecs)
+{
+	if(usecs < 1000)
+		return QStringLiteral("%1 \u00b5s").arg(usecs);
+	else
+		return QStringLiteral("%1 ms").arg(usecs / 1000);
+}
+
+static QString formatResidency(const protocol::LatencyHistogram &h)
+{
+	if(h.count() == 0)
+		return QStringLiteral("-");
+
+	return NetStats::tr("median %1, 99%: %2, max %3").arg(
+		formatUsecs(h.percentile(0.5)),
+		formatUsecs(h.percentile(0.99)),
+		formatUsecs(h.max() / 1000)
+	);
+}
+
 NetStats::NetStats(QWidget *parent) :
 	QDialog(parent), _ui(new Ui_NetStats)
 {
 	_ui->setupUi(this);
 	setDisconnected();
+
+	_ui->traceLatency->setChecked(net::LatencyTracer::active() != nullptr);
+	connect(_ui->traceLatency, &QCheckBox::toggled, this, &NetStats::setLatencyTracing);
+	connect(_ui->saveTrace, &QPushButton::clicked, this, &NetStats::saveLatencyTrace);
+	updateLatencyReport();
 }
 
 void NetStats::setRecvBytes(int bytes)
@@ -54,9 +87,81 @@ void NetStats::setCurrentLag(int lag)
 	_ui->lagLabel->setText(QStringLiteral("%1 ms").arg(lag));
 }
 
+void NetStats::setTrafficStats(const protocol::TrafficStats &stats)
+{
+	using protocol::TrafficStats;
+
+	_ui->inboxLabel->setText(formatResidency(stats.residency(TrafficStats::Received)));
+	_ui->outboxLabel->setText(formatResidency(stats.residency(TrafficStats::Sent)));
+
+	// Rows are rebuilt in place so the user's sort order is kept
+	QTreeWidget *view = _ui->trafficView;
+	view->setSortingEnabled(false);
+
+	int row = 0;
+	for(int type=0;type<256;++type) {
+		const qint64 received = stats.messages(TrafficStats::Received, type);
+		const qint64 sent = stats.messages(TrafficStats::Sent, type);
+		if(received == 0 && sent == 0)
+			continue;
+
+		QTreeWidgetItem *item = view->topLevelItem(row);
+		if(!item)
+			item = new QTreeWidgetItem(view);
+		++row;
+
+		item->setText(0, TrafficStats::typeName(type));
+		item->setData(1, Qt::DisplayRole, received);
+		item->setData(2, Qt::DisplayRole, stats.bytes(TrafficStats::Received, type));
+		item->setData(3, Qt::DisplayRole, sent);
+		item->setData(4, Qt::DisplayRole, stats.bytes(TrafficStats::Sent, type));
+	}
+
+	while(view->topLevelItemCount() > row)
+		delete view->takeTopLevelItem(row);
+
+	view->setSortingEnabled(true);
+}
+
 void NetStats::setDisconnected()
 {
 	_ui->lagLabel->setText(tr("not connected"));
 }
 
+void NetStats::setLatencyTracing(bool enable)
+{
+	net::LatencyTracer::setEnabled(enable);
+	updateLatencyReport();
+}
+
+void NetStats::updateLatencyReport()
+{
+	const net::LatencyTracer *tracer = net::LatencyTracer::active();
+
+	_ui->saveTrace->setEnabled(tracer && !tracer->traces().isEmpty());
+	_ui->latencyReport->setVisible(tracer != nullptr);
+	if(tracer)
+		_ui->latencyReport->setText(tracer->report());
+}
+
+void NetStats::saveLatencyTrace()
+{
+	const net::LatencyTracer *tracer = net::LatencyTracer::active();
+	if(!tracer)
+		return;
+
+	const QString filename = QFileDialog::getSaveFileName(
+		this,
+		tr("Save trace"),
+		QString(),
+		tr("Chrome trace (%1)").arg("*.json")
+	);
+	if(filename.isEmpty())
+		return;
+
+	QSaveFile f(filename);
+	if(!f.open(QSaveFile::WriteOnly) || f.write(tracer->chromeTrace().toJson(QJsonDocument::Compact)) < 0 || !f.commit())
+		QMessageBox::warning(this, tr("Save trace"), f.errorString());
+}
+
 }
@@ -24,6 +24,11 @@
 
 class Ui_NetStats;
 
+namespace protocol {
+	class TrafficStats;
+	class LatencyHistogram;
+}
+
 namespace dialogs {
 
 class NetStats : public QDialog
@@ -36,8 +41,16 @@ public slots:
 	void setSentBytes(int bytes);
 	void setRecvBytes(int bytes);
 	void setCurrentLag(int lag);
+	void setTrafficStats(const protocol::TrafficStats &stats);
 	void setDisconnected();
 
+	//! Refresh the stroke latency tracing summary
+	void updateLatencyReport();
+
+private slots:
+	void setLatencyTracing(bool enable);
+	void saveLatencyTrace();
+
 private:
 	Ui_NetStats *_ui;
 };
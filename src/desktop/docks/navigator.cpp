@@ -35,6 +35,9 @@ using docks::NavigatorView;
 
 namespace docks {
 
+//! Finest mipmap level the navigator paints from (quarter resolution)
+static const int NAVIGATOR_CACHE_LEVEL = 2;
+
 static QPixmap makeCursorBackground(const int avatarSize)
 {
 	const int PADDING = 4;
@@ -82,6 +85,7 @@ void NavigatorView::setLayerStackObserver(paintcore::LayerStackPixmapCacheObserv
 {
 	m_observer = observer;
 	connect(m_observer, &paintcore::LayerStackPixmapCacheObserver::areaChanged, this, &NavigatorView::onChange);
+	connect(m_observer, &paintcore::LayerStackPixmapCacheObserver::cacheRefreshed, this, &NavigatorView::onChange);
 	connect(m_observer, &paintcore::LayerStackPixmapCacheObserver::resized, this, &NavigatorView::onResize);
 	refreshCache();
 }
@@ -174,19 +178,27 @@ void NavigatorView::onResize()
 
 void NavigatorView::refreshCache()
 {
-	const QPixmap &canvas = m_observer->getPixmap();
-	if(canvas.isNull())
+	if(!m_observer->layerStack())
+		return;
+
+	const QSize canvasSize = m_observer->layerStack()->size();
+	if(canvasSize.isEmpty())
 		return;
 
 	const QSize size = this->size();
 	if(size != m_cachedSize) {
 		m_cachedSize = size;
-		const QSize pixmapSize = m_observer->layerStack()->size().scaled(size, Qt::KeepAspectRatio);
+		const QSize pixmapSize = canvasSize.scaled(size, Qt::KeepAspectRatio);
 		m_cache = QPixmap(pixmapSize);
 	}
 
 	QPainter painter(&m_cache);
-	painter.drawPixmap(m_cache.rect(), canvas);
+	painter.setRenderHint(QPainter::SmoothPixmapTransform);
+	// The navigator is low priority: changed tiles are refreshed in
+	// the background and cacheRefreshed triggers another update.
+	// It always paints from a coarse mipmap level, so that it never needs
+	// the whole canvas to be cached at full (or half) resolution.
+	m_observer->paint(&painter, m_cache.rect(), QRect(QPoint(), canvasSize), true, NAVIGATOR_CACHE_LEVEL);
 
 	update();
 }
@@ -48,6 +48,7 @@
 
 #ifndef NDEBUG
 #include "core/tile.h"
+#include "core/layerstackpixmapcacheobserver.h"
 #endif
 
 #ifdef Q_OS_OSX
@@ -214,6 +215,7 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	m_viewstatus = new widgets::ViewStatus(this);
 
 	m_netstatus = new widgets::NetStatus(this);
+	m_netstatus->setClient(m_doc->client());
 	m_lockstatus = new QLabel(this);
 	m_lockstatus->setFixedSize(QSize(16, 16));
 
@@ -241,6 +243,22 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 		tilememtimer->start(1000);
 		m_viewStatusBar->addPermanentWidget(tilemem);
 	}
+
+	// Debugging tool: show canvas repaint statistics
+	{
+		QLabel *paintstats = new QLabel(this);
+		QTimer *paintstatstimer = new QTimer(this);
+		connect(paintstatstimer, &QTimer::timeout, [this, paintstats]() {
+			const auto stats = m_canvasscene->layerStackObserver()->takePaintStats();
+			paintstats->setText(QStringLiteral("Repaints: %1/s Flattened: %2 tiles/s (%3 ms)")
+				.arg(stats.paints)
+				.arg(stats.flattenedTiles)
+				.arg(stats.flattenTime / 1000000.0, 0, 'f', 1)
+			);
+		});
+		paintstatstimer->start(1000);
+		m_viewStatusBar->addPermanentWidget(paintstats);
+	}
 #endif
 
 	m_viewStatusBar->addPermanentWidget(m_viewstatus);
@@ -757,6 +775,7 @@ void MainWindow::updateSettings()
 
 	cfg.beginGroup("settings");
 	m_view->setBrushCursorStyle(cfg.value("brushcursor").toInt(), cfg.value("brushoutlinewidth").toReal());
+	m_canvasscene->setCanvasMaxFps(cfg.value("canvasmaxfps", 0).toInt());
 	static_cast<tools::BrushSettings*>(m_dockToolSettings->getToolSettingsPage(tools::Tool::FREEHAND))->setShareBrushSlotColor(cfg.value("sharebrushslotcolor", false).toBool());
 	cfg.endGroup();
 
@@ -21,9 +21,13 @@
 
 #include "core/layerstackpixmapcacheobserver.h"
 #include "core/layerstack.h"
+#include "net/latencytracer.h"
 
 #include <QPainter>
 #include <QStyleOptionGraphicsItem>
+#include <QGuiApplication>
+#include <QScreen>
+#include <QTimer>
 
 namespace drawingboard {
 
@@ -34,14 +38,54 @@ namespace drawingboard {
 CanvasItem::CanvasItem(paintcore::LayerStackPixmapCacheObserver *layerstack, QGraphicsItem *parent)
 	: QGraphicsObject(parent), m_image(layerstack)
 {
+	m_refreshTimer = new QTimer(this);
+	m_refreshTimer->setSingleShot(true);
+	m_refreshTimer->setTimerType(Qt::PreciseTimer);
+	connect(m_refreshTimer, &QTimer::timeout, this, &CanvasItem::flushRefresh);
+	setMaxFps(0);
+
 	connect(m_image, &paintcore::LayerStackPixmapCacheObserver::areaChanged, this, &CanvasItem::refreshImage);
 	connect(m_image, &paintcore::LayerStackPixmapCacheObserver::resized, this, &CanvasItem::canvasResize);
 	setFlag(ItemUsesExtendedStyleOption);
 }
 
+void CanvasItem::setMaxFps(int fps)
+{
+	if(fps <= 0) {
+		const QScreen *screen = QGuiApplication::primaryScreen();
+		fps = screen ? qRound(screen->refreshRate()) : 60;
+	}
+
+	// Nanoseconds, so e.g. 144 FPS doesn't get truncated to 6 ms (166 FPS)
+	m_refreshInterval = 1000000000 / qBound(1, fps, 1000);
+}
+
 void CanvasItem::refreshImage(const QRect &area)
 {
-	update(area.adjusted(-2, -2, 2, 2));
+	// Changes are accumulated and repainted at most once per frame
+	m_pendingRefresh |= area;
+
+	if(m_refreshTimer->isActive())
+		return;
+
+	const qint64 elapsed = m_lastRefresh.isValid() ? m_lastRefresh.nsecsElapsed() : m_refreshInterval;
+	if(elapsed >= m_refreshInterval)
+		flushRefresh();
+	else
+		m_refreshTimer->start(int((m_refreshInterval - elapsed + 999999) / 1000000));
+}
+
+void CanvasItem::flushRefresh()
+{
+	if(m_pendingRefresh.isEmpty())
+		return;
+
+	// Disjoint changes (e.g. two users drawing at opposite corners)
+	// are repainted separately instead of as one big bounding rectangle
+	for(const QRect &r : m_pendingRefresh)
+		update(r.adjusted(-2, -2, 2, 2));
+	m_pendingRefresh = QRegion();
+	m_lastRefresh.start();
 }
 
 void CanvasItem::canvasResize()
@@ -60,7 +104,10 @@ void CanvasItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option
 	 QWidget *)
 {
 	const QRect exposed = option->exposedRect.adjusted(-1, -1, 1, 1).toAlignedRect();
-	painter->drawPixmap(exposed, m_image->getPixmap(exposed), exposed);
+	m_image->paint(painter, exposed);
+
+	if(net::LatencyTracer *tracer = net::LatencyTracer::active())
+		tracer->canvasPainted();
 }
 
 }
@@ -20,6 +20,10 @@
 #define DP_CANVASITEM_H
 
 #include <QGraphicsObject>
+#include <QElapsedTimer>
+#include <QRegion>
+
+class QTimer;
 
 namespace paintcore {
 	class LayerStackPixmapCacheObserver;
@@ -39,8 +43,19 @@ public:
 
 	QRectF boundingRect() const override;
 
+	/**
+	 * @brief Set the maximum canvas refresh rate
+	 *
+	 * Changed areas are accumulated and repainted at most this
+	 * many times per second.
+	 *
+	 * @param fps maximum refresh rate or 0 to use the screen's refresh rate
+	 */
+	void setMaxFps(int fps);
+
 private slots:
 	void refreshImage(const QRect &area);
+	void flushRefresh();
 	void canvasResize();
 
 protected:
@@ -48,6 +63,11 @@ protected:
 
 private:
 	paintcore::LayerStackPixmapCacheObserver *m_image;
+
+	QTimer *m_refreshTimer;
+	QElapsedTimer m_lastRefresh;
+	QRegion m_pendingRefresh;
+	qint64 m_refreshInterval; // in nanoseconds
 };
 
 }
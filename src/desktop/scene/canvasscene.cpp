@@ -60,6 +60,11 @@ CanvasScene::~CanvasScene()
 	delete m_canvasItem;
 }
 
+void CanvasScene::setCanvasMaxFps(int fps)
+{
+	m_canvasItem->setMaxFps(fps);
+}
+
 /**
  * This prepares the canvas for new drawing commands.
  * @param myid the context id of the local user
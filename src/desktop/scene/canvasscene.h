@@ -80,6 +80,9 @@ public:
 
 	paintcore::LayerStackPixmapCacheObserver *layerStackObserver() { return m_layerstackObserver; }
 
+	//! Set the canvas refresh rate limit (0 means screen refresh rate)
+	void setCanvasMaxFps(int fps);
+
 public slots:
 	//! Show annotation borders
 	void showAnnotationBorders(bool hl);
@@ -29,7 +29,8 @@ namespace tools {
 namespace props {
 	static const ToolProperties::RangedValue<int>
 		tolerance { QStringLiteral("tolerance"), 0, 0, 100 },
-		expand { QStringLiteral("expand"), 0, 0, 100 }
+		expand { QStringLiteral("expand"), 0, 0, 100 },
+		gap { QStringLiteral("gap"), 0, 0, 32 }
 		;
 	static const ToolProperties::RangedValue<double>
 		sizelimit { QStringLiteral("sizelimit"), 50.0, 0.0, 1000.0 }
@@ -61,6 +62,7 @@ QWidget *FillSettings::createUiWidget(QWidget *parent)
 	connect(_ui->tolerance, &QSlider::valueChanged, this, &FillSettings::pushSettings);
 	connect(_ui->sizelimit, QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, &FillSettings::pushSettings);
 	connect(_ui->expand, &QSlider::valueChanged, this, &FillSettings::pushSettings);
+	connect(_ui->gap, QOverload<int>::of(&QSpinBox::valueChanged), this, &FillSettings::pushSettings);
 	connect(_ui->samplemerged, &QAbstractButton::toggled, this, &FillSettings::pushSettings);
 	connect(_ui->fillunder, &QAbstractButton::toggled, this, &FillSettings::pushSettings);
 	connect(_ui->erasermode, &QAbstractButton::toggled, this, &FillSettings::pushSettings);
@@ -78,6 +80,7 @@ void FillSettings::pushSettings()
 	auto *tool = static_cast<FloodFill*>(controller()->getTool(Tool::FLOODFILL));
 	tool->setTolerance(_ui->tolerance->value());
 	tool->setExpansion(_ui->expand->value());
+	tool->setGapSize(_ui->gap->value());
 	tool->setSizeLimit(_ui->sizelimit->value() * _ui->sizelimit->value() * 10 * 10);
 	tool->setSampleMerged(erase ? false : _ui->samplemerged->isChecked());
 	tool->setUnderFill(_ui->fillunder->isChecked());
@@ -94,6 +97,7 @@ ToolProperties FillSettings::saveToolSettings()
 	ToolProperties cfg(toolType());
 	cfg.setValue(props::tolerance, _ui->tolerance->value());
 	cfg.setValue(props::expand, _ui->expand->value());
+	cfg.setValue(props::gap, _ui->gap->value());
 	cfg.setValue(props::samplemerged, _ui->samplemerged->isChecked());
 	cfg.setValue(props::underfill, _ui->fillunder->isChecked());
 	cfg.setValue(props::erasermode, _ui->erasermode->isChecked());
@@ -113,6 +117,7 @@ void FillSettings::restoreToolSettings(const ToolProperties &cfg)
 {
 	_ui->tolerance->setValue(cfg.value(props::tolerance));
 	_ui->expand->setValue(cfg.value(props::expand));
+	_ui->gap->setValue(cfg.value(props::gap));
 	_ui->sizelimit->setValue(cfg.value(props::sizelimit));
 	_ui->samplemerged->setChecked(cfg.value(props::samplemerged));
 	_ui->fillunder->setChecked(cfg.value(props::underfill));
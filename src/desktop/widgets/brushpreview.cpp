@@ -112,7 +112,7 @@ void BrushPreview::paintEvent(QPaintEvent *event)
 		updatePreview();
 
 	QPainter painter(this);
-	painter.drawPixmap(event->rect(), m_previewCache->getPixmap(event->rect()), event->rect());
+	m_previewCache->paint(&painter, event->rect());
 #endif
 }
 
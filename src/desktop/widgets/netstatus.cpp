@@ -21,6 +21,7 @@
 #include "widgets/popupmessage.h"
 #include "dialogs/certificateview.h"
 #include "dialogs/netstats.h"
+#include "net/client.h"
 #include "utils/icon.h"
 #include "../libshared/util/whatismyip.h"
 
@@ -43,7 +44,7 @@
 namespace widgets {
 
 NetStatus::NetStatus(QWidget *parent)
-	: QWidget(parent), m_state(NotConnected), _sentbytes(0), _recvbytes(0), _lag(0)
+	: QWidget(parent), m_state(NotConnected), m_client(nullptr), _sentbytes(0), _recvbytes(0), _lag(0)
 {
 	setMinimumHeight(16+2);
 
@@ -424,10 +425,26 @@ void NetStatus::showNetStats()
 		_netstats->setSentBytes(_sentbytes);
 		if(!m_address.isEmpty())
 			_netstats->setCurrentLag(_lag);
+
+		// Traffic statistics are polled while the dialog is open
+		QTimer *refreshTimer = new QTimer(_netstats);
+		connect(refreshTimer, &QTimer::timeout, this, &NetStatus::updateTrafficStats);
+		refreshTimer->start(1000);
+		updateTrafficStats();
 	}
 	_netstats->show();
 }
 
+void NetStatus::updateTrafficStats()
+{
+	if(!_netstats)
+		return;
+
+	if(m_client)
+		_netstats->setTrafficStats(m_client->trafficStats());
+	_netstats->updateLatencyReport();
+}
+
 void NetStatus::showCGNAlert()
 {
 	QSettings cfg;
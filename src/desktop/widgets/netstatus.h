@@ -34,6 +34,10 @@ namespace dialogs {
 	class NetStats;
 }
 
+namespace net {
+	class Client;
+}
+
 namespace widgets {
 
 class PopupMessage;
@@ -51,6 +55,9 @@ public:
 
 	void setSecurityLevel(net::Server::Security level, const QSslCertificate &certificate);
 
+	//! Set the client whose traffic statistics are shown in the statistics dialog
+	void setClient(net::Client *client) { m_client = client; }
+
 public slots:
 	void connectingToHost(const QString& address, int port);
 	void loggedIn(const QUrl &sessionUrl);
@@ -94,6 +101,7 @@ private slots:
 	void externalIpDiscovered(const QString &ip);
 	void showCertificate();
 	void showNetStats();
+	void updateTrafficStats();
 
 private:
 	void showCGNAlert();
@@ -105,6 +113,7 @@ private:
 	QString fullAddress() const;
 
 	QPointer<dialogs::NetStats> _netstats;
+	net::Client *m_client;
 	QProgressBar *m_download;
 
 	QLabel *m_label, *m_security;
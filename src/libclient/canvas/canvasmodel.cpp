@@ -32,6 +32,7 @@
 #include "ora/orawriter.h"
 #include "utils/identicon.h"
 #include "net/internalmsg.h"
+#include "net/latencytracer.h"
 
 #include "../libshared/net/meta.h"
 #include "../libshared/net/meta2.h"
@@ -131,6 +132,15 @@ void CanvasModel::handleCommand(protocol::MessagePtr cmd)
 		return;
 	}
 
+	net::LatencyTracer *tracer = net::LatencyTracer::active();
+
+	if(cmd->type() == protocol::MSG_TRACE_MARK) {
+		// Trace marks are not part of the session and are not recorded
+		if(tracer)
+			tracer->markReceived(cmd.cast<TraceMark>());
+		return;
+	}
+
 	// Apply ACL filter
 	if(m_mode != Mode::Playback && !m_aclfilter->filterMessage(*cmd)) {
 		qWarning("Filtered %s message from %d", qPrintable(cmd->messageName()), cmd->contextId());
@@ -189,6 +199,8 @@ void CanvasModel::handleCommand(protocol::MessagePtr cmd)
 
 	} else if(cmd->isCommand()) {
 		// The state tracker handles all drawing commands
+		if(tracer)
+			tracer->commandReceived(*cmd);
 		m_statetracker->receiveQueuedCommand(cmd);
 		emit canvasModified();
 
@@ -27,6 +27,7 @@
 #include "brushes/brushpainter.h"
 #include "net/commands.h"
 #include "net/internalmsg.h"
+#include "net/latencytracer.h"
 #include "tools/selection.h" // for selection transform utils
 
 #include "../libshared/net/brushes.h"
@@ -318,6 +319,9 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 		int pos = m_history.end() - 1;
 		handleCommand(msg, false, pos);
 	} // else ALREADYDONE
+
+	if(net::LatencyTracer *tracer = net::LatencyTracer::active())
+		tracer->commandExecuted(*msg);
 }
 
 void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
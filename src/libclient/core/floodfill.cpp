@@ -22,13 +22,23 @@
 #include "layer.h"
 
 #include <QStack>
+#include <QBitArray>
+#include <QHash>
 #include <QPainter>
-#include <QVarLengthArray>
+#include <QVector>
+
+#include <cstring>
 
 namespace paintcore {
 
 namespace {
 
+static const float DISTANCE_INF = 1e20f;
+
+void distanceTransform2D(float *grid, int width, int height);
+
+enum GapCell { GAP_OUTSIDE, GAP_INSIDE, GAP_MARGIN };
+
 class Floodfill {
 public:
 	Floodfill(const LayerStack *image, int sourceLayer, bool merge, const QColor &color, int colorTolerance, unsigned int sizelimit) :
@@ -40,7 +50,9 @@ public:
 		fillColor(color.rgba()),
 		tolerance(colorTolerance),
 		filledSize(0),
-		sizelimit(sizelimit)
+		sizelimit(sizelimit),
+		gapShift(0),
+		gapColumns(0)
 	{ }
 
 	Tile &scratchTile(int x, int y)
@@ -103,11 +115,293 @@ public:
 		return r*r + g*g + b*b + a*a <= tolerance * tolerance;
 	}
 
+	inline bool isInsideGapMask(int x, int y) const {
+		if(gapCells.isEmpty())
+			return true;
+
+		const int cell = (y >> gapShift) * gapColumns + (x >> gapShift);
+		switch(gapCells.at(cell)) {
+		case GAP_INSIDE: return true;
+		case GAP_MARGIN: {
+			const int m = (1 << gapShift) - 1;
+			const auto margin = gapMargins.constFind(cell);
+			return margin != gapMargins.constEnd() && margin->testBit(((y & m) << gapShift) | (x & m));
+		}
+		default: return false;
+		}
+	}
+
 	inline bool isOldColorAt(int x, int y) {
-		return isSameColor(colorAt(x, y), oldColor);
+		return isInsideGapMask(x, y) && isSameColor(colorAt(x, y), oldColor);
+	}
+
+	//! Check if every pixel in the given gap grid cell can be filled
+	bool isOpenCell(int cx, int cy)
+	{
+		// Cells are never larger than tiles, so each cell is contained in a single tile
+		Q_ASSERT((1 << gapShift) <= Tile::SIZE);
+
+		const int x0 = cx << gapShift;
+		const int y0 = cy << gapShift;
+		const int x1 = qMin(x0 + (1 << gapShift), scratch.width());
+		const int y1 = qMin(y0 + (1 << gapShift), scratch.height());
+
+		const QRgb *pixels = scratchTile(x0 / Tile::SIZE, y0 / Tile::SIZE).constData();
+
+		for(int y=y0;y<y1;++y) {
+			const QRgb *row = pixels + (y % Tile::SIZE) * Tile::SIZE;
+			for(int x=x0;x<x1;++x) {
+				if(!isSameColor(row[x % Tile::SIZE], oldColor))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	//! Check if a straight line between the two points crosses only fillable pixels
+	bool isStraightPathOpen(const QPoint &from, const QPoint &to)
+	{
+		const int dx = to.x() - from.x();
+		const int dy = to.y() - from.y();
+		const int steps = qMax(qAbs(dx), qAbs(dy));
+		for(int i=1;i<=steps;++i) {
+			const int x = from.x() + qRound(dx * i / float(steps));
+			const int y = from.y() + qRound(dy * i / float(steps));
+			if(!isSameColor(colorAt(x, y), oldColor))
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Calculate which pixels of a margin cell the fill may enter
+	 *
+	 * The allowed pixels are the morphological opening of the fillable area:
+	 * pixels further than the gap radius from any line that are connected to
+	 * the coarse fill, grown back by the same radius. A gap narrower than the
+	 * radius is removed by the erosion, so the fill cannot slip through it to the
+	 * other side of the line, but it still reaches all the way to the line itself.
+	 *
+	 * The calculation is done in a window extending one cell around the margin cell.
+	 *
+	 * @param cx margin cell column
+	 * @param cy margin cell row
+	 * @param startPoint fill seed point (always connected)
+	 * @param radius2 squared gap radius
+	 */
+	QBitArray marginMask(int cx, int cy, const QPoint &startPoint, float radius2)
+	{
+		const int cellSize = 1 << gapShift;
+		const QRect window = QRect((cx-1) << gapShift, (cy-1) << gapShift, 3*cellSize, 3*cellSize)
+			.intersected(QRect(0, 0, scratch.width(), scratch.height()));
+
+		const int W = window.width();
+		const int H = window.height();
+
+		auto inArea = [this, &window](int x, int y) {
+			return gapCells.at(((y + window.y()) >> gapShift) * gapColumns + ((x + window.x()) >> gapShift)) != GAP_OUTSIDE;
+		};
+
+		// Erode: distance to the nearest line pixel
+		QVector<float> distance(W * H);
+		for(int y=0;y<H;++y) {
+			for(int x=0;x<W;++x)
+				distance[y*W+x] = isSameColor(colorAt(x + window.x(), y + window.y()), oldColor) ? DISTANCE_INF : 0;
+		}
+		distanceTransform2D(distance.data(), W, H);
+
+		// Find the eroded area reachable from the coarse fill
+		QVector<quint8> reached(W * H, 0);
+		QStack<int> stack;
+
+		auto visit = [&](int x, int y) {
+			const int i = y*W + x;
+			if(!reached[i] && distance[i] > radius2 && inArea(x, y)) {
+				reached[i] = 1;
+				stack.push(i);
+			}
+		};
+
+		for(int y=0;y<H;++y) {
+			for(int x=0;x<W;++x) {
+				if(gapCells.at(((y + window.y()) >> gapShift) * gapColumns + ((x + window.x()) >> gapShift)) == GAP_INSIDE)
+					visit(x, y);
+			}
+		}
+
+		if(window.contains(startPoint)) {
+			const int i = (startPoint.y() - window.y()) * W + startPoint.x() - window.x();
+			if(!reached[i]) {
+				reached[i] = 1;
+				stack.push(i);
+			}
+		}
+
+		while(!stack.isEmpty()) {
+			const int i = stack.pop();
+			const int x = i % W;
+			const int y = i / W;
+			if(x>0) visit(x-1, y);
+			if(x<W-1) visit(x+1, y);
+			if(y>0) visit(x, y-1);
+			if(y<H-1) visit(x, y+1);
+		}
+
+		// Dilate: grow the reached area back by the same radius
+		for(int i=0;i<W*H;++i)
+			distance[i] = reached[i] ? 0 : DISTANCE_INF;
+		distanceTransform2D(distance.data(), W, H);
+
+		QBitArray mask(cellSize * cellSize);
+		const int x0 = (cx << gapShift) - window.x();
+		const int y0 = (cy << gapShift) - window.y();
+		const int x1 = qMin(x0 + cellSize, W);
+		const int y1 = qMin(y0 + cellSize, H);
+
+		for(int y=y0;y<y1;++y) {
+			for(int x=x0;x<x1;++x) {
+				if(distance[y*W+x] <= radius2)
+					mask.setBit(((y-y0) << gapShift) | (x-x0));
+			}
+		}
+
+		return mask;
+	}
+
+	/**
+	 * @brief Prepare the gap closing mask
+	 *
+	 * The fillable area is divided into a grid of cells large enough that
+	 * a whole cell cannot fit inside a gap of the given size. A cell is fillable
+	 * only if every pixel inside it is. The fill is first performed on this coarse
+	 * grid, and the full resolution fill is then limited to the reached cells plus
+	 * the parts of the surrounding cells that can be reached without passing
+	 * through a gap (see marginMask), so the final fill still extends all the way to the lines.
+	 *
+	 * Cells are checked only when the coarse fill reaches them, so tiles
+	 * far from the filled area are never fetched or flattened.
+	 *
+	 * If the seed point is too close to a line to start a coarse fill, the
+	 * nearest open cell reachable from it in a straight line is used instead.
+	 * If there is none, the seed is inside an area narrower than the gap
+	 * and the fill is limited to the seed's surroundings.
+	 */
+	void prepareGapMask(const QPoint &startPoint, int gap)
+	{
+		gapShift = 0;
+		while((1<<gapShift) <= gap)
+			++gapShift;
+
+		const int cellSize = 1 << gapShift;
+		const int cols = (scratch.width() + cellSize - 1) >> gapShift;
+		const int rows = (scratch.height() + cellSize - 1) >> gapShift;
+
+		enum { CELL_UNKNOWN, CELL_OPEN, CELL_BLOCKED, CELL_FILLED };
+		QVector<quint8> cells(cols * rows, CELL_UNKNOWN);
+
+		auto isOpen = [this, &cells, cols](int i) {
+			if(cells[i] == CELL_UNKNOWN)
+				cells[i] = isOpenCell(i % cols, i / cols) ? CELL_OPEN : CELL_BLOCKED;
+			return cells[i] == CELL_OPEN;
+		};
+
+		// Step 1: find a coarse seed cell
+		int seed = (startPoint.y() >> gapShift) * cols + (startPoint.x() >> gapShift);
+		bool seedOpen = isOpen(seed);
+
+		if(!seedOpen) {
+			const int scx = startPoint.x() >> gapShift;
+			const int scy = startPoint.y() >> gapShift;
+			int bestDist = -1;
+
+			for(int cy=qMax(0, scy-2);cy<=qMin(rows-1, scy+2);++cy) {
+				for(int cx=qMax(0, scx-2);cx<=qMin(cols-1, scx+2);++cx) {
+					const int i = cy*cols + cx;
+					if(!isOpen(i))
+						continue;
+
+					const QPoint center(
+						qMin((cx << gapShift) + cellSize/2, scratch.width()-1),
+						qMin((cy << gapShift) + cellSize/2, scratch.height()-1)
+					);
+					const int dist = (center - startPoint).manhattanLength();
+					if((bestDist < 0 || dist < bestDist) && isStraightPathOpen(startPoint, center)) {
+						bestDist = dist;
+						seed = i;
+						seedOpen = true;
+					}
+				}
+			}
+		}
+
+		// Step 2: flood fill the coarse grid
+		QStack<int> stack;
+		if(seedOpen) {
+			stack.push(seed);
+			cells[seed] = CELL_FILLED;
+		}
+
+		while(!stack.isEmpty()) {
+			const int i = stack.pop();
+			const int cx = i % cols;
+			const int cy = i / cols;
+
+			if(cx>0 && isOpen(i-1)) {
+				cells[i-1] = CELL_FILLED;
+				stack.push(i-1);
+			}
+			if(cx<cols-1 && isOpen(i+1)) {
+				cells[i+1] = CELL_FILLED;
+				stack.push(i+1);
+			}
+			if(cy>0 && isOpen(i-cols)) {
+				cells[i-cols] = CELL_FILLED;
+				stack.push(i-cols);
+			}
+			if(cy<rows-1 && isOpen(i+cols)) {
+				cells[i+cols] = CELL_FILLED;
+				stack.push(i+cols);
+			}
+		}
+
+		// Step 3: the full resolution fill may enter the filled cells and parts of their neighbours
+		gapColumns = cols;
+		gapCells = QVector<quint8>(cols * rows, GAP_OUTSIDE);
+		gapMargins.clear();
+
+		QVector<int> margins;
+		auto addMargin = [this, &margins](int i) {
+			if(gapCells[i] == GAP_OUTSIDE) {
+				gapCells[i] = GAP_MARGIN;
+				margins << i;
+			}
+		};
+
+		for(int i=0;i<cells.size();++i) {
+			if(cells[i] == CELL_FILLED)
+				gapCells[i] = GAP_INSIDE;
+		}
+
+		for(int cy=0;cy<rows;++cy) {
+			for(int cx=0;cx<cols;++cx) {
+				if(cells[cy*cols+cx] != CELL_FILLED)
+					continue;
+
+				for(int ny=qMax(0, cy-1);ny<=qMin(rows-1, cy+1);++ny)
+					for(int nx=qMax(0, cx-1);nx<=qMin(cols-1, cx+1);++nx)
+						addMargin(ny*cols + nx);
+			}
+		}
+
+		// The seed pixel's own cell is always included, even if the coarse fill started elsewhere
+		addMargin((startPoint.y() >> gapShift) * cols + (startPoint.x() >> gapShift));
+
+		const float radius = (gap + 1) / 2.0f;
+		for(const int i : margins)
+			gapMargins[i] = marginMask(i % cols, i / cols, startPoint, radius * radius);
 	}
 
-	void start(const QPoint &startPoint)
+	void start(const QPoint &startPoint, int gap)
 	{
 		oldColor = colorAt(startPoint.x(), startPoint.y());
 		if(qAlpha(fillColor) == 0) {
@@ -139,6 +433,9 @@ public:
 			layerSeedColor = sl->tile(tx, ty).pixel(x, y);
 		}
 
+		if(gap > 0)
+			prepareGapMask(startPoint, gap);
+
 		QStack<QPoint> stack;
 		stack.push(startPoint);
 
@@ -218,6 +515,13 @@ private:
 	// Maximum number of pixels to fill
 	unsigned int filledSize;
 	unsigned int sizelimit;
+
+	// Gap closing: coarse grid of cells the fill may enter (empty if not used)
+	// and the pixel masks of the partially enterable margin cells
+	QVector<quint8> gapCells;
+	QHash<int, QBitArray> gapMargins;
+	int gapShift;
+	int gapColumns;
 };
 
 /**
@@ -255,12 +559,95 @@ QRect findOpaqueBoundingRect(const QImage &image)
 	return QRect(QPoint(left, top), QPoint(right, bottom));
 }
 
+//! Location where the parabolas rooted at q and p intersect
+inline float parabolaIntersection(const float *f, int q, int p)
+{
+	return ((double(f[q]) + double(q)*q) - (double(f[p]) + double(p)*p)) / (2.0 * (q - p));
 }
 
-FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge, unsigned int sizelimit)
+/**
+ * @brief Squared euclidean distance transform of a one dimensional sampled function
+ *
+ * This is the lower envelope of parabolas algorithm from
+ * Felzenszwalb & Huttenlocher: "Distance Transforms of Sampled Functions".
+ * The running time is linear in the length of the input.
+ *
+ * @param f input function (n elements)
+ * @param d output distances (n elements)
+ * @param v scratch buffer for parabola locations (n elements)
+ * @param z scratch buffer for parabola boundaries (n+1 elements)
+ * @param n number of samples
+ */
+void distanceTransform1D(const float *f, float *d, int *v, float *z, int n)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -DISTANCE_INF;
+	z[1] = DISTANCE_INF;
+
+	for(int q=1;q<n;++q) {
+		float s = parabolaIntersection(f, q, v[k]);
+		while(s <= z[k]) {
+			--k;
+			s = parabolaIntersection(f, q, v[k]);
+		}
+		++k;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = DISTANCE_INF;
+	}
+
+	k = 0;
+	for(int q=0;q<n;++q) {
+		while(z[k+1] < q)
+			++k;
+		const float dq = q - v[k];
+		d[q] = dq*dq + f[v[k]];
+	}
+}
+
+/**
+ * @brief Squared euclidean distance transform of a two dimensional grid
+ *
+ * The transform is separable: first every column is transformed and then every row.
+ * The cost is linear in the area of the grid and independent of the distances involved.
+ *
+ * Input cells should be 0 for feature pixels and DISTANCE_INF for everything else.
+ *
+ * @param grid the grid to transform in place
+ * @param width grid width
+ * @param height grid height
+ */
+void distanceTransform2D(float *grid, int width, int height)
+{
+	const int n = qMax(width, height);
+	QVector<float> f(n), d(n), z(n+1);
+	QVector<int> v(n);
+
+	for(int x=0;x<width;++x) {
+		for(int y=0;y<height;++y)
+			f[y] = grid[y*width + x];
+
+		distanceTransform1D(f.constData(), d.data(), v.data(), z.data(), height);
+
+		for(int y=0;y<height;++y)
+			grid[y*width + x] = d[y];
+	}
+
+	for(int y=0;y<height;++y) {
+		float *row = grid + y*width;
+		memcpy(f.data(), row, width * sizeof(float));
+		distanceTransform1D(f.constData(), row, v.data(), z.data(), width);
+	}
+}
+
+}
+
+FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge, unsigned int sizelimit, int gap)
 {
 	Q_ASSERT(image);
 	Q_ASSERT(tolerance>=0);
+	Q_ASSERT(gap>=0);
 
 	if(!image->getLayer(layer))
 		return FillResult();
@@ -268,7 +655,7 @@ FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor
 	Floodfill fill(image, layer, merge, color, tolerance, sizelimit);
 
 	if(point.x() >=0 && point.x() < image->width() && point.y()>=0 && point.y() < image->height())
-		fill.start(point);
+		fill.start(point, qMin(gap, MAX_FILL_GAP));
 
 	return fill.result();
 }
@@ -312,48 +699,38 @@ FillResult expandFill(const FillResult &input, int expansion, const QColor &colo
 		BOUNDS.translate(D, D);
 	}
 
-	// Step 2. Generate convolution matrix for expanding the alpha channel
-	QVarLengthArray<int> kernel(D*D);
-	int i=0;
-	const int RR = R*R;
-	for(int y=0;y<D;++y) {
-		const int y0 = y-R;
-		for(int x=0;x<D;++x) {
-			const int x0 = x-R;
-			// TODO use a gaussian kernel?
-			kernel[i++] = x0*x0 + y0*y0 <= RR;
-		}
+	// Step 2. Compute the squared euclidean distance to the nearest filled pixel.
+	// Only the area within the expansion radius of the content needs to be examined.
+	const QRect expBounds = BOUNDS.adjusted(-R, -R, R, R);
+	Q_ASSERT(QRect(0, 0, inputImg.width(), inputImg.height()).contains(expBounds));
+
+	const int W = expBounds.width();
+	const int H = expBounds.height();
+
+	QVector<float> distance(W * H);
+	for(int y=0;y<H;++y) {
+		const uchar *alphaIn = inputImg.constScanLine(y + expBounds.top()) + expBounds.left()*4 + 3;
+		float *row = distance.data() + y*W;
+		for(int x=0;x<W;++x, alphaIn+=4)
+			row[x] = *alphaIn ? 0 : DISTANCE_INF;
 	}
-	Q_ASSERT(i==kernel.length());
+
+	distanceTransform2D(distance.data(), W, H);
 
 	// Step 3. Generate expanded image
 	out.image = QImage(inputImg.width(), inputImg.height(), inputImg.format());
 	out.image.fill(0);
 
-	const uchar *alphaIn = inputImg.bits()+3;
 	const QRgb fillColor = color.rgba();
-	quint32 *colorOut = reinterpret_cast<quint32*>(out.image.bits());
-
-	// Optimization: skip extra padding
-	QRect expBounds = BOUNDS.adjusted(-R, -R, R+1, R+1);
-	Q_ASSERT(QRect(0, 0, inputImg.width(), inputImg.height()).contains(expBounds));
-
-	for(int y=expBounds.top();y<expBounds.bottom();++y) {
-		for(int x=expBounds.left();x<expBounds.right();++x) {
-			int i=0, a=0;
-			for(int ky=y-R;ky<=y+R;++ky) {
-				for(int kx=x-R;kx<=x+R;++kx) {
-					a += alphaIn[ky*inputImg.bytesPerLine() + 4*kx] * kernel[i++];
-				}
-			}
-			Q_ASSERT(i==kernel.length());
+	const float RR = R*R;
 
+	for(int y=0;y<H;++y) {
+		const float *row = distance.constData() + y*W;
+		quint32 *colorOut = reinterpret_cast<quint32*>(out.image.scanLine(y + expBounds.top())) + expBounds.left();
+		for(int x=0;x<W;++x) {
 			// TODO adjustable threshold
-			if(a>0) {
-				int j = y*inputImg.width() + x;
-				Q_ASSERT(j <= out.image.width() * out.image.height());
-				colorOut[j] = fillColor;
-			}
+			if(row[x] <= RR)
+				colorOut[x] = fillColor;
 		}
 	}
 
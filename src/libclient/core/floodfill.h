@@ -26,6 +26,9 @@ namespace paintcore {
 
 class LayerStack;
 
+//! Largest supported gap closing size
+static const int MAX_FILL_GAP = 63;
+
 struct FillResult {
 	//! The fill bitmap.
 	QImage image;
@@ -57,9 +60,10 @@ struct FillResult {
  * @param layer the active layer
  * @param merge if true, use merged pixel values from all layers
  * @param sizelimit maximum number of pixels to color (aborts fill if exceeded)
+ * @param gap if nonzero, the fill will not leak through gaps in lines up to this many pixels wide
  * @return fill bitmap
  */
-FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge, unsigned int sizelimit);
+FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge, unsigned int sizelimit, int gap=0);
 
 /**
  * @brief Take a previous flood fill result and expand the filled area
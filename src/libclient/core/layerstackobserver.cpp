@@ -64,6 +64,17 @@ void LayerStackObserver::markDirty(const QRect &area)
 	if(m_layerstack->m_layers.isEmpty() || m_layerstack->m_width<=0 || m_layerstack->m_height<=0)
 		return;
 
+	markTilesDirty(area);
+	m_dirtyrect |= area;
+}
+
+void LayerStackObserver::markTilesDirty(const QRect &area)
+{
+	Q_ASSERT(m_layerstack);
+
+	if(m_layerstack->m_width<=0 || m_layerstack->m_height<=0)
+		return;
+
 	const int XT = m_layerstack->m_xtiles;
 	const int YT = m_layerstack->m_ytiles;
 
@@ -77,7 +88,6 @@ void LayerStackObserver::markDirty(const QRect &area)
 	for(;ty0<=ty1;++ty0) {
 		m_dirtytiles.fill(true, ty0*XT + tx0, ty0*XT + tx1);
 	}
-	m_dirtyrect |= area;
 }
 
 void LayerStackObserver::markDirty()
@@ -161,10 +171,23 @@ namespace {
 }
 
 void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *target)
+{
+	QPainter painter;
+
+	flattenChangedTiles(rect, [&painter, target](int x, int y, const QImage &tile) {
+		if(!painter.isActive()) {
+			painter.begin(target);
+			painter.setCompositionMode(QPainter::CompositionMode_Source);
+		}
+		painter.drawImage(x*Tile::SIZE, y*Tile::SIZE, tile);
+	});
+}
+
+bool LayerStackObserver::flattenChangedTiles(const QRect &rect, const FlattenedTileFunction &fn, int maxTiles)
 {
 	Q_ASSERT(m_layerstack);
-	if(m_layerstack->width() <=0 || m_layerstack->height() <= 0)
-		return;
+	if(m_layerstack->width() <=0 || m_layerstack->height() <= 0 || rect.isEmpty() || maxTiles == 0)
+		return maxTiles != 0;
 
 	// Affected tile range
 	const int tx0 = qBound(0, rect.left() / Tile::SIZE, m_layerstack->m_xtiles-1);
@@ -174,12 +197,17 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 
 	// Gather list of tiles in need of updating
 	QList<UpdateTile*> updates;
+	bool complete = true;
 
-	for(int ty=ty0;ty<=ty1;++ty) {
+	for(int ty=ty0;ty<=ty1 && complete;++ty) {
 		const int y = ty*m_layerstack->m_xtiles;
 		for(int tx=tx0;tx<=tx1;++tx) {
 			const int i = y+tx;
 			if(m_dirtytiles.testBit(i)) {
+				if(updates.size() == maxTiles) {
+					complete = false;
+					break;
+				}
 				updates.append(new UpdateTile(tx, ty));
 				m_dirtytiles.clearBit(i);
 			}
@@ -193,14 +221,12 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 			m_layerstack->flattenTile(t->data, t->x, t->y);
 		});
 
-		// Paint flattened tiles
-		QPainter painter(target);
-		painter.setCompositionMode(QPainter::CompositionMode_Source);
+		// Hand over the flattened tiles
 		while(!updates.isEmpty()) {
 			UpdateTile *ut = updates.takeLast();
-			painter.drawImage(
-				ut->x*Tile::SIZE,
-				ut->y*Tile::SIZE,
+			fn(
+				ut->x,
+				ut->y,
 				QImage(reinterpret_cast<const uchar*>(ut->data),
 					Tile::SIZE, Tile::SIZE,
 					QImage::Format_ARGB32_Premultiplied
@@ -209,6 +235,8 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 			delete ut;
 		}
 	}
+
+	return complete;
 }
 
 }
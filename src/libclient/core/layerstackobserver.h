@@ -25,7 +25,10 @@
 #include <QBitArray>
 #include <QRect>
 
+#include <functional>
+
 class QPaintDevice;
+class QImage;
 
 namespace paintcore {
 
@@ -97,6 +100,30 @@ protected:
 	 */
 	void paintChangedTiles(const QRect &rect, QPaintDevice *target);
 
+	//! Callback for receiving a freshly flattened tile: tile column, row and content
+	typedef std::function<void(int, int, const QImage&)> FlattenedTileFunction;
+
+	/**
+	 * @brief Flatten changed tiles in the given region
+	 *
+	 * The dirty flag will be cleared for each flattened tile and the
+	 * tile will be passed to the callback function.
+	 *
+	 * @param rect
+	 * @param fn
+	 * @param maxTiles maximum number of tiles to flatten (-1 for no limit)
+	 * @return false if the limit was reached and some tiles may still be dirty
+	 */
+	bool flattenChangedTiles(const QRect &rect, const FlattenedTileFunction &fn, int maxTiles=-1);
+
+	/**
+	 * @brief Mark the tiles under the area dirty without reporting them as changed
+	 *
+	 * This is used when a cached copy of the tiles has been discarded and
+	 * must be repainted the next time it is needed.
+	 */
+	void markTilesDirty(const QRect &area);
+
 private:
 	LayerStack *m_layerstack;
 	Tile m_paintBackgroundTile;
@@ -20,36 +20,302 @@
 #include "layerstackpixmapcacheobserver.h"
 #include "layerstack.h"
 
+#include <QPainter>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QtMath>
+#include <algorithm>
+
 namespace paintcore {
 
+namespace {
+
+//! Downsample a premultiplied ARGB image to half its size by averaging 2x2 blocks
+QImage halveImage(const QImage &image)
+{
+	Q_ASSERT(image.format() == QImage::Format_ARGB32_Premultiplied);
+
+	QImage out(image.width() / 2, image.height() / 2, QImage::Format_ARGB32_Premultiplied);
+
+	for(int y=0;y<out.height();++y) {
+		const quint32 *row0 = reinterpret_cast<const quint32*>(image.constScanLine(y*2));
+		const quint32 *row1 = reinterpret_cast<const quint32*>(image.constScanLine(y*2+1));
+		quint32 *o = reinterpret_cast<quint32*>(out.scanLine(y));
+
+		for(int x=0;x<out.width();++x, row0+=2, row1+=2) {
+			// Average two channels at a time
+			const quint32 rb =
+				(row0[0] & 0x00ff00ff) + (row0[1] & 0x00ff00ff) +
+				(row1[0] & 0x00ff00ff) + (row1[1] & 0x00ff00ff) + 0x00020002;
+			const quint32 ag =
+				((row0[0] >> 8) & 0x00ff00ff) + ((row0[1] >> 8) & 0x00ff00ff) +
+				((row1[0] >> 8) & 0x00ff00ff) + ((row1[1] >> 8) & 0x00ff00ff) + 0x00020002;
+
+			o[x] = ((rb >> 2) & 0x00ff00ff) | (((ag >> 2) & 0x00ff00ff) << 8);
+		}
+	}
+
+	return out;
+}
+
+}
+
 LayerStackPixmapCacheObserver::LayerStackPixmapCacheObserver(QObject *parent)
-	: QObject(parent), LayerStackObserver()
+	: QObject(parent), LayerStackObserver(),
+	  m_cacheSize(0), m_cacheLimit(256 * 1024 * 1024), m_paintCounter(0)
+{
+	m_idleTimer = new QTimer(this);
+	m_idleTimer->setSingleShot(true);
+	m_idleTimer->setInterval(0);
+	connect(m_idleTimer, &QTimer::timeout, this, &LayerStackPixmapCacheObserver::idleRefresh);
+
+	// Chunk positions are no longer valid after a resize
+	connect(this, &LayerStackPixmapCacheObserver::resized, this, &LayerStackPixmapCacheObserver::clearCache);
+
+	// Changes outside the view may need to be refreshed in the background
+	connect(this, &LayerStackPixmapCacheObserver::areaChanged, m_idleTimer, QOverload<>::of(&QTimer::start));
+
+	for(Level &l : m_levels)
+		l.columns = 0;
+}
+
+void LayerStackPixmapCacheObserver::setCacheLimit(qint64 bytes)
+{
+	m_cacheLimit = bytes;
+	evictChunks();
+}
+
+void LayerStackPixmapCacheObserver::clearCache()
+{
+	const int width = layerStack() ? layerStack()->width() : 0;
+
+	for(int i=0;i<MIPMAP_LEVELS;++i) {
+		const int span = CHUNK_SIZE << i;
+		m_levels[i].chunks.clear();
+		m_levels[i].columns = (width + span - 1) / span;
+	}
+	m_cacheSize = 0;
+}
+
+QRect LayerStackPixmapCacheObserver::chunkCanvasRect(int level, int cx, int cy) const
+{
+	const int span = CHUNK_SIZE << level;
+	return QRect(cx * span, cy * span, span, span) & QRect(QPoint(), layerStack()->size());
+}
+
+LayerStackPixmapCacheObserver::Chunk &LayerStackPixmapCacheObserver::chunk(int level, int cx, int cy)
+{
+	Level &l = m_levels[level];
+	const int key = cy * l.columns + cx;
+
+	auto i = l.chunks.find(key);
+	if(i == l.chunks.end()) {
+		// A new chunk must be painted fully, regardless of what was painted
+		// into the chunk that may have previously been here.
+		const QRect canvasRect = chunkCanvasRect(level, cx, cy);
+		markTilesDirty(canvasRect);
+		m_idleTimer->start();
+
+		const QSize size {
+			((canvasRect.right() >> level) & (CHUNK_SIZE-1)) + 1,
+			((canvasRect.bottom() >> level) & (CHUNK_SIZE-1)) + 1
+		};
+
+		Chunk c;
+		c.pixmap = QPixmap(size);
+		c.pixmap.fill();
+		c.lastUsed = 0;
+		m_cacheSize += qint64(size.width()) * size.height() * 4;
+		i = l.chunks.insert(key, c);
+	}
+
+	return i.value();
+}
+
+void LayerStackPixmapCacheObserver::paintTile(int tx, int ty, const QImage &tile)
 {
+	// Find the highest level that has any chunks that may need updating
+	int topLevel = MIPMAP_LEVELS-1;
+	while(topLevel>0 && m_levels[topLevel].chunks.isEmpty())
+		--topLevel;
+
+	QImage image = tile;
+	for(int level=0;level<=topLevel;++level) {
+		if(level>0)
+			image = halveImage(image);
+
+		const int x = (tx * Tile::SIZE) >> level;
+		const int y = (ty * Tile::SIZE) >> level;
+
+		Level &l = m_levels[level];
+		auto c = l.chunks.find((y / CHUNK_SIZE) * l.columns + x / CHUNK_SIZE);
+		if(c == l.chunks.end())
+			continue;
+
+		QPainter chunkPainter(&c.value().pixmap);
+		chunkPainter.setCompositionMode(QPainter::CompositionMode_Source);
+		chunkPainter.drawImage(x % CHUNK_SIZE, y % CHUNK_SIZE, image);
+	}
 }
 
-const QPixmap &LayerStackPixmapCacheObserver::getPixmap()
+void LayerStackPixmapCacheObserver::paint(QPainter *painter, const QRectF &target, const QRect &source, bool lowPriority, int minLevel)
 {
 	if(!layerStack())
-		return m_cache;
+		return;
+
+	const QRect area = source & QRect(QPoint(), layerStack()->size());
+	if(area.isEmpty())
+		return;
+
+	++m_paintCounter;
+	++m_stats.paints;
+
+	const qreal sx = target.width() / source.width();
+	const qreal sy = target.height() / source.height();
+
+	// Pick the mipmap level
+	const qreal scale = qMax(sx, sy) * qSqrt(qAbs(painter->worldTransform().determinant()));
+	int level = qBound(0, minLevel, MIPMAP_LEVELS-1);
+	while(level < MIPMAP_LEVELS-1 && scale <= 0.5 / (1<<level))
+		++level;
+
+	const int span = CHUNK_SIZE << level;
+	const int cx0 = area.left() / span;
+	const int cx1 = area.right() / span;
+	const int cy0 = area.top() / span;
+	const int cy1 = area.bottom() / span;
+
+	// Make sure all the needed chunks exist
+	for(int cy=cy0;cy<=cy1;++cy) {
+		for(int cx=cx0;cx<=cx1;++cx)
+			chunk(level, cx, cy).lastUsed = m_paintCounter;
+	}
+
+	// Refresh changed tiles in the area to be painted
+	if(!lowPriority) {
+		const bool complete = timedFlatten(area, [this](int tx, int ty, const QImage &tile) {
+			paintTile(tx, ty, tile);
+		}, FRAME_TILE_BUDGET);
+
+		// Over budget: continue in the next frame
+		if(!complete)
+			emit areaChanged(area);
+	}
+
+	// Paint the chunks
+	const Level &l = m_levels[level];
+	const QRect levelArea {
+		QPoint(area.left() >> level, area.top() >> level),
+		QPoint(area.right() >> level, area.bottom() >> level)
+	};
+
+	for(int cy=cy0;cy<=cy1;++cy) {
+		for(int cx=cx0;cx<=cx1;++cx) {
+			const Chunk &c = l.chunks[cy * l.columns + cx];
+			const QRect chunkRect = QRect(QPoint(cx * CHUNK_SIZE, cy * CHUNK_SIZE), c.pixmap.size()) & levelArea;
+
+			painter->drawPixmap(
+				QRectF(
+					target.x() + ((chunkRect.x() << level) - source.x()) * sx,
+					target.y() + ((chunkRect.y() << level) - source.y()) * sy,
+					(chunkRect.width() << level) * sx,
+					(chunkRect.height() << level) * sy
+				),
+				c.pixmap,
+				QRectF(chunkRect.translated(-cx * CHUNK_SIZE, -cy * CHUNK_SIZE))
+			);
+		}
+	}
 
-	return getPixmap(QRect(QPoint(), layerStack()->size()));
+	evictChunks();
 }
 
-const QPixmap &LayerStackPixmapCacheObserver::getPixmap(const QRect &refreshArea)
+bool LayerStackPixmapCacheObserver::timedFlatten(const QRect &rect, const FlattenedTileFunction &fn, int maxTiles)
+{
+	QElapsedTimer timer;
+	timer.start();
+
+	const bool complete = flattenChangedTiles(rect, [this, &fn](int tx, int ty, const QImage &tile) {
+		++m_stats.flattenedTiles;
+		fn(tx, ty, tile);
+	}, maxTiles);
+
+	m_stats.flattenTime += timer.nsecsElapsed();
+	return complete;
+}
+
+LayerStackPixmapCacheObserver::PaintStats LayerStackPixmapCacheObserver::takePaintStats()
+{
+	const PaintStats stats = m_stats;
+	m_stats = PaintStats();
+	return stats;
+}
+
+void LayerStackPixmapCacheObserver::idleRefresh()
 {
 	if(!layerStack())
-		return m_cache;
+		return;
 
-	const QSize size = layerStack()->size();
+	int budget = IDLE_TILE_BUDGET;
+	QRect refreshed;
 
-	if((m_cache.isNull() || m_cache.size() != size) && size.isValid()) {
-		m_cache = QPixmap(size);
-		m_cache.fill();
+	const auto fn = [this, &budget, &refreshed](int tx, int ty, const QImage &tile) {
+		paintTile(tx, ty, tile);
+		refreshed |= QRect(tx * Tile::SIZE, ty * Tile::SIZE, Tile::SIZE, Tile::SIZE);
+		--budget;
+	};
+
+	// Refresh the changed tiles of cached chunks, full resolution level first
+	for(int level=0;level<MIPMAP_LEVELS && budget>0;++level) {
+		const Level &l = m_levels[level];
+		for(auto i=l.chunks.constBegin();i!=l.chunks.constEnd() && budget>0;++i) {
+			const QRect rect = chunkCanvasRect(level, i.key() % l.columns, i.key() / l.columns);
+			timedFlatten(rect, fn, budget);
+		}
 	}
 
-	paintChangedTiles(refreshArea & m_cache.rect(), &m_cache);
+	// Out of budget: there may be more left to do
+	if(budget <= 0)
+		m_idleTimer->start();
 
-	return m_cache;
+	if(!refreshed.isEmpty())
+		emit cacheRefreshed(refreshed & QRect(QPoint(), layerStack()->size()));
+}
+
+void LayerStackPixmapCacheObserver::evictChunks()
+{
+	if(m_cacheSize <= m_cacheLimit)
+		return;
+
+	struct LruEntry {
+		quint64 lastUsed;
+		int level;
+		int key;
+		bool operator<(const LruEntry &other) const { return lastUsed < other.lastUsed; }
+	};
+
+	QVector<LruEntry> lru;
+	for(int level=0;level<MIPMAP_LEVELS;++level) {
+		const Level &l = m_levels[level];
+		for(auto i=l.chunks.constBegin();i!=l.chunks.constEnd();++i)
+			lru << LruEntry { i.value().lastUsed, level, i.key() };
+	}
+
+	// Chunks used in the latest paint call sort last, but are evicted too
+	// if they alone don't fit in the cache. Otherwise painting a large area
+	// at full resolution could grow the cache without bound.
+	std::sort(lru.begin(), lru.end());
+
+	for(const LruEntry &entry : lru) {
+		if(m_cacheSize <= m_cacheLimit)
+			break;
+
+		QHash<int, Chunk> &chunks = m_levels[entry.level].chunks;
+		const QPixmap &pixmap = chunks[entry.key].pixmap;
+		m_cacheSize -= qint64(pixmap.width()) * pixmap.height() * 4;
+		chunks.remove(entry.key);
+	}
 }
 
 }
@@ -23,31 +23,134 @@
 
 #include <QObject>
 #include <QPixmap>
+#include <QHash>
+
+class QPainter;
+class QTimer;
 
 namespace paintcore {
 
+/**
+ * @brief A layer stack observer that keeps a pixmap cache of the flattened canvas
+ *
+ * The cache is split into chunks that are created on demand when
+ * the area they cover is painted. When the total size of the cached chunks
+ * exceeds the cache limit, the least recently used ones are discarded.
+ *
+ * In addition to the full resolution cache, downscaled mipmap levels are
+ * kept for painting the canvas when zoomed out. Each level is half the
+ * resolution of the previous one. Whenever a tile is flattened, it is
+ * downsampled into every cached chunk of every level that covers it.
+ *
+ * Visible tiles are flattened when painted, up to a per-frame budget.
+ * Changed tiles in cached chunks outside the view are refreshed in small
+ * batches when the event loop is idle. Changed tiles not in any cached
+ * chunk are not flattened at all until they are needed.
+ */
 class LayerStackPixmapCacheObserver : public QObject, public LayerStackObserver
 {
 	Q_OBJECT
 public:
+	//! Width and height of a cache chunk in pixels
+	static const int CHUNK_SIZE = Tile::SIZE * 4;
+
+	//! Number of cache levels (including the full resolution level)
+	static const int MIPMAP_LEVELS = 6;
+
+	//! Maximum number of tiles to flatten per paint call
+	static const int FRAME_TILE_BUDGET = 1024;
+
+	//! Maximum number of tiles to flatten per background refresh batch
+	static const int IDLE_TILE_BUDGET = 32;
+
 	explicit LayerStackPixmapCacheObserver(QObject *parent=nullptr);
 
 	/**
-	 * @brief Get a reference to the underlying cache pixmap while makign sure at least the given area has been refreshed
-	 * @param refreshArea
-	 * @return
+	 * @brief Paint the canvas
+	 *
+	 * The chunks needed to paint the source area are created and
+	 * refreshed if needed. The lowest resolution mipmap level that still
+	 * has at least as many pixels as the target (taking the painter's transform
+	 * into account) is used, but never a level finer than minLevel.
+	 *
+	 * If more than FRAME_TILE_BUDGET tiles need refreshing, the rest are
+	 * left for the next frame and areaChanged is emitted for the area.
+	 *
+	 * In low priority mode, no tiles are flattened immediately. Instead, the
+	 * current cache content is painted and the changed tiles are refreshed in
+	 * the background. cacheRefreshed is emitted when that happens.
+	 *
+	 * @param painter the painter to use
+	 * @param target the target rectangle in painter coordinates
+	 * @param source the canvas area to paint
+	 * @param lowPriority if true, defer refreshing to idle time
+	 * @param minLevel the full resolution level to use at most
+	 */
+	void paint(QPainter *painter, const QRectF &target, const QRect &source, bool lowPriority=false, int minLevel=0);
+
+	//! Paint the given area of the canvas at the same coordinates
+	void paint(QPainter *painter, const QRect &area) { paint(painter, area, area); }
+
+	/**
+	 * @brief Set the maximum size of the cache
+	 *
+	 * Chunks used in the latest paint call are discarded last, but the
+	 * cache is always trimmed down to the limit. If a single paint needs
+	 * more than that, its chunks are recreated on the next paint.
+	 *
+	 * @param bytes
 	 */
-	const QPixmap &getPixmap(const QRect &refreshArea);
+	void setCacheLimit(qint64 bytes);
 
-	//! Get a reference to the underlying cache pixmap while making sure the whole pixmap is refreshed
-	const QPixmap &getPixmap();
+	//! Get the total size of the currently cached chunks
+	qint64 cacheSize() const { return m_cacheSize; }
+
+	struct PaintStats {
+		//! Number of paint calls
+		int paints = 0;
+
+		//! Number of tiles flattened (in the foreground and background)
+		int flattenedTiles = 0;
+
+		//! Time spent flattening tiles (in nanoseconds)
+		qint64 flattenTime = 0;
+	};
+
+	//! Get the paint statistics gathered since the previous call
+	PaintStats takePaintStats();
 
 signals:
 	void areaChanged(const QRect &area) override;
 	void resized(int xoffset, int yoffset, const QSize &oldSize) override;
 
+	//! Cached content in the given area was refreshed in the background
+	void cacheRefreshed(const QRect &area);
+
 private:
-	QPixmap m_cache;
+	struct Chunk {
+		QPixmap pixmap;
+		quint64 lastUsed;
+	};
+
+	struct Level {
+		QHash<int, Chunk> chunks;
+		int columns;
+	};
+
+	QRect chunkCanvasRect(int level, int cx, int cy) const;
+	Chunk &chunk(int level, int cx, int cy);
+	void paintTile(int tx, int ty, const QImage &tile);
+	void evictChunks();
+	void clearCache();
+	void idleRefresh();
+	bool timedFlatten(const QRect &rect, const FlattenedTileFunction &fn, int maxTiles);
+
+	Level m_levels[MIPMAP_LEVELS];
+	qint64 m_cacheSize;
+	qint64 m_cacheLimit;
+	quint64 m_paintCounter;
+	QTimer *m_idleTimer;
+	PaintStats m_stats;
 };
 
 }
@@ -135,6 +135,11 @@ public:
 	 */
 	bool serverSupportsReports() const { return m_server->supportsAbuseReports(); }
 
+	/**
+	 * @brief Can stroke latency tracing marks be sent to the server?
+	 */
+	bool serverSupportsLatencyTracing() const { return m_server->supportsLatencyTracing(); }
+
 	bool sessionSupportsAutoReset() const { return m_supportsAutoReset; }
 
 	/**
@@ -143,6 +148,9 @@ public:
 	 */
 	int uploadQueueBytes() const;
 
+	//! Get per message type traffic statistics of the current connection
+	protocol::TrafficStats trafficStats() const { return m_server->trafficStats(); }
+
 	//! Are we expecting more incoming data?
 	bool isFullyCaughtUp() const { return m_catchupTo == 0; }
 
@@ -0,0 +1,256 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "latencytracer.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QSet>
+#include <QStringList>
+
+#include <algorithm>
+#include <cstring>
+
+namespace net {
+
+using protocol::TraceMark;
+
+// Minimum time between two trace marks (in microseconds)
+static const qint64 TRACE_INTERVAL = 100 * 1000;
+
+// Max. number of completed traces to keep
+static const int MAX_TRACES = 10000;
+
+LatencyTracer *LatencyTracer::s_active = nullptr;
+
+LatencyTracer::Trace::Trace()
+	: user(0), id(0)
+{
+	memset(stamps, 0, sizeof(stamps));
+}
+
+LatencyTracer::LatencyTracer()
+	: m_localUser(0), m_lastId(0), m_lastMarkTime(0)
+{
+}
+
+void LatencyTracer::setEnabled(bool enable)
+{
+	if(enable && !s_active) {
+		s_active = new LatencyTracer;
+	} else if(!enable && s_active) {
+		delete s_active;
+		s_active = nullptr;
+	}
+}
+
+void LatencyTracer::traceStroke(uint8_t user, qint64 penEventTime, protocol::MessageList &messages)
+{
+	if(messages.isEmpty())
+		return;
+
+	const qint64 now = TraceMark::timestamp();
+	if(now - m_lastMarkTime < TRACE_INTERVAL)
+		return;
+
+	m_localUser = user;
+	m_lastMarkTime = now;
+
+	messages.prepend(protocol::MessagePtr(new TraceMark(user, ++m_lastId, QVector<TraceMark::Stamp>()
+		<< TraceMark::Stamp { TraceMark::PenEvent, penEventTime }
+		<< TraceMark::Stamp { TraceMark::DabsTaken, now }
+	)));
+}
+
+void LatencyTracer::markReceived(const TraceMark &mark)
+{
+	// A previous trace still waiting for its command is superseded
+	Pending p;
+	p.trace.user = mark.contextId();
+	p.trace.id = mark.traceId();
+	for(const TraceMark::Stamp &s : mark.stamps())
+		p.trace.stamps[s.stage] = s.time;
+	p.command = nullptr;
+
+	m_pending[mark.contextId()] = p;
+}
+
+void LatencyTracer::commandReceived(const protocol::Message &msg)
+{
+	auto i = m_pending.find(msg.contextId());
+	if(i == m_pending.end() || i->command)
+		return;
+
+	i->trace.stamps[TraceMark::Received] = TraceMark::timestamp();
+
+	if(msg.contextId() == m_localUser) {
+		// Our own commands were already executed by the local fork,
+		// so the trace ends at the round trip
+		complete(i->trace);
+		m_pending.erase(i);
+	} else {
+		i->command = &msg;
+	}
+}
+
+void LatencyTracer::commandExecuted(const protocol::Message &msg)
+{
+	auto i = m_pending.find(msg.contextId());
+	if(i == m_pending.end() || i->command != &msg)
+		return;
+
+	i->trace.stamps[TraceMark::Executed] = TraceMark::timestamp();
+	m_executed << i->trace;
+	m_pending.erase(i);
+}
+
+void LatencyTracer::canvasPainted()
+{
+	if(m_executed.isEmpty())
+		return;
+
+	const qint64 now = TraceMark::timestamp();
+	for(Trace &t : m_executed) {
+		t.stamps[TraceMark::Painted] = now;
+		complete(t);
+	}
+	m_executed.clear();
+}
+
+void LatencyTracer::complete(const Trace &trace)
+{
+	if(m_completed.size() >= MAX_TRACES)
+		m_completed.remove(0, MAX_TRACES / 10);
+	m_completed << trace;
+}
+
+static QString formatDuration(qint64 usecs)
+{
+	return QStringLiteral("%1 ms").arg(usecs / 1000.0, 0, 'f', 1);
+}
+
+QString LatencyTracer::report() const
+{
+	if(m_completed.isEmpty())
+		return QStringLiteral("No traces yet");
+
+	// Durations between consecutive stages (and from the first stage to the last)
+	QMap<QPair<int,int>, QVector<qint64>> segments;
+	QMap<QPair<int,int>, QVector<qint64>> totals;
+
+	for(const Trace &t : m_completed) {
+		int first = -1, prev = -1;
+		for(int s=0;s<TraceMark::STAGE_COUNT;++s) {
+			if(!t.stamps[s])
+				continue;
+			if(prev >= 0)
+				segments[qMakePair(prev, s)] << t.stamps[s] - t.stamps[prev];
+			else
+				first = s;
+			prev = s;
+		}
+		if(first >= 0 && prev > first)
+			totals[qMakePair(first, prev)] << t.stamps[prev] - t.stamps[first];
+	}
+
+	QStringList lines;
+	lines << QStringLiteral("%1 traces").arg(m_completed.size());
+
+	auto describe = [&lines](const QMap<QPair<int,int>, QVector<qint64>> &durations) {
+		for(auto i=durations.constBegin();i!=durations.constEnd();++i) {
+			QVector<qint64> d = i.value();
+			std::sort(d.begin(), d.end());
+			lines << QStringLiteral("%1 -> %2: median %3, 95%: %4 (%5)").arg(
+				TraceMark::stageName(Stage(i.key().first)),
+				TraceMark::stageName(Stage(i.key().second)),
+				formatDuration(d.at(d.size() / 2)),
+				formatDuration(d.at(qMin(d.size()-1, d.size() * 95 / 100))),
+				QString::number(d.size())
+			);
+		}
+	};
+
+	describe(segments);
+	lines << QString();
+	describe(totals);
+
+	return lines.join('\n');
+}
+
+QJsonDocument LatencyTracer::chromeTrace() const
+{
+	// Each stroke sender is shown as a process and each stage
+	// of a trace as an async slice
+	QJsonArray events;
+	QSet<uint8_t> users;
+
+	for(const Trace &t : m_completed) {
+		if(!users.contains(t.user)) {
+			users.insert(t.user);
+			events << QJsonObject {
+				{"name", "process_name"},
+				{"ph", "M"},
+				{"pid", t.user},
+				{"args", QJsonObject { {"name", QStringLiteral("User %1").arg(t.user)} }}
+			};
+		}
+
+		const QString id = QStringLiteral("%1.%2").arg(t.user).arg(t.id);
+		int prev = -1;
+		for(int s=0;s<TraceMark::STAGE_COUNT;++s) {
+			if(!t.stamps[s])
+				continue;
+
+			if(prev >= 0) {
+				const QString name = QStringLiteral("%1 -> %2").arg(
+					TraceMark::stageName(Stage(prev)),
+					TraceMark::stageName(Stage(s))
+				);
+				events << QJsonObject {
+					{"name", name},
+					{"cat", "stroke"},
+					{"ph", "b"},
+					{"id", id},
+					{"pid", t.user},
+					{"tid", 0},
+					{"ts", double(t.stamps[prev])}
+				};
+				events << QJsonObject {
+					{"name", name},
+					{"cat", "stroke"},
+					{"ph", "e"},
+					{"id", id},
+					{"pid", t.user},
+					{"tid", 0},
+					{"ts", double(t.stamps[s])}
+				};
+			}
+			prev = s;
+		}
+	}
+
+	return QJsonDocument(QJsonObject {
+		{"traceEvents", events},
+		{"displayTimeUnit", "ms"}
+	});
+}
+
+}
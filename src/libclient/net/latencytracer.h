@@ -0,0 +1,123 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_LATENCYTRACER_H
+#define DP_NET_LATENCYTRACER_H
+
+#include "../libshared/net/meta2.h"
+
+#include <QHash>
+#include <QVector>
+
+class QJsonDocument;
+
+namespace net {
+
+/**
+ * @brief End to end stroke latency tracer
+ *
+ * When enabled, the freehand tool occasionally tags an outgoing stroke with
+ * a TraceMark message. The server stamps the mark when relaying it and the
+ * receiving clients time the reception, execution and display of the drawing
+ * command that follows it. Our own marks come back from the server too, so
+ * the round trip time is traced as well.
+ *
+ * Tracing must be enabled on each client whose view of the strokes is wanted.
+ * Marks are only sent to servers that list the TRACE capability flag.
+ * All functions must be called from the GUI thread.
+ */
+class LatencyTracer {
+public:
+	typedef protocol::TraceMark::Stage Stage;
+
+	//! A (possibly incomplete) trace of a single stroke segment
+	struct Trace {
+		uint8_t user;
+		quint32 id;
+		qint64 stamps[protocol::TraceMark::STAGE_COUNT]; // zero if the stage was not seen
+
+		Trace();
+	};
+
+	//! Get the tracer if tracing is enabled, or nullptr if not
+	static LatencyTracer *active() { return s_active; }
+
+	//! Enable or disable tracing. Disabling discards the collected traces.
+	static void setEnabled(bool enable);
+
+	/**
+	 * @brief Tag an outgoing stroke segment
+	 *
+	 * A trace mark is prepended to the messages if enough time has passed
+	 * since the previous one.
+	 *
+	 * @param user the local user's ID
+	 * @param penEventTime when the input event was received (TraceMark::timestamp())
+	 * @param messages the drawing commands about to be sent
+	 */
+	void traceStroke(uint8_t user, qint64 penEventTime, protocol::MessageList &messages);
+
+	//! A trace mark was received
+	void markReceived(const protocol::TraceMark &mark);
+
+	//! A drawing command was received
+	void commandReceived(const protocol::Message &msg);
+
+	//! A drawing command was executed
+	void commandExecuted(const protocol::Message &msg);
+
+	//! The canvas was repainted
+	void canvasPainted();
+
+	//! Get the completed traces
+	const QVector<Trace> &traces() const { return m_completed; }
+
+	/**
+	 * @brief Get a human readable breakdown of the traced latencies
+	 *
+	 * For each pair of consecutive stages, the median and the 95th
+	 * percentile of the time taken are listed.
+	 */
+	QString report() const;
+
+	//! Get the completed traces in Chrome's trace event format
+	QJsonDocument chromeTrace() const;
+
+private:
+	struct Pending {
+		Trace trace;
+		const protocol::Message *command; // the command being traced (once received)
+	};
+
+	LatencyTracer();
+	void complete(const Trace &trace);
+
+	static LatencyTracer *s_active;
+
+	QHash<uint8_t, Pending> m_pending; // per user traces waiting for their command to be executed
+	QVector<Trace> m_executed;       // waiting for the canvas to be repainted
+	QVector<Trace> m_completed;
+
+	uint8_t m_localUser;
+	quint32 m_lastId;
+	qint64 m_lastMarkTime;
+};
+
+}
+
+#endif
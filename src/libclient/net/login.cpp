@@ -25,6 +25,7 @@
 
 #include "../libshared/net/protover.h"
 #include "../libshared/net/control.h"
+#include "../libshared/net/messagequeue.h"
 #include "../libshared/util/networkaccess.h"
 #include "../libshared/util/paths.h"
 
@@ -38,6 +39,7 @@
 #include <QNetworkReply>
 #include <QImage>
 #include <QBuffer>
+#include <QSettings>
 
 #define DEBUG_LOGIN
 
@@ -70,6 +72,9 @@ LoginHandler::LoginHandler(Mode mode, const QUrl &url, QObject *parent)
 	  m_needUserPassword(false),
 	  m_supportsCustomAvatars(false),
 	  m_supportsExtAuthAvatars(false),
+	  m_supportsCompression(false),
+	  m_supportsLatencyTracing(false),
+	  m_compressionLevel(0),
 	  m_isGuest(true)
 {
 	m_sessions = new LoginSessionModel(this);
@@ -133,6 +138,7 @@ void LoginHandler::receiveMessage(protocol::MessagePtr message)
 	switch(m_state) {
 	case EXPECT_HELLO: expectHello(msg); break;
 	case EXPECT_STARTTLS: expectStartTls(msg); break;
+	case EXPECT_COMPRESS: expectCompress(msg); break;
 	case WAIT_FOR_LOGIN_PASSWORD:
 	case WAIT_FOR_EXTAUTH:
 		expectNothing(msg); break;
@@ -174,6 +180,7 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 	m_needUserPassword = false;
 	m_canPersist = false;
 	m_canReport = false;
+	m_supportsLatencyTracing = false;
 
 	bool startTls = false;
 
@@ -192,6 +199,10 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 			m_canReport = true;
 		} else if(flag == "AVATAR") {
 			m_supportsCustomAvatars = true;
+		} else if(flag == "DEFLATE") {
+			m_supportsCompression = true;
+		} else if(flag == "TRACE") {
+			m_supportsLatencyTracing = true;
 		} else {
 			qWarning() << "Unknown server capability:" << flag;
 		}
@@ -212,7 +223,7 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 			return;
 		}
 
-		prepareToSendIdentity();
+		requestCompression();
 	}
 }
 
@@ -227,6 +238,41 @@ void LoginHandler::expectStartTls(const protocol::ServerReply &msg)
 	}
 }
 
+void LoginHandler::requestCompression()
+{
+	const int level = QSettings().value("settings/server/compression", 6).toInt();
+
+	if(m_supportsCompression && level > 0 && protocol::MessageQueue::isCompressionSupported()) {
+		m_state = EXPECT_COMPRESS;
+		m_compressionLevel = level;
+
+		protocol::ServerCommand cmd;
+		cmd.cmd = "compress";
+		cmd.args.append("deflate");
+		send(cmd);
+
+	} else {
+		prepareToSendIdentity();
+	}
+}
+
+void LoginHandler::expectCompress(const protocol::ServerReply &msg)
+{
+	if(msg.reply["compress"].toString() == "deflate") {
+		// The server sends nothing after the reply until we send something,
+		// so the rest of the stream is compressed in both directions.
+		if(!m_server->m_msgqueue->startCompression(m_compressionLevel)) {
+			failLogin(tr("Couldn't start compression"));
+			return;
+		}
+		prepareToSendIdentity();
+
+	} else {
+		qWarning() << "Login error. Expected compress, got:" << msg.reply;
+		failLogin(tr("Incompatible server"));
+	}
+}
+
 void LoginHandler::sendSessionPassword(const QString &password)
 {
 	if(m_state == WAIT_FOR_JOIN_PASSWORD) {
@@ -758,8 +804,8 @@ void LoginHandler::acceptServerCertificate()
 void LoginHandler::continueTls()
 {
 	// STARTTLS is the very first command that must be sent, if sent at all
-	// Next up is user authentication.
-	prepareToSendIdentity();
+	// Next up is compression and then user authentication.
+	requestCompression();
 }
 
 void LoginHandler::cancelLogin()
@@ -792,6 +838,8 @@ void LoginHandler::handleError(const QString &code, const QString &msg)
 		error = tr("You have been banned from this session!");
 	else if(code == "idInUse")
 		error = tr("Session alias is reserved!");
+	else if(code == "tryAgain")
+		error = tr("Session is being saved. Please try again in a moment.");
 	else
 		error = msg;
 
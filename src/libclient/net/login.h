@@ -148,6 +148,13 @@ public:
 	 */
 	bool supportsAbuseReports() const { return m_canReport; }
 
+	/**
+	 * @brief Does the server relay latency tracing marks?
+	 *
+	 * Servers that don't would store the marks in the session history.
+	 */
+	bool supportsLatencyTracing() const { return m_supportsLatencyTracing; }
+
 	/**
 	 * @brief Check if the user has the given flag
 	 *
@@ -341,6 +348,7 @@ private:
 	enum State {
 		EXPECT_HELLO,
 		EXPECT_STARTTLS,
+		EXPECT_COMPRESS,
 		WAIT_FOR_LOGIN_PASSWORD,
 		WAIT_FOR_EXTAUTH,
 		EXPECT_IDENTIFIED,
@@ -354,6 +362,8 @@ private:
 	void expectNothing(const protocol::ServerReply &msg);
 	void expectHello(const protocol::ServerReply &msg);
 	void expectStartTls(const protocol::ServerReply &msg);
+	void requestCompression();
+	void expectCompress(const protocol::ServerReply &msg);
 	void prepareToSendIdentity();
 	void sendIdentity();
 	void expectIdentified(const protocol::ServerReply &msg);
@@ -408,6 +418,9 @@ private:
 	bool m_needUserPassword;
 	bool m_supportsCustomAvatars;
 	bool m_supportsExtAuthAvatars;
+	bool m_supportsCompression;
+	bool m_supportsLatencyTracing;
+	int m_compressionLevel;
 
 	// User flags
 	QStringList m_userFlags;
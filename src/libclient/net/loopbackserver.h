@@ -40,10 +40,12 @@ public:
 
 	bool isLoggedIn() const override { return false; }
 	int uploadQueueBytes() const override { return 0; }
+	protocol::TrafficStats trafficStats() const override { return protocol::TrafficStats(); }
 	Security securityLevel() const override { return NO_SECURITY; }
 	QSslCertificate hostCertificate() const override { return QSslCertificate(); }
 	bool supportsPersistence() const override { return false; }
 	bool supportsAbuseReports() const override { return false; }
+	bool supportsLatencyTracing() const override { return true; }
 
 };
 
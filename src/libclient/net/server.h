@@ -20,6 +20,7 @@
 #define DP_NET_SERVER_H
 
 #include "../libshared/net/message.h"
+#include "../libshared/net/trafficstats.h"
 
 #include <QObject>
 
@@ -69,6 +70,11 @@ public:
 	 */
 	virtual int uploadQueueBytes() const = 0;
 
+	/**
+	 * @brief Get per message type traffic statistics of the connection
+	 */
+	virtual protocol::TrafficStats trafficStats() const = 0;
+
 	/**
 	 * @brief Current security level
 	 */
@@ -85,6 +91,11 @@ public:
 	virtual bool supportsPersistence() const = 0;
 	virtual bool supportsAbuseReports() const = 0;
 
+	/**
+	 * @brief Does the server relay latency tracing marks without storing them?
+	 */
+	virtual bool supportsLatencyTracing() const = 0;
+
 signals:
 	void messageReceived(protocol::MessagePtr message);
 
@@ -28,12 +28,15 @@
 #include <QSslSocket>
 #include <QSslConfiguration>
 #include <QSettings>
+#include <QThread>
+#include <QTimer>
 
 namespace net {
 
 TcpServer::TcpServer(QObject *parent) :
-	Server(false, parent), m_loginstate(nullptr), m_securityLevel(NO_SECURITY),
-	m_localDisconnect(false), m_supportsPersistence(false)
+	Server(false, parent), m_ioThread(nullptr), m_loginstate(nullptr), m_securityLevel(NO_SECURITY),
+	m_localDisconnect(false), m_supportsPersistence(false), m_supportsAbuseReports(false),
+	m_supportsLatencyTracing(false)
 {
 	m_socket = new QSslSocket(this);
 
@@ -48,10 +51,24 @@ TcpServer::TcpServer(QObject *parent) :
 	m_msgqueue->setPingInterval(15 * 1000);
 
 	connect(m_socket, &QSslSocket::disconnected, this, &TcpServer::handleDisconnect);
+
+	// The socket may live in the network I/O thread, so the error
+	// details are read there and passed along to this thread.
+	auto socketError = [this](QAbstractSocket::SocketError error) {
+		qWarning() << "Socket error:" << m_socket->errorString();
+		if(error == QTcpSocket::RemoteHostClosedError)
+			return;
+
+		const QString errorString = m_socket->errorString();
+		const bool connected = m_socket->state() != QTcpSocket::UnconnectedState;
+		QTimer::singleShot(0, this, [this, errorString, connected]() {
+			handleSocketError(errorString, connected);
+		});
+	};
 #if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
-	connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this, &TcpServer::handleSocketError);
+	connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), m_socket, socketError);
 #else
-	connect(m_socket, &QTcpSocket::errorOccurred, this, &TcpServer::handleSocketError);
+	connect(m_socket, &QTcpSocket::errorOccurred, m_socket, socketError);
 #endif
 	connect(m_socket, &QSslSocket::stateChanged, this, [this](QAbstractSocket::SocketState state) {
 		if(state==QAbstractSocket::ClosingState)
@@ -65,6 +82,17 @@ TcpServer::TcpServer(QObject *parent) :
 	connect(m_msgqueue, &protocol::MessageQueue::pingPong, this, &TcpServer::lagMeasured);
 }
 
+TcpServer::~TcpServer()
+{
+	if(m_ioThread) {
+		// The message queue cleans up its half in the I/O thread,
+		// so it must go before the thread is stopped.
+		delete m_msgqueue;
+		m_ioThread->quit();
+		m_ioThread->wait();
+	}
+}
+
 void TcpServer::login(LoginHandler *login)
 {
 	m_loginstate = login;
@@ -84,6 +112,11 @@ int TcpServer::uploadQueueBytes() const
 	return m_msgqueue->uploadQueueBytes();
 }
 
+protocol::TrafficStats TcpServer::trafficStats() const
+{
+	return m_msgqueue->trafficStats();
+}
+
 void TcpServer::sendMessage(const protocol::MessagePtr &msg)
 {
 	m_msgqueue->send(msg);
@@ -126,7 +159,7 @@ void TcpServer::handleBadData(int len, int type, int contextId)
 	if(type < 64 || contextId == 0) {
 		// If message type is Transparent, the bad data came from the server. Something is wrong for sure.
 		m_error = tr("Received invalid data");
-		m_socket->abort();
+		m_msgqueue->abort();
 	} else {
 		// Opaque messages are merely passed along by the server.
 		// TODO autokick misbehaving clients?
@@ -138,17 +171,12 @@ void TcpServer::handleDisconnect()
 	emit serverDisconnected(m_error, m_errorcode, m_localDisconnect);
 }
 
-void TcpServer::handleSocketError()
+void TcpServer::handleSocketError(const QString &errorString, bool connected)
 {
-	qWarning() << "Socket error:" << m_socket->errorString();
-
-	if(m_socket->error() == QTcpSocket::RemoteHostClosedError)
-		return;
-
 	if(m_error.isEmpty())
-		m_error = m_socket->errorString();
-	if(m_socket->state() != QTcpSocket::UnconnectedState)
-		m_socket->disconnectFromHost();
+		m_error = errorString;
+	if(connected)
+		m_msgqueue->disconnectFromHost();
 	else
 		handleDisconnect();
 }
@@ -159,7 +187,7 @@ void TcpServer::loginFailure(const QString &message, const QString &errorcode)
 	m_error = message;
 	m_errorcode = errorcode;
 	m_localDisconnect = errorcode == "CANCELLED";
-	m_socket->disconnectFromHost();
+	m_msgqueue->disconnectFromHost();
 }
 
 void TcpServer::loginSuccess()
@@ -168,6 +196,17 @@ void TcpServer::loginSuccess()
 
 	m_supportsPersistence = m_loginstate->supportsPersistence();
 	m_supportsAbuseReports = m_loginstate->supportsAbuseReports();
+	m_supportsLatencyTracing = m_loginstate->supportsLatencyTracing();
+	m_hostCertificate = m_socket->peerCertificate();
+
+	// The handshake (TLS and compression included) is done: the rest of
+	// the connection's I/O can be moved off the GUI thread.
+	if(QSettings().value("settings/server/iothread", false).toBool()) {
+		m_ioThread = new QThread(this);
+		m_ioThread->setObjectName("network I/O");
+		m_ioThread->start();
+		m_msgqueue->moveIoToThread(m_ioThread);
+	}
 
 	emit loggedIn(
 		m_loginstate->url(),
@@ -184,7 +223,7 @@ void TcpServer::loginSuccess()
 
 QSslCertificate TcpServer::hostCertificate() const
 {
-	return m_socket->peerCertificate();
+	return m_hostCertificate;
 }
 
 }
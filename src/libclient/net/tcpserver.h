@@ -22,8 +22,10 @@
 #include "server.h"
 
 #include <QUrl>
+#include <QSslCertificate>
 
 class QSslSocket;
+class QThread;
 
 namespace protocol {
     class MessageQueue;
@@ -39,6 +41,7 @@ class TcpServer : public Server
 	friend class LoginHandler;
 public:
 	explicit TcpServer(QObject *parent=nullptr);
+	~TcpServer();
 
 	void login(LoginHandler *login);
 	void logout() override;
@@ -49,6 +52,7 @@ public:
 	bool isLoggedIn() const override { return m_loginstate == nullptr; }
 
 	int uploadQueueBytes() const override;
+	protocol::TrafficStats trafficStats() const override;
 
 	void startTls();
 
@@ -57,6 +61,7 @@ public:
 
 	bool supportsPersistence() const override { return m_supportsPersistence; }
 	bool supportsAbuseReports() const override { return m_supportsAbuseReports; }
+	bool supportsLatencyTracing() const override { return m_supportsLatencyTracing; }
 
 signals:
 	void loggedIn(const QUrl &url, uint8_t userid, bool join, bool auth, bool moderator, bool hasAutoreset);
@@ -76,17 +81,20 @@ private slots:
 	void handleMessage();
 	void handleBadData(int len, int type, int contextId);
 	void handleDisconnect();
-	void handleSocketError();
+	void handleSocketError(const QString &errorString, bool connected);
 
 private:
 	QSslSocket *m_socket;
 	protocol::MessageQueue *m_msgqueue;
+	QThread *m_ioThread;
+	QSslCertificate m_hostCertificate;
 	LoginHandler *m_loginstate;
 	QString m_error, m_errorcode;
 	Security m_securityLevel;
 	bool m_localDisconnect;
 	bool m_supportsPersistence;
 	bool m_supportsAbuseReports;
+	bool m_supportsLatencyTracing;
 };
 
 }
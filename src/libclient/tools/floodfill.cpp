@@ -34,7 +34,7 @@ namespace tools {
 
 FloodFill::FloodFill(ToolController &owner)
 	: Tool(owner, FLOODFILL, QCursor(QPixmap(":cursors/bucket.png"), 2, 29)),
-	m_tolerance(1), m_expansion(0), m_sizelimit(1000*1000), m_sampleMerged(true), m_underFill(true),
+	m_tolerance(1), m_expansion(0), m_gap(0), m_sizelimit(1000*1000), m_sampleMerged(true), m_underFill(true),
 	m_eraseMode(false)
 {
 }
@@ -54,7 +54,8 @@ void FloodFill::begin(const paintcore::Point &point, bool right, float zoom)
 		m_tolerance,
 		owner.activeLayer(),
 		m_sampleMerged,
-		m_sizelimit
+		m_sizelimit,
+		m_gap
 	);
 
 	if(!fill.oversize)
@@ -34,6 +34,7 @@ public:
 
 	void setTolerance(int tolerance) { m_tolerance = tolerance; }
 	void setExpansion(int expansion) { m_expansion = expansion; }
+	void setGapSize(int gap) { m_gap = gap; }
 	void setSizeLimit(unsigned int limit) { m_sizelimit = qMax(100u, limit); }
 	void setSampleMerged(bool sm) { m_sampleMerged = sm; }
 	void setUnderFill(bool uf) { m_underFill = uf; }
@@ -42,6 +43,7 @@ public:
 private:
 	int m_tolerance;
 	int m_expansion;
+	int m_gap;
 	unsigned int m_sizelimit;
 	bool m_sampleMerged;
 	bool m_underFill;
@@ -20,6 +20,7 @@
 #include "canvas/canvasmodel.h"
 #include "net/client.h"
 #include "net/commands.h"
+#include "net/latencytracer.h"
 
 #include "tools/toolcontroller.h"
 #include "tools/freehand.h"
@@ -56,6 +57,10 @@ void Freehand::motion(const paintcore::Point& point, bool constrain, bool center
 	if(!m_drawing)
 		return;
 
+	// Servers that don't know about trace marks would store them in the session history
+	net::LatencyTracer *tracer = owner.client()->serverSupportsLatencyTracing() ? net::LatencyTracer::active() : nullptr;
+	const qint64 penEventTime = tracer ? protocol::TraceMark::timestamp() : 0;
+
 	const paintcore::Layer *srcLayer = nullptr;
 	if(owner.activeBrush().smudge1()>0 || owner.activeBrush().isColorPickMode())
 		srcLayer = owner.model()->layerStack()->getLayer(owner.activeLayer());
@@ -67,7 +72,10 @@ void Freehand::motion(const paintcore::Point& point, bool constrain, bool center
 	}
 
 	m_brushengine.strokeTo(point, srcLayer);
-	owner.client()->sendMessages(m_brushengine.takeDabs());
+	protocol::MessageList dabs = m_brushengine.takeDabs();
+	if(tracer)
+		tracer->traceStroke(owner.client()->myId(), penEventTime, dabs);
+	owner.client()->sendMessages(dabs);
 }
 
 void Freehand::end()
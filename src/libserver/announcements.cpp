@@ -23,6 +23,7 @@
 #include "serverconfig.h"
 #include "serverlog.h"
 
+#include <QMutexLocker>
 #include <QTimerEvent>
 
 namespace sessionlisting {
@@ -32,6 +33,9 @@ Announcable::~Announcable() { }
 Announcements::Announcements(server::ServerConfig *config, QObject *parent)
 	: QObject(parent), m_config(config)
 {
+	// Needed when sessions run in worker threads
+	qRegisterMetaType<const sessionlisting::Announcable*>("const sessionlisting::Announcable*");
+
 	m_timerId = startTimer(30 * 1000, Qt::VeryCoarseTimer);
 }
 
@@ -56,13 +60,16 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 		return;
 
 	// Make announcement
-	m_announcements << Listing {
-		listServer,
-		session,
-		Announcement {},
-		QElapsedTimer(),
-		PrivacyMode::Undefined
-	};
+	{
+		QMutexLocker lock(&m_mutex);
+		m_announcements << Listing {
+			listServer,
+			session,
+			Announcement {},
+			QElapsedTimer(),
+			PrivacyMode::Undefined
+		};
+	}
 
 	server::Log()
 		.about(server::Log::Level::Info, server::Log::Topic::PubList)
@@ -101,10 +108,13 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 			listing->session->sendListserverMessage(message);
 		}
 
-		listing->announcement = result.value<sessionlisting::Announcement>();
-		Q_ASSERT(listing->announcement.apiUrl == listing->listServer);
-		listing->mode = listing->announcement.isPrivate ? PrivacyMode::Private : PrivacyMode::Public;
-		listing->refreshTimer.start();
+		{
+			QMutexLocker lock(&m_mutex);
+			listing->announcement = result.value<sessionlisting::Announcement>();
+			Q_ASSERT(listing->announcement.apiUrl == listing->listServer);
+			listing->mode = listing->announcement.isPrivate ? PrivacyMode::Private : PrivacyMode::Public;
+			listing->refreshTimer.start();
+		}
 
 		emit announcementsChanged(listing->session);
 
@@ -140,6 +150,7 @@ void Announcements::unlistSession(Announcable *session, const QUrl &listServer,
 				connect(response, &AnnouncementApiResponse::finished, response, &AnnouncementApiResponse::deleteLater);
 			}
 
+			QMutexLocker lock(&m_mutex);
 			i.remove();
 		}
 	}
@@ -275,6 +286,7 @@ void Announcements::refreshListings()
 
 QVector<Announcement> Announcements::getAnnouncements(const Announcable *session) const
 {
+	QMutexLocker lock(&m_mutex);
 	QVector<Announcement> list;
 	for(const auto &listing : m_announcements) {
 		if(listing.mode != PrivacyMode::Undefined && listing.session == session)
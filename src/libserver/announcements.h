@@ -22,6 +22,7 @@
 #include "../libshared/listings/announcementapi.h"
 
 #include <QObject>
+#include <QMutex>
 #include <QVector>
 #include <QElapsedTimer>
 
@@ -35,6 +36,9 @@ class Announcable;
 
 /**
  * @brief All session announcements made from this server
+ *
+ * This object lives in the main thread. When sessions run in worker threads,
+ * they may only call getAnnouncements() directly.
  */
 class Announcements : public QObject
 {
@@ -64,6 +68,9 @@ public:
 
 	/**
 	 * @brief Return all active announcements for the given session
+	 *
+	 * This function is thread-safe.
+	 *
 	 * @param session
 	 * @return
 	 */
@@ -91,7 +98,8 @@ private:
 
 	void refreshListings();
 
-	QVector<Listing> m_announcements;
+	QVector<Listing> m_announcements; // modified only in the main thread
+	mutable QMutex m_mutex;           // held when modifying m_announcements or reading it elsewhere
 	server::ServerConfig *m_config;
 
 	int m_timerId;
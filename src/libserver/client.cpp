@@ -30,15 +30,21 @@
 #include <QSslSocket>
 #include <QStringList>
 #include <QPointer>
+#include <QTimer>
 
 namespace server {
 
+// A client that falls this far behind is disconnected
+static const int MAX_UPLOAD_QUEUE = 256 * 1024 * 1024;
+
 using protocol::MessagePtr;
 
 struct Client::Private {
 	QPointer<Session> session;
 	QTcpSocket *socket;
 	ServerLog *logger;
+	QHostAddress peerAddress;
+	QThread *ioThread = nullptr;
 
 	protocol::MessageQueue *msgqueue;
 	protocol::MessageList holdqueue;
@@ -58,9 +64,10 @@ struct Client::Private {
 	bool isMuted = false;
 	bool isHoldLocked = false;
 	bool isAwaitingReset = false;
+	bool isSecure = false;
 
 	Private(QTcpSocket *socket, ServerLog *logger)
-		: socket(socket), logger(logger)
+		: socket(socket), logger(logger), peerAddress(socket->peerAddress())
 	{
 		Q_ASSERT(socket);
 		Q_ASSERT(logger);
@@ -71,14 +78,25 @@ Client::Client(QTcpSocket *socket, ServerLog *logger, QObject *parent)
 	: QObject(parent), d(new Private(socket, logger))
 {
 	d->msgqueue = new protocol::MessageQueue(socket, this);
+	d->msgqueue->setUploadQueueLimit(MAX_UPLOAD_QUEUE);
 	d->socket->setParent(this);
 
 	connect(d->socket, &QAbstractSocket::disconnected, this, &Client::socketDisconnect);
+
+	// The socket may be moved to the network I/O thread, so the error
+	// string is read in the socket's own thread.
+	auto onSocketError = [this, socket](QAbstractSocket::SocketError error) {
+		const QString errorString = socket->errorString();
+		QTimer::singleShot(0, this, [this, error, errorString]() { socketError(error, errorString); });
+	};
 #if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
-	connect(d->socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &Client::socketError);
+	connect(d->socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), socket, onSocketError);
 #else
-	connect(d->socket, &QAbstractSocket::errorOccurred, this, &Client::socketError);
+	connect(d->socket, &QAbstractSocket::errorOccurred, socket, onSocketError);
 #endif
+
+	if(QSslSocket *sslSocket = qobject_cast<QSslSocket*>(socket))
+		connect(sslSocket, &QSslSocket::encrypted, this, [this]() { d->isSecure = true; });
 	connect(d->msgqueue, &protocol::MessageQueue::messageAvailable, this, &Client::receiveMessages);
 	connect(d->msgqueue, &protocol::MessageQueue::badData, this, &Client::gotBadData);
 }
@@ -120,8 +138,19 @@ QJsonObject Client::description(bool includeSession) const
 	return u;
 }
 
+protocol::TrafficStats Client::trafficStats() const
+{
+	return d->msgqueue->trafficStats();
+}
+
 JsonApiResult Client::callJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
 {
+	if(path.size() == 1 && path.first() == "traffic") {
+		if(method != JsonApiMethod::Get)
+			return JsonApiBadMethod();
+		return JsonApiResult { JsonApiResult::Ok, QJsonDocument(trafficStats().toJson()) };
+	}
+
 	if(!path.isEmpty())
 		return JsonApiNotFound();
 
@@ -163,6 +192,11 @@ JsonApiResult Client::callJsonApi(JsonApiMethod method, const QStringList &path,
 void Client::setSession(Session *session)
 {
 	d->session = session;
+
+	// The TLS and compression handshakes are done by the time
+	// the client joins a session, so I/O can be moved to its thread now.
+	if(session && d->ioThread && !d->msgqueue->isIoThreaded())
+		d->msgqueue->moveIoToThread(d->ioThread);
 }
 
 Session *Client::session()
@@ -279,6 +313,11 @@ void Client::setConnectionTimeout(int timeout)
 	d->msgqueue->setIdleTimeout(timeout);
 }
 
+void Client::setIoThread(QThread *thread)
+{
+	d->ioThread = thread;
+}
+
 #ifndef NDEBUG
 void Client::setRandomLag(uint lag)
 {
@@ -288,7 +327,7 @@ void Client::setRandomLag(uint lag)
 
 QHostAddress Client::peerAddress() const
 {
-	return d->socket->peerAddress();
+	return d->peerAddress;
 }
 
 void Client::sendDirectMessage(protocol::MessagePtr msg)
@@ -354,14 +393,14 @@ void Client::gotBadData(int len, int type)
 	log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message(
 		QString("Received unknown message type %1 of length %2").arg(type).arg(len)
 		));
-	d->socket->abort();
+	d->msgqueue->abort();
 }
 
-void Client::socketError(QAbstractSocket::SocketError error)
+void Client::socketError(QAbstractSocket::SocketError error, const QString &errorString)
 {
 	if(error != QAbstractSocket::RemoteHostClosedError) {
-		log(Log().about(Log::Level::Warn, Log::Topic::Status).message("Socket error: " + d->socket->errorString()));
-		d->socket->abort();
+		log(Log().about(Log::Level::Warn, Log::Topic::Status).message("Socket error: " + errorString));
+		d->msgqueue->abort();
 	}
 }
 
@@ -424,20 +463,25 @@ bool Client::hasSslSupport() const
 
 bool Client::isSecure() const
 {
-	QSslSocket *socket = qobject_cast<QSslSocket*>(d->socket);
-	return socket && socket->isEncrypted();
+	return d->isSecure;
 }
 
 void Client::startTls()
 {
 	QSslSocket *socket = qobject_cast<QSslSocket*>(d->socket);
 	Q_ASSERT(socket);
+	Q_ASSERT(!d->msgqueue->isIoThreaded());
 	socket->startServerEncryption();
 }
 
+bool Client::startCompression(int level)
+{
+	return d->msgqueue->startCompression(level);
+}
+
 void Client::log(Log entry) const
 {
-	entry.user(d->id, d->socket->peerAddress(), d->username);
+	entry.user(d->id, d->peerAddress, d->username);
 	if(d->session)
 		d->session->log(entry);
 	else
@@ -445,7 +489,7 @@ void Client::log(Log entry) const
 }
 
 Log Client::log() const {
-	return Log().user(d->id, d->socket->peerAddress(), d->username);
+	return Log().user(d->id, d->peerAddress, d->username);
 }
 
 
@@ -20,12 +20,14 @@
 #define DP_SERVER_CLIENT_H
 
 #include "../libshared/net/message.h"
+#include "../libshared/net/trafficstats.h"
 #include "jsonapi.h"
 
 #include <QObject>
 #include <QTcpSocket>
 
 class QHostAddress;
+class QThread;
 
 namespace protocol {
 	class MessageQueue;
@@ -155,6 +157,15 @@ public:
 	 */
 	void setConnectionTimeout(int timeout);
 
+	/**
+	 * @brief Set the thread to do this client's network I/O in
+	 *
+	 * I/O is moved to the thread when the client joins a session,
+	 * since the login handshakes are done by then.
+	 * If not set, all I/O is done in the main thread.
+	 */
+	void setIoThread(QThread *thread);
+
 	/**
 	 * Get the timestamp of this client's last activity (i.e. non-keepalive message received)
 	 *
@@ -219,6 +230,14 @@ public:
 	 */
 	void startTls();
 
+	/**
+	 * @brief Start compressing the connection
+	 *
+	 * @param level deflate compression level
+	 * @return false if compression is not supported
+	 */
+	bool startCompression(int level);
+
 	/**
 	 * @brief Get a Join message for this user
 	 */
@@ -231,6 +250,11 @@ public:
 	 */
 	QJsonObject description(bool includeSession=true) const;
 
+	/**
+	 * @brief Get this connection's per message type traffic statistics
+	 */
+	protocol::TrafficStats trafficStats() const;
+
 	/**
 	 * @brief Call the client's JSON administration API
 	 *
@@ -290,7 +314,7 @@ signals:
 private slots:
 	void gotBadData(int len, int type);
 	void receiveMessages();
-	void socketError(QAbstractSocket::SocketError error);
+	void socketError(QAbstractSocket::SocketError error, const QString &errorString);
 	void socketDisconnect();
 
 protected:
@@ -18,6 +18,7 @@
 */
 
 #include "filedhistory.h"
+#include "historycache.h"
 #include "../libshared/util/passwordhash.h"
 #include "../libshared/util/filename.h"
 #include "../libshared/record/header.h"
@@ -25,15 +26,200 @@
 
 #include <QFile>
 #include <QJsonObject>
-#include <QVarLengthArray>
 #include <QDebug>
 #include <QTimerEvent>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QTimer>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QCryptographicHash>
+
+#include <functional>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 namespace server {
 
 // A block is closed when its size goes above this limit
 static const qint64 MAX_BLOCK_SIZE = 0xffff * 10;
 
+// Pending writes are committed when this much has accumulated...
+static const int GROUP_COMMIT_SIZE = 0xffff;
+
+// ...or when this many milliseconds have passed since the first one
+static const int GROUP_COMMIT_INTERVAL = 50;
+
+// Block index file format identifier and version
+static const quint32 INDEX_MAGIC = 0x44504958; // "DPIX"
+static const quint16 INDEX_VERSION = 1;
+
+// How much of the end of the indexed part of the recording is checksummed
+static const qint64 INDEX_CHECKSUM_LENGTH = 4096;
+
+// Threads for reading history blocks in the background (shared by all sessions)
+class HistoryIoPool : public QThreadPool {
+public:
+	HistoryIoPool() { setMaxThreadCount(2); }
+};
+Q_GLOBAL_STATIC(HistoryIoPool, historyIoPool)
+
+// Threads for syncing session files to disk (shared by all sessions.)
+// Kept separate so slow syncs don't hold up history loading.
+class HistorySyncPool : public QThreadPool {
+public:
+	HistorySyncPool() { setMaxThreadCount(2); }
+};
+Q_GLOBAL_STATIC(HistorySyncPool, historySyncPool)
+
+/**
+ * The link between a FiledHistory and the background loads it has started.
+ *
+ * The history clears the pointer when it is destroyed, so a load that
+ * finishes afterwards won't try to report back to it.
+ */
+struct FiledHistory::LoaderLink {
+	QMutex mutex;
+	FiledHistory *history;
+};
+
+/**
+ * A history's file syncs.
+ *
+ * Only one sync per history runs at a time. Requests made while it is
+ * running are coalesced into a single pending one, which the running
+ * sync picks up when it is done.
+ */
+struct FiledHistory::SyncQueue {
+	QMutex mutex;
+	QVector<int> pending;     // file descriptors (dups) to sync next
+	int pendingFileCount = 0; // the history's file count when the pending descriptors were made
+	bool running = false;
+};
+
+namespace {
+
+class BlockLoaderRunnable : public QRunnable {
+public:
+	typedef std::function<void(const QByteArray&)> Callback;
+
+	BlockLoaderRunnable(const QString &filename, qint64 offset, qint64 length, Callback callback)
+		: m_filename(filename), m_offset(offset), m_length(length), m_callback(callback)
+	{ }
+
+	void run() override
+	{
+		QByteArray data;
+		QFile f(m_filename);
+		if(f.open(QFile::ReadOnly) && f.seek(m_offset))
+			data = f.read(m_length);
+
+		m_callback(data);
+	}
+
+private:
+	QString m_filename;
+	qint64 m_offset;
+	qint64 m_length;
+	Callback m_callback;
+};
+
+/**
+ * A read-only memory mapping of a part of a file.
+ *
+ * The mapping stays valid even after the file is closed or removed,
+ * and is unmapped when the last reference to it is dropped.
+ * Mapping is only supported on Unix systems: on other platforms,
+ * a mapped file could not be deleted when the session ends.
+ */
+class FileMapping {
+public:
+	static std::shared_ptr<FileMapping> map(int fd, qint64 offset, qint64 length)
+	{
+#ifdef Q_OS_UNIX
+		if(fd < 0 || length <= 0 || length > std::numeric_limits<int>::max())
+			return std::shared_ptr<FileMapping>();
+
+		// The mapping must start at a page boundary
+		static const qint64 pageSize = ::sysconf(_SC_PAGESIZE);
+		const qint64 skip = offset % pageSize;
+		const size_t size = size_t(length + skip);
+
+		void *base = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, off_t(offset - skip));
+		if(base == MAP_FAILED)
+			return std::shared_ptr<FileMapping>();
+
+		return std::shared_ptr<FileMapping>(new FileMapping(base, size, int(skip), int(length)));
+#else
+		Q_UNUSED(fd);
+		Q_UNUSED(offset);
+		Q_UNUSED(length);
+		return std::shared_ptr<FileMapping>();
+#endif
+	}
+
+	~FileMapping()
+	{
+#ifdef Q_OS_UNIX
+		::munmap(m_base, m_size);
+#endif
+	}
+
+	const char *data() const { return static_cast<const char*>(m_base) + m_skip; }
+	int length() const { return m_length; }
+
+	//! Start reading the mapped pages in from the disk in the background
+	void prefetch() const
+	{
+#ifdef Q_OS_UNIX
+		::madvise(m_base, m_size, MADV_WILLNEED);
+#endif
+	}
+
+private:
+	FileMapping(void *base, size_t size, int skip, int length)
+		: m_base(base), m_size(size), m_skip(skip), m_length(length) { }
+	Q_DISABLE_COPY(FileMapping)
+
+	void *m_base;
+	size_t m_size;
+	int m_skip;
+	int m_length;
+};
+
+class FileSyncRunnable : public QRunnable {
+public:
+	// Fetches the next descriptors to sync. Returns false if there are none.
+	typedef std::function<bool(QVector<int>&)> Next;
+
+	// Takes ownership of the file descriptors
+	FileSyncRunnable(const QVector<int> &fds, Next next) : m_fds(fds), m_next(next) { }
+
+	void run() override
+	{
+		do {
+#ifdef Q_OS_UNIX
+			for(int fd : m_fds) {
+				::fsync(fd);
+				::close(fd);
+			}
+#endif
+		} while(m_next(m_fds));
+	}
+
+private:
+	QVector<int> m_fds;
+	Next m_next;
+};
+
+}
+
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent)
 	: SessionHistory(id, parent),
 	  m_dir(dir),
@@ -44,10 +230,22 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, c
 	  m_version(version),
 	  m_maxUsers(254),
 	  m_flags(),
+	  m_loaderLink(new LoaderLink),
+	  m_syncQueue(new SyncQueue),
+	  m_cache(new HistoryCache),
+	  m_cacheId(HistoryCache::newOwnerId()),
+	  m_syncInterval(-1),
+	  m_unsynced(false),
+	  m_indexedBlocks(0),
 	  m_fileCount(0),
 	  m_archive(false)
 {
 	Q_ASSERT(journal);
+	m_loaderLink->history = this;
+
+	m_commitTimer = new QTimer(this);
+	m_commitTimer->setSingleShot(true);
+	connect(m_commitTimer, &QTimer::timeout, this, &FiledHistory::commitWrites);
 
 	// Flush the recording file periodically
 	startTimer(1000 * 30, Qt::VeryCoarseTimer);
@@ -60,6 +258,22 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, Q
 
 FiledHistory::~FiledHistory()
 {
+	if(m_recording && m_recording->isOpen() && !m_blocks.isEmpty())
+		saveIndex();
+
+	m_cache->removeOwner(m_cacheId);
+
+	QMutexLocker lock(&m_loaderLink->mutex);
+	m_loaderLink->history = nullptr;
+}
+
+void FiledHistory::setCache(const std::shared_ptr<HistoryCache> &cache)
+{
+	Q_ASSERT(cache);
+	if(cache != m_cache) {
+		m_cache->removeOwner(m_cacheId);
+		m_cache = cache;
+	}
 }
 
 QString FiledHistory::journalFilename(const QString &id)
@@ -164,7 +378,9 @@ bool FiledHistory::initRecording()
 		firstIndex(),
 		0,
 		m_recording->pos(),
-		protocol::MessageList()
+		protocol::MessageList(),
+		QByteArray(),
+		LoadState::Idle
 		};
 
 	return true;
@@ -337,6 +553,11 @@ bool FiledHistory::load()
 
 	qint64 startOffset = m_recording->pos();
 
+	// If a valid block index was saved, only the part of the
+	// recording written after it needs to be scanned
+	if(loadIndex(startOffset))
+		qDebug() << recordingFile << "block index valid up to" << m_blocks.last().endOffset;
+
 	// Scan the recording file and build the index of blocks
 	if(!scanBlocks()) {
 		qWarning() << recordingFile << "error occurred during indexing";
@@ -358,35 +579,57 @@ bool FiledHistory::load()
 
 bool FiledHistory::scanBlocks()
 {
-	Q_ASSERT(m_blocks.isEmpty());
-	// Note: m_recording should be at the start of the recording
+	// Note: m_recording should be at the start of the recording,
+	// unless the blocks were already read from the index
+	if(m_blocks.isEmpty()) {
+		m_blocks << Block {
+			m_recording->pos(),
+			firstIndex(),
+			0,
+			m_recording->pos(),
+			protocol::MessageList(),
+			QByteArray(),
+			LoadState::Idle
+		};
+	} else {
+		m_recording->seek(m_blocks.last().endOffset);
+	}
 
-	m_blocks << Block {
-		m_recording->pos(),
-		firstIndex(),
-		0,
-		m_recording->pos(),
-		protocol::MessageList()
-	};
+	const qint64 fileSize = m_recording->size();
+	const qint64 scanStart = m_blocks.last().endOffset;
 
-	QSet<uint8_t> users;
+	// The message headers are read straight from memory if the file can be mapped
+	const std::shared_ptr<FileMapping> map = FileMapping::map(m_recording->handle(), scanStart, fileSize - scanStart);
 
-	do {
+	while(m_blocks.last().endOffset < fileSize) {
 		Block &b = m_blocks.last();
-		uint8_t msgType, ctxId;
+		uint8_t msgType = 0, ctxId = 0;
+
+		int msglen = -1;
+		if(map) {
+			const qint64 left = fileSize - b.endOffset;
+			if(left >= protocol::Message::HEADER_LEN) {
+				const char *msg = map->data() + (b.endOffset - scanStart);
+				msglen = protocol::Message::sniffLength(msg);
+				if(msglen > left)
+					msglen = -1;
+				msgType = uint8_t(msg[2]);
+				ctxId = uint8_t(msg[3]);
+			}
+		} else {
+			msglen = recording::skipRecordingMessage(m_recording, &msgType, &ctxId);
+		}
 
-		const int msglen = recording::skipRecordingMessage(m_recording, &msgType, &ctxId);
 		if(msglen<0) {
 			// Truncated message encountered.
 			// Rewind back to the end of the previous message
 			qWarning() << m_recording->fileName() << "Recording truncated at" << int(b.endOffset);
-			m_recording->seek(b.endOffset);
 			break;
 		}
 		++m_blocks.last().count;
 
 		b.endOffset += msglen;
-		Q_ASSERT(b.endOffset == m_recording->pos());
+		Q_ASSERT(map || b.endOffset == m_recording->pos());
 
 		if(b.endOffset-b.startOffset >= MAX_BLOCK_SIZE) {
 			m_blocks << Block {
@@ -394,34 +637,163 @@ bool FiledHistory::scanBlocks()
 				b.startIndex+b.count,
 				0,
 				b.endOffset,
-				protocol::MessageList()
+				protocol::MessageList(),
+				QByteArray(),
+				LoadState::Idle
 			};
 		}
 
 		switch(msgType) {
-		case protocol::MSG_USER_JOIN: users.insert(ctxId); break;
+		case protocol::MSG_USER_JOIN: m_users.insert(ctxId); break;
 		case protocol::MSG_USER_LEAVE:
-			users.remove(ctxId);
+			m_users.remove(ctxId);
+			m_leftUsers.insert(ctxId);
 			idQueue().reserveId(ctxId);
 			break;
 		}
-	} while(!m_recording->atEnd());
+	}
+
+	// New messages are appended after the last complete one
+	m_recording->seek(m_blocks.last().endOffset);
 
 	// There should be no users at the end of the recording.
-	for(const uint8_t user : users) {
+	for(const uint8_t user : m_users) {
 		protocol::UserLeave msg(user);
 		m_blocks.last().count++;
 		m_blocks.last().endOffset += msg.length();
 		char buf[16];
 		msg.serialize(buf);
 		m_recording->write(buf, msg.length());
+		m_leftUsers.insert(user);
 		idQueue().reserveId(user);
 	}
+	m_users.clear();
 	return true;
 }
 
+QString FiledHistory::indexFilename() const
+{
+	return m_dir.absoluteFilePath(QFileInfo(m_recording->fileName()).completeBaseName() + ".dpidx");
+}
+
+QByteArray FiledHistory::indexChecksum(qint64 end) const
+{
+	const qint64 start = qMax(m_blocks.first().startOffset, end - INDEX_CHECKSUM_LENGTH);
+	if(start >= end)
+		return QByteArray();
+	const QByteArray tail = readRecording(start, end - start);
+	if(tail.isEmpty())
+		return QByteArray();
+	return QCryptographicHash::hash(tail, QCryptographicHash::Sha1);
+}
+
+bool FiledHistory::loadIndex(qint64 startOffset)
+{
+	Q_ASSERT(m_blocks.isEmpty());
+
+	QFile f(indexFilename());
+	if(!f.open(QFile::ReadOnly))
+		return false;
+
+	QDataStream ds(&f);
+	ds.setVersion(QDataStream::Qt_5_0);
+
+	quint32 magic;
+	quint16 version;
+	ds >> magic >> version;
+	if(magic != INDEX_MAGIC || version != INDEX_VERSION) {
+		qWarning() << f.fileName() << "unsupported block index";
+		return false;
+	}
+
+	qint64 indexedEnd;
+	QByteArray checksum;
+	QSet<quint8> users, leftUsers;
+	qint32 blockCount;
+	ds >> indexedEnd >> checksum >> users >> leftUsers >> blockCount;
+
+	QVector<Block> blocks;
+	qint64 offset = startOffset;
+	int index = firstIndex();
+	for(int i=0;i<blockCount && ds.status() == QDataStream::Ok;++i) {
+		qint64 start, end;
+		qint32 startIndex, count;
+		ds >> start >> startIndex >> count >> end;
+
+		// The blocks must cover the recording without gaps
+		if(start != offset || startIndex != index || count < 0 || end < start)
+			break;
+
+		blocks << Block {
+			start,
+			startIndex,
+			count,
+			end,
+			protocol::MessageList(),
+			QByteArray(),
+			LoadState::Idle
+		};
+		offset = end;
+		index += count;
+	}
+
+	if(ds.status() != QDataStream::Ok || blocks.isEmpty() || blocks.size() != blockCount || offset != indexedEnd) {
+		qWarning() << f.fileName() << "invalid block index";
+		return false;
+	}
+
+	// Make sure the index belongs to this version of the recording
+	m_blocks = blocks;
+	if(indexedEnd > m_recording->size() || indexChecksum(indexedEnd) != checksum) {
+		qWarning() << f.fileName() << "block index does not match the recording";
+		m_blocks.clear();
+		return false;
+	}
+
+	m_users = users;
+	m_leftUsers = leftUsers;
+	for(const uint8_t user : m_leftUsers)
+		idQueue().reserveId(user);
+
+	m_indexedBlocks = m_blocks.size();
+	return true;
+}
+
+void FiledHistory::saveIndex()
+{
+	commitWrites();
+
+	const qint64 indexedEnd = m_blocks.last().endOffset;
+
+	QSaveFile f(indexFilename());
+	if(!f.open(QFile::WriteOnly)) {
+		qWarning() << f.fileName() << f.errorString();
+		return;
+	}
+
+	QDataStream ds(&f);
+	ds.setVersion(QDataStream::Qt_5_0);
+
+	ds << INDEX_MAGIC << INDEX_VERSION
+		<< indexedEnd
+		<< indexChecksum(indexedEnd)
+		<< m_users
+		<< m_leftUsers
+		<< qint32(m_blocks.size());
+
+	for(const Block &b : m_blocks)
+		ds << b.startOffset << qint32(b.startIndex) << qint32(b.count) << b.endOffset;
+
+	if(!f.commit())
+		qWarning() << f.fileName() << f.errorString();
+
+	m_indexedBlocks = m_blocks.size();
+}
+
 void FiledHistory::terminate()
 {
+	commitWrites();
+	QFile::remove(indexFilename());
 	m_recording->close();
 	m_journal->close();
 
@@ -436,22 +808,26 @@ void FiledHistory::terminate()
 
 void FiledHistory::closeBlock()
 {
-	// Flush the output files just to be safe
-	m_recording->flush();
-	m_journal->flush();
+	// Closed blocks are read through other file handles, so they must be written out
+	commitWrites();
 
 	// Check if anything needs to be done
 	Block &b = m_blocks.last();
 	if(b.count==0)
 		return;
 
+	// Closed blocks are cached in serialized form only
+	b.messages = protocol::MessageList();
+
 	// Mark last block as closed and start a new one
 	m_blocks << Block {
 				b.endOffset,
 				b.startIndex+b.count,
 				0,
 				b.endOffset,
-				protocol::MessageList()
+				protocol::MessageList(),
+				QByteArray(),
+				LoadState::Idle
 	};
 }
 
@@ -464,7 +840,7 @@ void FiledHistory::setPasswordHash(const QByteArray &password)
 		if(!m_password.isEmpty())
 			m_journal->write(m_password);
 		m_journal->write("\n");
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -476,7 +852,7 @@ void FiledHistory::setOpwordHash(const QByteArray &opword)
 	if(!m_opword.isEmpty())
 		m_journal->write(m_opword);
 	m_journal->write("\n");
-	m_journal->flush();
+	scheduleCommit();
 }
 
 void FiledHistory::setMaxUsers(int max)
@@ -485,7 +861,7 @@ void FiledHistory::setMaxUsers(int max)
 	if(newMax != m_maxUsers) {
 		m_maxUsers = newMax;
 		m_journal->write(QString("MAXUSERS %1\n").arg(newMax).toUtf8());
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -495,7 +871,7 @@ void FiledHistory::setAutoResetThreshold(uint limit)
 	if(newLimit != m_autoResetThreshold) {
 		m_autoResetThreshold = newLimit;
 		m_journal->write(QString("AUTORESET %1\n").arg(newLimit).toUtf8());
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -504,7 +880,7 @@ void FiledHistory::setTitle(const QString &title)
 	if(title != m_title) {
 		m_title = title;
 		m_journal->write(QString("TITLE %1\n").arg(title).toUtf8());
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -524,7 +900,7 @@ void FiledHistory::setFlags(Flags f)
 		if(f.testFlag(AuthOnly))
 			fstr << "authonly";
 		m_journal->write(QString("FLAGS %1\n").arg(fstr.join(' ')).toUtf8());
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -537,10 +913,10 @@ void FiledHistory::joinUser(uint8_t id, const QString &name)
 		+ " "
 		+ name.toUtf8().toPercentEncoding(QByteArray(), " ")
 		+ "\n");
-	m_journal->flush();
+	scheduleCommit();
 }
 
-std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
+int FiledHistory::findBlock(int after) const
 {
 	// Find the block that contains the index *after*
 	int i=m_blocks.size()-1;
@@ -549,46 +925,250 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 		if(b.startIndex+b.count-1 <= after)
 			break;
 	}
+	return i;
+}
+
+QByteArray FiledHistory::cachedBlock(int block) const
+{
+	const Block &b = m_blocks.at(block);
+	if(!b.loaded.isEmpty())
+		return b.loaded;
+	return m_cache->get(m_cacheId, b.startOffset);
+}
+
+QByteArray FiledHistory::readBlock(int block) const
+{
+	const QByteArray mapped = mapBlock(block, false);
+	if(!mapped.isEmpty())
+		return mapped;
+
+	const Block &b = m_blocks.at(block);
+
+	// The recording contains the messages in the same form they are sent in,
+	// so a closed block can be read in as is
+	qDebug() << m_recording->fileName() << "loading block" << block;
+	const QByteArray data = readRecording(b.startOffset, b.endOffset - b.startOffset);
+	if(!data.isEmpty())
+		m_cache->insert(m_cacheId, b.startOffset, data);
+	return data;
+}
+
+QByteArray FiledHistory::mapBlock(int block, bool prefetch) const
+{
+	const Block &b = m_blocks.at(block);
+
+	// Closed blocks are never written to again, so their part of the
+	// file can be mapped once it has been written out
+	if(!m_pendingWrites.isEmpty())
+		const_cast<FiledHistory*>(this)->commitWrites();
+
+	const std::shared_ptr<FileMapping> mapping = FileMapping::map(m_recording->handle(), b.startOffset, b.endOffset - b.startOffset);
+	if(!mapping)
+		return QByteArray();
+
+	if(prefetch)
+		mapping->prefetch();
+
+	// The data points straight into the mapping. The cache keeps the
+	// mapping alive for as long as anyone holds a reference to the data,
+	// so opaque messages and serialized batches can be sent without copying.
+	const QByteArray data = QByteArray::fromRawData(mapping->data(), mapping->length());
+	m_cache->insert(m_cacheId, b.startOffset, data, mapping);
+	return data;
+}
+
+QByteArray FiledHistory::readRecording(qint64 offset, qint64 length) const
+{
+	if(!m_pendingWrites.isEmpty())
+		const_cast<FiledHistory*>(this)->commitWrites();
+
+	const qint64 prevPos = m_recording->pos();
+	m_recording->seek(offset);
+	const QByteArray data = m_recording->read(length);
+	m_recording->seek(prevPos);
 
+	if(data.length() != length) {
+		qWarning() << m_recording->fileName() << "read error!";
+		return QByteArray();
+	}
+	return data;
+}
+
+protocol::MessageList FiledHistory::parseBlock(int block, const QByteArray &data, int first) const
+{
+	// Opaque messages refer to the block's buffer rather than copying their payloads
+	protocol::MessageList messages;
+	int pos = 0;
+	for(int m=0;m<m_blocks.at(block).count;++m) {
+		if(data.length() - pos < protocol::Message::HEADER_LEN) {
+			qWarning() << m_recording->fileName() << "Block" << block << "truncated";
+			break;
+		}
+		const int len = protocol::Message::sniffLength(data.constData() + pos);
+		if(m >= first) {
+			protocol::NullableMessageRef msg = protocol::Message::deserialize(data, pos, data.length() - pos, false);
+			if(msg.isNull()) {
+				qWarning() << m_recording->fileName() << "Invalid message in block" << block;
+				break;
+			}
+			messages << protocol::MessagePtr::fromNullable(msg);
+		}
+		pos += len;
+	}
+	return messages;
+}
+
+std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
+{
+	const int i = findBlock(after);
 	const Block &b = m_blocks.at(i);
 
 	const int idxOffset = qMax(0, after - b.startIndex + 1);
 	if(idxOffset >= b.count)
 		return std::make_tuple(protocol::MessageList(), b.startIndex+b.count-1);
 
+	if(i < m_blocks.size()-1) {
+		// Closed blocks are cached in serialized form only, so that the
+		// shared cache can account for their memory use
+		QByteArray data = cachedBlock(i);
+		if(data.isEmpty())
+			data = readBlock(i);
+
+		return std::make_tuple(parseBlock(i, data, idxOffset), b.startIndex+b.count-1);
+	}
+
 	if(b.messages.isEmpty() && b.count>0) {
-		// Load the block worth of messages to memory if not already loaded
-		const qint64 prevPos = m_recording->pos();
+		// Load the open block's messages to memory if not already loaded.
+		// New messages are added to the list as they come in.
 		qDebug() << m_recording->fileName() << "loading block" << i;
-		m_recording->seek(b.startOffset);
-		QByteArray buffer;
-		for(int m=0;m<b.count;++m) {
-			if(!recording::readRecordingMessage(m_recording, buffer)) {
-				qWarning() << m_recording->fileName() << "read error!";
-				m_recording->close();
-				break;
-			}
-			protocol::NullableMessageRef msg = protocol::Message::deserialize((const uchar*)buffer.constData(), buffer.length(), false);
-			if(msg.isNull()) {
-				qWarning() << m_recording->fileName() << "Invalid message in block" << i;
-				m_recording->close();
-				break;
+		const QByteArray data = readRecording(b.startOffset, b.endOffset - b.startOffset);
+		const_cast<Block&>(b).messages = parseBlock(i, data, 0);
+	}
+	Q_ASSERT(b.messages.size() == b.count);
+	return std::make_tuple(b.messages.mid(idxOffset), b.startIndex+b.count-1);
+}
+
+FiledHistory::SerializedBatch FiledHistory::getSerializedBatch(int after) const
+{
+	const int i = findBlock(after);
+
+	// The last block is still being written to
+	if(i == m_blocks.size()-1)
+		return SerializedBatch { protocol::ByteSlice(), after, false };
+
+	const Block &b = m_blocks.at(i);
+
+	const int idxOffset = qMax(0, after - b.startIndex + 1);
+	if(idxOffset >= b.count)
+		return SerializedBatch { protocol::ByteSlice(), b.startIndex+b.count-1, false };
+
+	QByteArray data = cachedBlock(i);
+	if(data.isEmpty())
+		data = mapBlock(i, false);
+
+	if(data.isEmpty()) {
+		if(b.loadState == LoadState::Failed)
+			return SerializedBatch { protocol::ByteSlice(), after, false };
+
+		// The block is read in the background so the session's thread is not blocked
+		loadBlockInBackground(i);
+		return SerializedBatch { protocol::ByteSlice(), after, true };
+	}
+
+	// A freshly loaded block is held on to until it's been handed out once,
+	// even if the cache has already evicted it
+	const_cast<Block&>(b).loaded = QByteArray();
+
+	// Read ahead the next block while this one is being sent
+	loadBlockInBackground(i+1);
+
+	// Skip the messages the client already has
+	int pos = 0;
+	for(int m=0;m<idxOffset;++m)
+		pos += protocol::Message::sniffLength(data.constData() + pos);
+
+	return SerializedBatch {
+		protocol::ByteSlice(data, pos, data.length() - pos),
+		b.startIndex+b.count-1,
+		false
+	};
+}
+
+void FiledHistory::loadBlockInBackground(int block) const
+{
+	// Only closed blocks can be read in as is
+	if(block >= m_blocks.size()-1)
+		return;
+
+	const Block &b = m_blocks.at(block);
+	if(b.loadState != LoadState::Idle || !b.loaded.isEmpty() || b.count == 0 || m_cache->contains(m_cacheId, b.startOffset))
+		return;
+
+	// A mapped block is paged in by the kernel instead
+	if(!mapBlock(block, true).isEmpty())
+		return;
+
+	const_cast<Block&>(b).loadState = LoadState::Loading;
+
+	const QString filename = m_recording->fileName();
+	const qint64 offset = b.startOffset;
+	std::shared_ptr<LoaderLink> link = m_loaderLink;
+
+	historyIoPool()->start(new BlockLoaderRunnable(filename, offset, b.endOffset - b.startOffset,
+		[link, filename, offset](const QByteArray &data) {
+			QMutexLocker lock(&link->mutex);
+			if(link->history) {
+				FiledHistory *history = link->history;
+				QMetaObject::invokeMethod(history, "backgroundLoadFinished", Qt::QueuedConnection,
+					Q_ARG(QString, filename), Q_ARG(qint64, offset), Q_ARG(QByteArray, data));
 			}
-			const_cast<Block&>(b).messages << protocol::MessagePtr::fromNullable(msg);
 		}
+	));
+}
 
-		m_recording->seek(prevPos);
+void FiledHistory::backgroundLoadFinished(const QString &filename, qint64 offset, const QByteArray &data)
+{
+	// The history may have been reset while the block was being loaded
+	if(!m_recording || m_recording->fileName() != filename)
+		return;
+
+	for(Block &b : m_blocks) {
+		if(b.startOffset != offset || b.loadState != LoadState::Loading)
+			continue;
+
+		if(data.length() == b.endOffset - b.startOffset) {
+			b.loaded = data;
+			b.loadState = LoadState::Idle;
+			m_cache->insert(m_cacheId, offset, data);
+		} else {
+			qWarning() << filename << "couldn't read block starting at" << offset;
+			b.loadState = LoadState::Failed;
+		}
+
+		emit batchLoaded();
+		break;
 	}
-	Q_ASSERT(b.messages.size() == b.count);
-	return std::make_tuple(b.messages.mid(idxOffset), b.startIndex+b.count-1);
 }
 
 void FiledHistory::historyAdd(const protocol::MessagePtr &msg)
 {
-	QVarLengthArray<char> buf(msg->length());
-	const int len = msg->serialize(buf.data());
-	Q_ASSERT(len == buf.length());
-	m_recording->write(buf.data(), len);
+	// The serialized form is shared with the copies sent to the clients
+	const protocol::ByteSlice buf = msg->serialized();
+	const int len = buf.length();
+	m_pendingWrites.append(buf.constData(), len);
+
+	switch(msg->type()) {
+	case protocol::MSG_USER_JOIN: m_users.insert(msg->contextId()); break;
+	case protocol::MSG_USER_LEAVE:
+		m_users.remove(msg->contextId());
+		m_leftUsers.insert(msg->contextId());
+		break;
+	default: break;
+	}
+	if(m_pendingWrites.length() >= GROUP_COMMIT_SIZE)
+		commitWrites();
+	else
+		scheduleCommit();
 
 	Block &b = m_blocks.last();
 	b.count++;
@@ -604,11 +1184,18 @@ void FiledHistory::historyAdd(const protocol::MessagePtr &msg)
 
 void FiledHistory::historyReset(const protocol::MessageList &newHistory)
 {
+	commitWrites();
+
 	QFile *oldRecording = m_recording;
+	QFile::remove(indexFilename());
 	oldRecording->close();
 
 	m_recording = nullptr;
 	m_blocks.clear();
+	m_users.clear();
+	m_leftUsers.clear();
+	m_indexedBlocks = 0;
+	m_cache->removeOwner(m_cacheId);
 	initRecording();
 
 	// Remove old recording after the new one has been created so
@@ -628,9 +1215,12 @@ void FiledHistory::cleanupBatches(int before)
 	for(Block &b : m_blocks) {
 		if(b.startIndex+b.count >= before)
 			break;
-		if(!b.messages.isEmpty()) {
+		if(!b.messages.isEmpty() || !b.loaded.isEmpty() || m_cache->contains(m_cacheId, b.startOffset)) {
 			qDebug() << "releasing history block cache from" << b.startIndex << "to" << b.startIndex+b.count-1;
 			b.messages = protocol::MessageList();
+			// Clients still sending this block keep their own reference to the data
+			b.loaded = QByteArray();
+			m_cache->remove(m_cacheId, b.startOffset);
 		}
 	}
 }
@@ -645,19 +1235,98 @@ void FiledHistory::historyAddBan(int id, const QString &username, const QHostAdd
 			extAuthId.toUtf8().toPercentEncoding(QByteArray(), include) + " " +
 			bannedBy.toUtf8().toPercentEncoding(QByteArray(), include) + "\n";
 	m_journal->write(entry);
-	m_journal->flush();
+	scheduleCommit();
 }
 
 void FiledHistory::historyRemoveBan(int id)
 {
 	m_journal->write(QByteArray("UNBAN ") + QByteArray::number(id) + "\n");
+	scheduleCommit();
+}
+
+void FiledHistory::scheduleCommit()
+{
+	m_unsynced = true;
+	if(!m_commitTimer->isActive())
+		m_commitTimer->start(GROUP_COMMIT_INTERVAL);
+}
+
+void FiledHistory::commitWrites()
+{
+	m_commitTimer->stop();
+
+	if(!m_pendingWrites.isEmpty()) {
+		m_unsynced = true;
+		m_recording->write(m_pendingWrites);
+		m_pendingWrites.truncate(0);
+	}
+	m_recording->flush();
 	m_journal->flush();
+
+	syncIfDue();
+}
+
+void FiledHistory::syncIfDue()
+{
+	if(m_syncInterval < 0 || !m_unsynced)
+		return;
+
+	if(m_lastSync.isValid() && m_lastSync.elapsed() < m_syncInterval) {
+		// Come back when the next sync is due
+		if(!m_commitTimer->isActive())
+			m_commitTimer->start(m_syncInterval - int(m_lastSync.elapsed()));
+		return;
+	}
+
+	m_unsynced = false;
+	m_lastSync.start();
+
+#ifdef Q_OS_UNIX
+	QMutexLocker lock(&m_syncQueue->mutex);
+
+	// A sync of the same files is already waiting: it will cover this one too
+	if(m_syncQueue->running && !m_syncQueue->pending.isEmpty() && m_syncQueue->pendingFileCount == m_fileCount)
+		return;
+
+	// The files may be closed before the sync is done, so it gets its own descriptors
+	QVector<int> fds;
+	for(const QFile *f : { m_recording, m_journal }) {
+		const int fd = f && f->isOpen() ? ::dup(f->handle()) : -1;
+		if(fd >= 0)
+			fds << fd;
+	}
+
+	if(m_syncQueue->running) {
+		m_syncQueue->pending << fds;
+		m_syncQueue->pendingFileCount = m_fileCount;
+	} else {
+		m_syncQueue->running = true;
+
+		std::shared_ptr<SyncQueue> queue = m_syncQueue;
+		historySyncPool()->start(new FileSyncRunnable(fds, [queue](QVector<int> &next) {
+			QMutexLocker lock(&queue->mutex);
+			if(queue->pending.isEmpty()) {
+				queue->running = false;
+				return false;
+			}
+			next = queue->pending;
+			queue->pending.clear();
+			return true;
+		}));
+	}
+#endif
 }
 
 void FiledHistory::timerEvent(QTimerEvent *)
 {
-	if(m_recording)
-		m_recording->flush();
+	if(!m_recording)
+		return;
+
+	// The index is updated when there are new closed blocks to add to it
+	if(m_blocks.size() != m_indexedBlocks)
+		saveIndex();
+	else
+		commitWrites();
 }
 
 void FiledHistory::addAnnouncement(const QString &url)
@@ -665,7 +1334,7 @@ void FiledHistory::addAnnouncement(const QString &url)
 	if(!m_announcements.contains(url)) {
 		m_announcements << url;
 		m_journal->write(QString("ANNOUNCE %1\n").arg(url).toUtf8());
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -674,7 +1343,7 @@ void FiledHistory::removeAnnouncement(const QString &url)
 	if(m_announcements.contains(url)) {
 		m_announcements.removeAll(url);
 		m_journal->write(QString("UNANNOUNCE %1\n").arg(url).toUtf8());
-		m_journal->flush();
+		scheduleCommit();
 	}
 }
 
@@ -687,13 +1356,13 @@ void FiledHistory::setAuthenticatedOperator(const QString &authId, bool op)
 		if(!m_ops.contains(authId)) {
 			m_ops.insert(authId);
 			m_journal->write(QStringLiteral("OP %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			scheduleCommit();
 		}
 	} else {
 		if(m_ops.contains(authId)) {
 			m_ops.remove(authId);
 			m_journal->write(QStringLiteral("DEOP %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			scheduleCommit();
 		}
 	}
 }
@@ -707,13 +1376,13 @@ void FiledHistory::setAuthenticatedTrust(const QString &authId, bool trusted)
 		if(!m_trusted.contains(authId)) {
 			m_trusted.insert(authId);
 			m_journal->write(QStringLiteral("TRUST %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			scheduleCommit();
 		}
 	} else {
 		if(m_trusted.contains(authId)) {
 			m_trusted.remove(authId);
 			m_journal->write(QStringLiteral("UNTRUST %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			scheduleCommit();
 		}
 	}
 }
@@ -26,9 +26,16 @@
 #include <QDir>
 #include <QVector>
 #include <QSet>
+#include <QElapsedTimer>
+
+#include <memory>
+
+class QTimer;
 
 namespace server {
 
+class HistoryCache;
+
 class FiledHistory : public SessionHistory
 {
 	Q_OBJECT
@@ -69,6 +76,23 @@ public:
 	 */
 	void setArchive(bool archive) { m_archive = archive; }
 
+	/**
+	 * @brief Cache closed blocks in a cache shared with other sessions
+	 *
+	 * By default, each history has its own cache with no size limit.
+	 */
+	void setCache(const std::shared_ptr<HistoryCache> &cache);
+
+	/**
+	 * @brief Set how often the session files are synced to disk
+	 *
+	 * Writes are always committed to the operating system in small groups.
+	 * This sets how often the committed writes are also fsync'd.
+	 *
+	 * @param ms minimum time between syncs in milliseconds (0 means every commit and -1 never)
+	 */
+	void setSyncInterval(int ms) { m_syncInterval = ms; }
+
 	//! Get the metadata journal file name for the given session ID
 	static QString journalFilename(const QString &id);
 
@@ -93,6 +117,7 @@ public:
 	void terminate() override;
 	void cleanupBatches(int before) override;
 	std::tuple<protocol::MessageList, int> getBatch(int after) const override;
+	SerializedBatch getSerializedBatch(int after) const override;
 
 	void addAnnouncement(const QString &) override;
 	void removeAnnouncement(const QString &url) override;
@@ -112,21 +137,50 @@ protected:
 
 	void timerEvent(QTimerEvent *event) override;
 
+private slots:
+	// Called from a history I/O thread through a queued call
+	void backgroundLoadFinished(const QString &filename, qint64 offset, const QByteArray &data);
+
 private:
 	FiledHistory(const QDir &dir, QFile *journal, const QString &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent);
 	FiledHistory(const QDir &dir, QFile *journal, const QString &id, QObject *parent);
 
+	enum class LoadState {
+		Idle,    // not being loaded (check the cache to see if it has been)
+		Loading, // being read in the background
+		Failed   // couldn't be read in the background
+	};
+
 	struct Block {
 		qint64 startOffset;
 		int startIndex;
 		int count;
 		qint64 endOffset;
 		protocol::MessageList messages;
+		QByteArray loaded;     // a background load's result, until handed out (the cache may evict it before that)
+		LoadState loadState;
 	};
 
+	struct LoaderLink;
+	struct SyncQueue;
+
 	bool create();
 	bool load();
 	bool scanBlocks();
+	QString indexFilename() const;
+	QByteArray indexChecksum(qint64 end) const;
+	bool loadIndex(qint64 startOffset);
+	void saveIndex();
+	int findBlock(int after) const;
+	QByteArray cachedBlock(int block) const;
+	QByteArray readBlock(int block) const;
+	QByteArray mapBlock(int block, bool prefetch) const;
+	QByteArray readRecording(qint64 offset, qint64 length) const;
+	protocol::MessageList parseBlock(int block, const QByteArray &data, int first) const;
+	void scheduleCommit();
+	void commitWrites();
+	void syncIfDue();
+	void loadBlockInBackground(int block) const;
 	bool initRecording();
 
 	QDir m_dir;
@@ -148,6 +202,21 @@ private:
 	QSet<QString> m_trusted;
 
 	QVector<Block> m_blocks;
+	std::shared_ptr<LoaderLink> m_loaderLink; // lets background loads report back to us safely
+	std::shared_ptr<SyncQueue> m_syncQueue;   // the sync in progress and the one waiting for it
+	std::shared_ptr<HistoryCache> m_cache;    // where closed blocks are cached (in serialized form)
+	quint64 m_cacheId;                        // our ID in the cache
+
+	QByteArray m_pendingWrites;               // recording content not yet written to the file
+	QTimer *m_commitTimer;
+	QElapsedTimer m_lastSync;
+	int m_syncInterval;
+	bool m_unsynced;                          // has something been written since the last sync?
+
+	QSet<uint8_t> m_users;                    // users who have joined (and not left) in the recording
+	QSet<uint8_t> m_leftUsers;                // users who have left in the recording (their IDs are reserved at load)
+	int m_indexedBlocks;                      // number of blocks when the block index was last saved
+
 	int m_fileCount;
 	bool m_archive;
 };
@@ -0,0 +1,200 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "historycache.h"
+
+#include <QJsonObject>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+namespace server {
+
+HistoryCache::HistoryCache(qint64 limit)
+	: m_limit(limit), m_size(0), m_hits(0), m_misses(0), m_evictions(0)
+{
+}
+
+HistoryCache::~HistoryCache()
+{
+	for(const Entry &e : m_entries)
+		retire(e);
+	m_entries.clear();
+	releaseRetired();
+
+	// Whatever is still in use at this point (we're probably shutting down)
+	// is left as is. Releasing the backing would pull the memory out from
+	// under whoever is still using it.
+	for(Retired &r : m_retired)
+		new std::shared_ptr<void>(std::move(r.backing));
+}
+
+quint64 HistoryCache::newOwnerId()
+{
+	static std::atomic<quint64> lastId(0);
+	return ++lastId;
+}
+
+void HistoryCache::setLimit(qint64 limit)
+{
+	QMutexLocker lock(&m_mutex);
+	m_limit = limit;
+	evict(Key(0, -1));
+	releaseRetired();
+}
+
+QByteArray HistoryCache::get(quint64 owner, qint64 block)
+{
+	QMutexLocker lock(&m_mutex);
+
+	auto i = m_entries.find(Key(owner, block));
+	if(i == m_entries.end()) {
+		++m_misses;
+		return QByteArray();
+	}
+
+	++m_hits;
+	m_lru.splice(m_lru.end(), m_lru, i->lru);
+	return i->data;
+}
+
+bool HistoryCache::contains(quint64 owner, qint64 block) const
+{
+	QMutexLocker lock(&m_mutex);
+	return m_entries.contains(Key(owner, block));
+}
+
+void HistoryCache::insert(quint64 owner, qint64 block, const QByteArray &data, const std::shared_ptr<void> &backing)
+{
+	QMutexLocker lock(&m_mutex);
+	releaseRetired();
+
+	const Key key(owner, block);
+	auto i = m_entries.find(key);
+	if(i != m_entries.end())
+		removeEntry(i);
+
+	m_lru.push_back(key);
+	m_entries.insert(key, Entry { data, std::prev(m_lru.end()), backing });
+	m_size += data.length();
+
+	evict(key);
+}
+
+void HistoryCache::remove(quint64 owner, qint64 block)
+{
+	QMutexLocker lock(&m_mutex);
+
+	auto i = m_entries.find(Key(owner, block));
+	if(i != m_entries.end())
+		removeEntry(i);
+	releaseRetired();
+}
+
+void HistoryCache::removeOwner(quint64 owner)
+{
+	QMutexLocker lock(&m_mutex);
+
+	auto i = m_entries.begin();
+	while(i != m_entries.end()) {
+		if(i.key().first == owner) {
+			m_size -= i->data.length();
+			m_lru.erase(i->lru);
+			retire(*i);
+			i = m_entries.erase(i);
+		} else {
+			++i;
+		}
+	}
+	releaseRetired();
+}
+
+void HistoryCache::removeEntry(QHash<Key, Entry>::iterator i)
+{
+	m_size -= i->data.length();
+	m_lru.erase(i->lru);
+	retire(*i);
+	m_entries.erase(i);
+}
+
+void HistoryCache::retire(const Entry &entry)
+{
+	// Data that owns its memory can just be dropped: whoever
+	// still has a copy of it keeps the buffer alive
+	if(entry.backing)
+		m_retired.push_back(Retired { entry.data, entry.backing });
+}
+
+void HistoryCache::releaseRetired()
+{
+	// A raw data array is still refcounted, so when our copy is the only
+	// one left, nobody else can be using the backing memory anymore
+	m_retired.erase(
+		std::remove_if(m_retired.begin(), m_retired.end(), [](const Retired &r) { return r.data.isDetached(); }),
+		m_retired.end()
+	);
+}
+
+void HistoryCache::evict(const Key &keep)
+{
+	if(m_limit <= 0)
+		return;
+
+	auto lru = m_lru.begin();
+	while(m_size > m_limit && lru != m_lru.end()) {
+		if(*lru == keep) {
+			++lru;
+			continue;
+		}
+
+		auto i = m_entries.find(*lru);
+		++lru;
+		removeEntry(i);
+		++m_evictions;
+	}
+}
+
+HistoryCache::Stats HistoryCache::stats() const
+{
+	QMutexLocker lock(&m_mutex);
+	return Stats {
+		m_hits,
+		m_misses,
+		m_evictions,
+		m_entries.size(),
+		m_size,
+		m_limit
+	};
+}
+
+QJsonObject HistoryCache::Stats::toJson() const
+{
+	return QJsonObject {
+		{"hits", hits},
+		{"misses", misses},
+		{"evictions", evictions},
+		{"blocks", blocks},
+		{"residentBytes", residentBytes},
+		{"limitBytes", limit}
+	};
+}
+
+}
@@ -0,0 +1,148 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_HISTORYCACHE_H
+#define DP_SERVER_HISTORYCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+
+#include <list>
+#include <memory>
+#include <vector>
+
+class QJsonObject;
+
+namespace server {
+
+/**
+ * @brief A memory budgeted cache of serialized history blocks
+ *
+ * One cache is shared by all the file backed session histories of a server.
+ * When the total size of the cached blocks exceeds the budget, the least
+ * recently used blocks are evicted.
+ *
+ * The cached data is implicitly shared, so evicting a block that a client
+ * is still sending just drops the cache's reference to it.
+ *
+ * A block may also point to memory the cache doesn't own (such as a
+ * memory mapped part of a file.) Such a block is inserted together with
+ * the object that keeps its memory valid. When the block is removed from
+ * the cache, the backing object is released only once nothing refers to
+ * the block's data anymore.
+ *
+ * This class is thread-safe.
+ */
+class HistoryCache {
+public:
+	//! Cache statistics
+	struct Stats {
+		qint64 hits;
+		qint64 misses;
+		qint64 evictions;
+		qint64 blocks;
+		qint64 residentBytes;
+		qint64 limit;
+
+		QJsonObject toJson() const;
+	};
+
+	/**
+	 * @brief Construct a cache
+	 * @param limit maximum size in bytes (0 means no limit)
+	 */
+	explicit HistoryCache(qint64 limit=0);
+	~HistoryCache();
+
+	//! Set the maximum size in bytes (0 means no limit)
+	void setLimit(qint64 limit);
+
+	//! Get a new unique ID for a cache user
+	static quint64 newOwnerId();
+
+	/**
+	 * @brief Look up a cached block
+	 *
+	 * A successful lookup marks the block as recently used.
+	 *
+	 * @param owner ID of the history the block belongs to
+	 * @param block key of the block (unique within the owner)
+	 * @return block content or an empty array if not cached
+	 */
+	QByteArray get(quint64 owner, qint64 block);
+
+	//! Is the block cached? (This doesn't count as a use)
+	bool contains(quint64 owner, qint64 block) const;
+
+	/**
+	 * @brief Add a block to the cache
+	 *
+	 * Least recently used blocks are evicted if the cache goes over its limit.
+	 * The newly added block itself is never evicted here, even if it alone
+	 * is bigger than the limit.
+	 *
+	 * @param backing if the data was made with QByteArray::fromRawData, the object that owns the memory
+	 */
+	void insert(quint64 owner, qint64 block, const QByteArray &data, const std::shared_ptr<void> &backing=std::shared_ptr<void>());
+
+	//! Remove a block from the cache
+	void remove(quint64 owner, qint64 block);
+
+	//! Remove all blocks of the given owner
+	void removeOwner(quint64 owner);
+
+	//! Get the current statistics
+	Stats stats() const;
+
+private:
+	typedef QPair<quint64, qint64> Key;
+
+	struct Entry {
+		QByteArray data;
+		std::list<Key>::iterator lru;
+		std::shared_ptr<void> backing;
+	};
+
+	struct Retired {
+		QByteArray data;
+		std::shared_ptr<void> backing;
+	};
+
+	void removeEntry(QHash<Key, Entry>::iterator i);
+	void retire(const Entry &entry);
+	void releaseRetired();
+	void evict(const Key &keep);
+
+	mutable QMutex m_mutex;
+	QHash<Key, Entry> m_entries;
+	std::list<Key> m_lru; // least recently used first
+	std::vector<Retired> m_retired; // removed blocks whose backing memory is still in use
+
+	qint64 m_limit;
+	qint64 m_size;
+	qint64 m_hits;
+	qint64 m_misses;
+	qint64 m_evictions;
+};
+
+}
+
+#endif
@@ -21,10 +21,12 @@
 #include "client.h"
 #include "session.h"
 #include "sessions.h"
+#include "sessionworkers.h"
 #include "serverconfig.h"
 #include "serverlog.h"
 
 #include "../libshared/net/control.h"
+#include "../libshared/net/messagequeue.h"
 #include "../libshared/util/authtoken.h"
 #include "../libshared/util/networkaccess.h"
 #include "../libshared/util/validators.h"
@@ -46,6 +48,18 @@ Sessions::~Sessions()
 {
 }
 
+bool Sessions::isSessionUnavailable(const QString &id) const
+{
+	Q_UNUSED(id);
+	return false;
+}
+
+void Sessions::handOverClient(Client *client, Session *session)
+{
+	Q_UNUSED(client);
+	Q_UNUSED(session);
+}
+
 LoginHandler::LoginHandler(Client *client, Sessions *sessions, ServerConfig *config)
 	: QObject(client), m_client(client), m_sessions(sessions), m_config(config)
 {
@@ -77,6 +91,9 @@ void LoginHandler::startLoginProcess()
 		flags << "REPORT";
 	if(m_config->getConfigBool(config::AllowCustomAvatars))
 		flags << "AVATAR";
+	if(m_config->getConfigInt(config::CompressionLevel) > 0 && protocol::MessageQueue::isCompressionSupported())
+		flags << "DEFLATE";
+	flags << "TRACE";
 
 	greeting.reply["flags"] = flags;
 
@@ -175,6 +192,8 @@ void LoginHandler::handleLoginMessage(protocol::MessagePtr msg)
 		// Wait for user identification before moving on to session listing
 		if(cmd.cmd == "ident") {
 			handleIdentMessage(cmd);
+		} else if(cmd.cmd == "compress") {
+			handleCompress(cmd);
 		} else {
 			m_client->log(Log().about(Log::Level::Error, Log::Topic::RuleBreak).message("Invalid login command (while waiting for ident): " + cmd.cmd));
 			m_client->disconnectClient(Client::DisconnectionReason::Error, "invalid message");
@@ -562,10 +581,6 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	if(cmd.kwargs["password"].isString())
-		session->history()->setPassword(cmd.kwargs["password"].toString());
-
-	// Mark login phase as complete. No more login messages will be sent to this user
 	protocol::ServerReply reply;
 	reply.type = protocol::ServerReply::RESULT;
 	reply.message = "Starting new session!";
@@ -574,14 +589,18 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 	QJsonObject joinInfo;
 	joinInfo["id"] = sessionAlias.isEmpty() ? session->id() : sessionAlias;
 	joinInfo["user"] = userId;
-	joinInfo["flags"] = sessionFlags(session);
-	reply.reply["join"] = joinInfo;
-	send(reply);
 
-	m_complete = true;
-	session->joinUser(m_client, true);
+	// The session may already be running in a worker thread
+	SessionWorkers::call(session, [&]() {
+		if(cmd.kwargs["password"].isString())
+			session->history()->setPassword(cmd.kwargs["password"].toString());
 
-	deleteLater();
+		joinInfo["flags"] = sessionFlags(session);
+	});
+
+	reply.reply["join"] = joinInfo;
+
+	joinSession(session, reply, true);
 }
 
 void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
@@ -594,62 +613,94 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 
 	QString sessionId = cmd.args.at(0).toString();
 
+	if(m_sessions->isSessionUnavailable(sessionId)) {
+		sendError("tryAgain", "Session is being saved. Please try again in a moment.");
+		return;
+	}
+
 	Session *session = m_sessions->getSessionById(sessionId, true);
 	if(!session) {
 		sendError("notFound", "Session not found!");
 		return;
 	}
 
-	if(!m_client->isModerator()) {
-		// Non-moderators have to obey access restrictions
-		if(session->history()->banlist().isBanned(m_client->peerAddress(), m_client->authId())) {
-			sendError("banned", "You have been banned from this session");
-			return;
-		}
-		if(session->isClosed()) {
-			sendError("closed", "This session is closed");
-			return;
-		}
-		if(session->history()->hasFlag(SessionHistory::AuthOnly) && !m_client->isAuthenticated()) {
-			sendError("authOnly", "This session does not allow guest logins");
-			return;
-		}
+	// Check access and reserve a user ID in the session's own thread
+	QString errorCode, errorMessage;
+	QJsonObject joinInfo;
 
-		if(!session->history()->checkPassword(cmd.kwargs.value("password").toString())) {
-			sendError("badPassword", "Incorrect password");
-			return;
+	SessionWorkers::call(session, [&]() {
+		if(!m_client->isModerator()) {
+			// Non-moderators have to obey access restrictions
+			if(session->history()->banlist().isBanned(m_client->peerAddress(), m_client->authId())) {
+				errorCode = "banned";
+				errorMessage = "You have been banned from this session";
+				return;
+			}
+			if(session->isClosed()) {
+				errorCode = "closed";
+				errorMessage = "This session is closed";
+				return;
+			}
+			if(session->history()->hasFlag(SessionHistory::AuthOnly) && !m_client->isAuthenticated()) {
+				errorCode = "authOnly";
+				errorMessage = "This session does not allow guest logins";
+				return;
+			}
+
+			if(!session->history()->checkPassword(cmd.kwargs.value("password").toString())) {
+				errorCode = "badPassword";
+				errorMessage = "Incorrect password";
+				return;
+			}
 		}
-	}
 
-	if(session->getClientByUsername(m_client->username())) {
+		if(session->getClientByUsername(m_client->username())) {
 #ifdef NDEBUG
-		sendError("nameInuse", "This username is already in use");
-		return;
+			errorCode = "nameInuse";
+			errorMessage = "This username is already in use";
+			return;
 #else
-		// Allow identical usernames in debug builds, so I don't have to keep changing
-		// the username when testing. There is no technical requirement for unique usernames;
-		// the limitation is solely for the benefit of the human users.
-		m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Username clash ignored because this is a debug build."));
+			// Allow identical usernames in debug builds, so I don't have to keep changing
+			// the username when testing. There is no technical requirement for unique usernames;
+			// the limitation is solely for the benefit of the human users.
+			m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Username clash ignored because this is a debug build."));
 #endif
-	}
+		}
+
+		// Ok, join the session
+		session->assignId(m_client);
 
-	// Ok, join the session
-	session->assignId(m_client);
+		joinInfo["id"] = session->aliasOrId();
+		joinInfo["user"] = m_client->id();
+		joinInfo["flags"] = sessionFlags(session);
+	});
+
+	if(!errorCode.isEmpty()) {
+		sendError(errorCode, errorMessage);
+		return;
+	}
 
 	protocol::ServerReply reply;
 	reply.type = protocol::ServerReply::RESULT;
 	reply.message = "Joining a session!";
 	reply.reply["state"] = "join";
-	QJsonObject joinInfo;
-	joinInfo["id"] = session->aliasOrId();
-	joinInfo["user"] = m_client->id();
-	joinInfo["flags"] = sessionFlags(session);
 	reply.reply["join"] = joinInfo;
-	send(reply);
 
-	m_complete = true;
+	joinSession(session, reply, false);
+}
+
+void LoginHandler::joinSession(Session *session, const protocol::ServerReply &reply, bool host)
+{
+	// From here on, the client belongs to the session's thread
+	m_sessions->handOverClient(m_client, session);
+
+	SessionWorkers::call(session, [this, session, &reply, host]() {
+		send(reply);
 
-	session->joinUser(m_client, false);
+		// Mark login phase as complete. No more login messages will be sent to this user
+		m_complete = true;
+		session->joinUser(m_client, host);
+	});
 
 	deleteLater();
 }
@@ -658,7 +709,10 @@ void LoginHandler::handleAbuseReport(const protocol::ServerCommand &cmd)
 {
 	Session *s = m_sessions->getSessionById(cmd.kwargs["session"].toString(), false);
 	if(s) {
-		s->sendAbuseReport(m_client, 0, cmd.kwargs["reason"].toString());
+		const QString reason = cmd.kwargs["reason"].toString();
+		SessionWorkers::call(s, [this, s, &reason]() {
+			s->sendAbuseReport(m_client, 0, reason);
+		});
 	}
 }
 
@@ -685,6 +739,32 @@ void LoginHandler::handleStarttls()
 	m_state = State::WaitForIdent;
 }
 
+void LoginHandler::handleCompress(const protocol::ServerCommand &cmd)
+{
+	// Note. Well behaved clients only send this if DEFLATE was listed in server features.
+	const int level = m_config->getConfigInt(config::CompressionLevel);
+	if(level <= 0 || !protocol::MessageQueue::isCompressionSupported()) {
+		sendError("noCompression", "Compression not supported");
+		return;
+	}
+
+	if(cmd.args.size() != 1 || cmd.args.at(0).toString() != "deflate") {
+		sendError("syntax", "Unsupported compression method");
+		return;
+	}
+
+	protocol::ServerReply reply;
+	reply.type = protocol::ServerReply::LOGIN;
+	reply.message = "Compression enabled";
+	reply.reply["compress"] = "deflate";
+	send(reply);
+
+	// The client won't send anything until it has received the reply,
+	// and everything we send after it will be compressed.
+	if(!m_client->startCompression(level))
+		m_client->disconnectClient(Client::DisconnectionReason::Error, "Compression error");
+}
+
 bool LoginHandler::send(const protocol::ServerReply &cmd)
 {
 	if(!m_complete) {
@@ -106,7 +106,9 @@ private:
 	void handleHostMessage(const protocol::ServerCommand &cmd);
 	void handleJoinMessage(const protocol::ServerCommand &cmd);
 	void handleAbuseReport(const protocol::ServerCommand &cmd);
+	void joinSession(Session *session, const protocol::ServerReply &reply, bool host);
 	void handleStarttls();
+	void handleCompress(const protocol::ServerCommand &cmd);
 	void requestExtAuth();
 	void guestLogin(const QString &username);
 	void authLoginOk(const QString &username, const QString &authId, const QStringList &flags, const QByteArray &avatar, bool allowMod, bool allowHost);
@@ -19,6 +19,7 @@
 
 #include "serverconfig.h"
 
+#include <QMutexLocker>
 #include <QRegularExpression>
 
 namespace server {
@@ -26,6 +27,7 @@ namespace server {
 QString ServerConfig::getConfigString(ConfigKey key) const
 {
 	bool found;
+	QMutexLocker lock(&m_configMutex);
 	const QString val = getConfigValue(key, found);
 	if(!found) {
 		return key.defaultValue;
@@ -109,6 +111,7 @@ bool ServerConfig::setConfigString(ConfigKey key, const QString &value)
 
 	// TODO key specific validation
 
+	QMutexLocker lock(&m_configMutex);
 	setConfigValue(key, value);
 	return true;
 }
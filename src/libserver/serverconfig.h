@@ -21,6 +21,7 @@
 #define SERVERCONFIG_H
 
 #include <QObject>
+#include <QMutex>
 #include <QString>
 #include <QHash>
 #include <QUrl>
@@ -76,7 +77,9 @@ namespace config {
 		LogPurgeDays(20, "logpurgedays", "0", ConfigKey::INT),               // Automatically purge log entries older than this many days (DB log only)
 		AutoresetThreshold(21, "autoResetThreshold", "15mb", ConfigKey::SIZE), // Default autoreset threshold in bytes
 		AllowCustomAvatars(22, "customAvatars", "true", ConfigKey::BOOL),      // Allow users to set a custom avatar when logging in
-		ExtAuthAvatars(23, "extAuthAvatars", "true", ConfigKey::BOOL)          // Use avatars received from ext-auth server (unless a custom avatar has been set)
+		ExtAuthAvatars(23, "extAuthAvatars", "true", ConfigKey::BOOL),         // Use avatars received from ext-auth server (unless a custom avatar has been set)
+		CompressionLevel(24, "compressionLevel", "6", ConfigKey::INT),         // Network stream compression level (1-9) offered to clients. 0 disables compression
+		HibernationTime(25, "hibernationTime", "0", ConfigKey::TIME)           // Unload persistent sessions that have been empty and idle this long (0 disables)
 		;
 }
 
@@ -87,6 +90,10 @@ struct InternalConfig {
 	int announcePort = 0;  // The port to use in session announcements
 	QUrl extAuthUrl;       // URL of the external authentication server
 	QUrl reportUrl;        // Abuse report handler backend URL
+	bool ioThread = false; // Do client network I/O in a separate thread
+	int workerThreads = 0; // Number of threads to run sessions in (0 means the main thread)
+	qint64 historyCacheSize = 0; // Memory budget (in bytes) for cached history blocks of file backed sessions (0 means no limit)
+	int historySyncInterval = -1; // Minimum time (ms) between fsyncs of session files (0 means sync every write, -1 never)
 
 	int getAnnouncePort() const { return announcePort > 0 ? announcePort : realPort; }
 };
@@ -111,6 +118,10 @@ struct RegisteredUser {
  * These are the configuration settings that can be changed at runtime.
  * The default storage implementation is a simple in-memory key/value map.
  * Deriving classes can implement persistent storage of settings.
+ *
+ * The configuration may be read from the session worker threads, so
+ * getConfigValue and setConfigValue are called with m_configMutex held.
+ * Deriving classes should hold it too when accessing the same data elsewhere.
  */
 class ServerConfig : public QObject
 {
@@ -195,6 +206,8 @@ protected:
 	virtual QString getConfigValue(const ConfigKey key, bool &found) const = 0;
 	virtual void setConfigValue(const ConfigKey key, const QString &value) = 0;
 
+	mutable QMutex m_configMutex;
+
 private:
 	InternalConfig m_internalCfg;
 };
@@ -22,6 +22,7 @@
 
 #include <QDateTime>
 #include <QHostAddress>
+#include <QMutex>
 
 #include "../libshared/util/ulid.h"
 
@@ -211,6 +212,8 @@ void Log::to(ServerLog *logger)
 
 /**
  * @brief A simple ServerLog implementation that keeps the latest messages in memory
+ *
+ * This is safe to use from multiple threads.
  */
 class InMemoryLog : public ServerLog
 {
@@ -224,6 +227,7 @@ protected:
 	void storeMessage(const Log &entry) override;
 
 private:
+	mutable QMutex m_mutex;
 	QList<Log> m_history;
 	int m_limit;
 };
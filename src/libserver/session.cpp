@@ -23,9 +23,11 @@
 #include "serverlog.h"
 #include "opcommands.h"
 #include "announcements.h"
+#include "sessionworkers.h"
 
 #include "../libshared/net/control.h"
 #include "../libshared/net/meta.h"
+#include "../libshared/net/meta2.h"
 #include "../libshared/record/writer.h"
 #include "../libshared/util/filename.h"
 #include "../libshared/util/passwordhash.h"
@@ -663,6 +665,18 @@ void Session::handleClientMessage(Client &client, protocol::MessagePtr msg)
 			}
 			return;
 		}
+		case protocol::MSG_TRACE_MARK: {
+			// Latency tracing marks get the relay time stamped on them and
+			// are passed on to everyone, but are not kept in the history
+			const protocol::ByteSlice wire = msg->serialized();
+			const protocol::NullableMessageRef mark = protocol::Message::deserialize(
+				reinterpret_cast<const uchar*>(wire.constData()), wire.length(), true);
+			if(!mark.isNull()) {
+				directToAll(protocol::MessagePtr(mark.cast<protocol::TraceMark>().stamped(
+					protocol::TraceMark::ServerRelay, protocol::TraceMark::timestamp())));
+			}
+			return;
+		}
 		case protocol::MSG_TRUSTED_USERS: {
 			if(!client.isOperator()) {
 				log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Tried to change trusted user list"));
@@ -803,7 +817,10 @@ void Session::killSession(bool terminate)
 	if(terminate)
 		m_history->terminate();
 
-	this->deleteLater();
+	emit sessionKilled(this);
+
+	if(!m_deletedByOwner)
+		this->deleteLater();
 }
 
 void Session::directToAll(protocol::MessagePtr msg)
@@ -943,13 +960,20 @@ QStringList Session::userNames() const
 void Session::makeAnnouncement(const QUrl &url, bool privateListing)
 {
 	Q_ASSERT(m_announcements);
-	m_announcements->announceSession(this, url, privateListing ? sessionlisting::PrivacyMode::Private : sessionlisting::PrivacyMode::Public);
+
+	// The announcements object lives in the main thread
+	const auto mode = privateListing ? sessionlisting::PrivacyMode::Private : sessionlisting::PrivacyMode::Public;
+	QTimer::singleShot(0, m_announcements, [this, url, mode]() {
+		m_announcements->announceSession(this, url, mode);
+	});
 }
 
 void Session::unlistAnnouncement(const QUrl &url, bool terminate)
 {
 	Q_ASSERT(m_announcements);
-	m_announcements->unlistSession(this, url);
+	QTimer::singleShot(0, m_announcements, [this, url]() {
+		m_announcements->unlistSession(this, url);
+	});
 
 	if(terminate)
 		m_history->removeAnnouncement(url.toString());
@@ -957,22 +981,32 @@ void Session::unlistAnnouncement(const QUrl &url, bool terminate)
 
 sessionlisting::Session Session::getSessionAnnouncement() const
 {
-	const bool privateUserList = m_config->getConfigBool(config::PrivateUserList);
-
-	return sessionlisting::Session {
-		m_config->internalConfig().localHostname,
-		m_config->internalConfig().getAnnouncePort(),
-		aliasOrId(),
-		m_history->protocolVersion(),
-		m_history->title(),
-		userCount(),
-		(!m_history->passwordHash().isEmpty() || privateUserList) ? QStringList() : userNames(),
-		!m_history->passwordHash().isEmpty(),
-		m_history->hasFlag(SessionHistory::Nsfm),
-		sessionlisting::PrivacyMode::Undefined,
-		m_history->founderName(),
-		m_history->startTime()
-	};
+	// Called from the main thread by the announcements object
+	return SessionWorkers::call(const_cast<Session*>(this), [this]() {
+		const bool privateUserList = m_config->getConfigBool(config::PrivateUserList);
+
+		return sessionlisting::Session {
+			m_config->internalConfig().localHostname,
+			m_config->internalConfig().getAnnouncePort(),
+			aliasOrId(),
+			m_history->protocolVersion(),
+			m_history->title(),
+			userCount(),
+			(!m_history->passwordHash().isEmpty() || privateUserList) ? QStringList() : userNames(),
+			!m_history->passwordHash().isEmpty(),
+			m_history->hasFlag(SessionHistory::Nsfm),
+			sessionlisting::PrivacyMode::Undefined,
+			m_history->founderName(),
+			m_history->startTime()
+		};
+	});
+}
+
+void Session::sendListserverMessage(const QString &message)
+{
+	QTimer::singleShot(0, this, [this, message]() {
+		messageAll(message, false);
+	});
 }
 
 
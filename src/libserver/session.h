@@ -257,7 +257,7 @@ public:
 
 	sessionlisting::Session getSessionAnnouncement() const override;
 
-	void sendListserverMessage(const QString &message) override { messageAll(message, false); }
+	void sendListserverMessage(const QString &message) override;
 
 	//! Get the session state
 	State state() const { return m_state; }
@@ -351,6 +351,9 @@ signals:
 	 */
 	void sessionAttributeChanged(Session *thisSession);
 
+	//! This session was just shut down
+	void sessionKilled(Session *thisSession);
+
 private slots:
 	void removeUser(Client *user);
 	void onAnnouncementsChanged(const Announcable *session);
@@ -435,6 +438,7 @@ private:
 	QElapsedTimer m_lastEventTime;
 
 	bool m_closed = false;
+	bool m_deletedByOwner = false;
 };
 
 }
@@ -88,6 +88,11 @@ bool SessionHistory::reset(const protocol::MessageList &newHistory)
 	return true;
 }
 
+SessionHistory::SerializedBatch SessionHistory::getSerializedBatch(int after) const
+{
+	return SerializedBatch { protocol::ByteSlice(), after, false };
+}
+
 uint SessionHistory::effectiveAutoResetThreshold() const
 {
 	uint t = autoResetThreshold();
@@ -159,6 +159,30 @@ public:
 	 */
 	virtual std::tuple<protocol::MessageList, int> getBatch(int after) const = 0;
 
+	//! A batch of messages in serialized form
+	struct SerializedBatch {
+		protocol::ByteSlice data; // empty if the batch is not available in this form
+		int lastIndex;            // index of the last message in the batch
+		bool pending;             // the batch is being loaded and batchLoaded() will be emitted
+	};
+
+	/**
+	 * @brief Get a batch of messages in serialized form
+	 *
+	 * This works like getBatch(), except that the messages are returned
+	 * as a single pre-serialized buffer. The buffer is shared, so any number
+	 * of clients can stream the same batch without re-encoding it.
+	 *
+	 * This function never blocks. If the batch must first be read from
+	 * storage, it is loaded in the background and the returned batch
+	 * is marked as pending. Try again when batchLoaded() is emitted.
+	 *
+	 * If the history cannot provide a serialized buffer for this position,
+	 * the returned buffer is empty and getBatch() should be used instead.
+	 * The default implementation always does so.
+	 */
+	virtual SerializedBatch getSerializedBatch(int after) const;
+
 	/**
 	 * @brief Mark messages before the given index as unneeded (for now)
 	 *
@@ -297,6 +321,11 @@ signals:
 	 */
 	void newMessagesAvailable();
 
+	/**
+	 * @brief A batch that was pending in getSerializedBatch() has been loaded
+	 */
+	void batchLoaded();
+
 protected:
 	virtual void historyAdd(const protocol::MessagePtr &msg) = 0;
 	virtual void historyReset(const protocol::MessageList &newHistory) = 0;
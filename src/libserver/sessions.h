@@ -31,6 +31,7 @@ namespace protocol {
 
 namespace server {
 
+class Client;
 class Session;
 
 /**
@@ -54,6 +55,15 @@ public:
 	 */
 	virtual Session *getSessionById(const QString &id, bool loadTemplate) = 0;
 
+	/**
+	 * @brief Is the session with the given ID or alias temporarily unavailable?
+	 *
+	 * A session that is being unloaded cannot be joined until it has
+	 * been completely shut down. The client should try again shortly.
+	 * The default implementation returns false.
+	 */
+	virtual bool isSessionUnavailable(const QString &id) const;
+
 	/**
 	 * Create a new session
 	 *
@@ -71,6 +81,14 @@ public:
 	 * @return session, error string pair: if session is null, error string contains the error code
 	 */
 	virtual std::tuple<Session*, QString> createSession(const QString &id, const QString &alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder) = 0;
+
+	/**
+	 * @brief A client is about to join the given session
+	 *
+	 * If the session runs in a different thread, the client
+	 * should be moved to that thread. The default implementation does nothing.
+	 */
+	virtual void handOverClient(Client *client, Session *session);
 };
 
 }
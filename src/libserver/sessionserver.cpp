@@ -27,10 +27,14 @@
 #include "filedhistory.h"
 #include "templateloader.h"
 #include "announcements.h"
+#include "sessionworkers.h"
+#include "historycache.h"
 
 #include <QTimer>
+#include <QThread>
 #include <QJsonArray>
 #include <QJsonDocument>
+#include <QMutexLocker>
 
 namespace server {
 
@@ -38,7 +42,11 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 	: QObject(parent),
 	m_config(config),
 	m_tpls(nullptr),
-	m_useFiledSessions(false)
+	m_useFiledSessions(false),
+	m_ioThread(nullptr),
+	m_workers(nullptr),
+	m_sessionClients(0),
+	m_historyCache(new HistoryCache)
 {
 	m_announcements = new sessionlisting::Announcements(config, this);
 
@@ -52,11 +60,34 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 #endif
 }
 
+SessionServer::~SessionServer()
+{
+	if(m_workers) {
+		// Sessions in worker threads are not our children
+		const QList<Session*> sessions = m_sessions;
+		for(Session *s : sessions)
+			m_workers->destroy(s);
+		m_sessions.clear();
+
+		delete m_workers;
+	}
+
+	if(m_ioThread) {
+		// Clients must be gone before the thread doing their I/O is stopped
+		const QList<ThinServerClient*> clients = m_clients;
+		qDeleteAll(clients);
+
+		m_ioThread->quit();
+		m_ioThread->wait();
+	}
+}
+
 void SessionServer::setSessionDir(const QDir &dir)
 {
 	if(dir.isReadable()) {
 		m_sessiondir = dir;
 		m_useFiledSessions = true;
+		m_historyCache->setLimit(m_config->internalConfig().historyCacheSize);
 		loadNewSessions();
 	} else {
 		qWarning("%s is not readable", qPrintable(dir.absolutePath()));
@@ -70,30 +101,44 @@ void SessionServer::loadNewSessions()
 
 	auto sessionFiles = m_sessiondir.entryInfoList(QStringList() << "*.session", QDir::Files|QDir::Writable|QDir::Readable);
 	for(const QFileInfo &f : sessionFiles) {
-		if(getSessionById(f.baseName(), false))
+		if(getSessionById(f.baseName(), false) || m_hibernated.contains(f.baseName()) || m_hibernating.contains(f.baseName()))
 			continue;
 
-		FiledHistory *fh = FiledHistory::load(f.absoluteFilePath());
-		if(fh) {
-			fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
-			Session *session = new ThinSession(fh, m_config, m_announcements, this);
-			initSession(session);
+		Session *session = loadSession(f.absoluteFilePath());
+		if(session)
 			session->log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Loaded from file."));
-		}
 	}
 }
 
+Session *SessionServer::loadSession(const QString &journal)
+{
+	FiledHistory *fh = FiledHistory::load(journal);
+	if(!fh)
+		return nullptr;
+
+	initFiledHistory(fh);
+	Session *session = new ThinSession(fh, m_config, m_announcements, this);
+	initSession(session);
+	return session;
+}
+
 QJsonArray SessionServer::sessionDescriptions() const
 {
 	QJsonArray descs;
 	QStringList aliases;
 
-	for(const Session *s : m_sessions) {
-		descs.append(s->getDescription());
+	for(Session *s : m_sessions) {
+		descs.append(SessionWorkers::call(s, [s]() { return s->getDescription(); }));
 		if(!s->idAlias().isEmpty())
 			aliases << s->idAlias();
 	}
 
+	for(const QJsonObject &desc : m_hibernated) {
+		descs.append(desc);
+		if(!desc["alias"].toString().isEmpty())
+			aliases << desc["alias"].toString();
+	}
+
 	if(templateLoader()) {
 		// Add session templates to list, if not shadowed by live sessions
 		QJsonArray templates = templateLoader()->templateDescriptions();
@@ -110,13 +155,20 @@ SessionHistory *SessionServer::initHistory(const QString &id, const QString alia
 {
 	if(m_useFiledSessions) {
 		FiledHistory *fh = FiledHistory::startNew(m_sessiondir, id, alias, protocolVersion, founder);
-		fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
+		initFiledHistory(fh);
 		return fh;
 	} else {
 		return new InMemoryHistory(id, alias, protocolVersion, founder);
 	}
 }
 
+void SessionServer::initFiledHistory(FiledHistory *history)
+{
+	history->setArchive(m_config->getConfigBool(config::ArchiveMode));
+	history->setCache(m_historyCache);
+	history->setSyncInterval(m_config->internalConfig().historySyncInterval);
+}
+
 std::tuple<Session*, QString> SessionServer::createSession(const QString &id, const QString &idAlias, const protocol::ProtocolVersion &protocolVersion, const QString &founder)
 {
 	Q_ASSERT(!id.isNull());
@@ -125,7 +177,9 @@ std::tuple<Session*, QString> SessionServer::createSession(const QString &id, co
 		return std::tuple<Session*, QString> { nullptr, "closed" };
 	}
 
-	if(getSessionById(id, false) || (!idAlias.isEmpty() && getSessionById(idAlias, false))) {
+	if(getSessionById(id, false) || (!idAlias.isEmpty() && getSessionById(idAlias, false))
+		|| !hibernatedSessionId(id).isEmpty() || (!idAlias.isEmpty() && !hibernatedSessionId(idAlias).isEmpty())
+		|| isSessionUnavailable(id) || (!idAlias.isEmpty() && isSessionUnavailable(idAlias))) {
 		return std::tuple<Session*, QString> { nullptr, "idInUse" };
 	}
 
@@ -135,14 +189,14 @@ std::tuple<Session*, QString> SessionServer::createSession(const QString &id, co
 
 	Session *session = new ThinSession(initHistory(id, idAlias, protocolVersion, founder), m_config, m_announcements, this);
 
-	initSession(session);
-
 	QString aka = idAlias.isEmpty() ? QString() : QStringLiteral(" (AKA %1)").arg(idAlias);
 
 	session->log(Log()
 		.about(Log::Level::Info, Log::Topic::Status)
 		.message("Session" + aka + " created by " + founder));
 
+	initSession(session);
+
 	return std::make_tuple(session, QString());
 }
 
@@ -166,40 +220,85 @@ Session *SessionServer::createFromTemplate(const QString &idAlias)
 	}
 
 	Session *session = new ThinSession(history, m_config, m_announcements, this);
-	initSession(session);
 	session->log(Log()
 		.about(Log::Level::Info, Log::Topic::Status)
 		.message(QStringLiteral("Session instantiated from template %1").arg(idAlias)));
+	initSession(session);
 
 	return session;
 }
 
+/**
+ * @brief Start tracking a newly created session
+ *
+ * If worker threads are enabled, the session is moved to one of them
+ * and must only be accessed via SessionWorkers::call afterwards.
+ */
 void SessionServer::initSession(Session *session)
 {
 	m_sessions.append(session);
 
-	const QString idString = session->id();
+	// Killed sessions are deleted in removeSession, so that a session
+	// in a worker thread cannot disappear while the main thread is using it
+	session->setDeletedByOwner(true);
 
 	connect(session, &Session::sessionAttributeChanged, this, &SessionServer::onSessionAttributeChanged);
-	connect(session, &Session::destroyed, this, [this, idString](QObject *object) {
-		auto *session = static_cast<Session*>(object);
-		m_sessions.removeOne(session);
-		m_announcements->unlistSession(session); // just to be safe
-
-		emit sessionEnded(idString);
-	});
+	connect(session, &Session::sessionKilled, this, &SessionServer::removeSession, Qt::QueuedConnection);
 
 	emit sessionCreated(session);
 	emit sessionChanged(session->getDescription());
+
+	const int workerThreads = m_config->internalConfig().workerThreads;
+	if(workerThreads > 0) {
+		if(!m_workers)
+			m_workers = new SessionWorkers(workerThreads);
+
+		session->setParent(nullptr);
+		m_workers->assign(session);
+	}
+}
+
+void SessionServer::removeSession(Session *session)
+{
+	if(!m_sessions.removeOne(session))
+		return;
+
+	const QString idString = session->id();
+	m_announcements->unlistSession(session); // just to be safe
+
+	const bool hibernating = m_hibernating.contains(idString);
+	if(hibernating) {
+		// The session can be woken up once its history has written everything out
+		connect(session->history(), &QObject::destroyed, this, [this, idString]() {
+			const QJsonObject description = m_hibernating.take(idString);
+			m_hibernated[idString] = description;
+			emit sessionChanged(description);
+		});
+	}
+
+	if(m_workers)
+		m_workers->release(session);
+	session->deleteLater();
+
+	if(!hibernating)
+		emit sessionEnded(idString);
 }
 
 Session *SessionServer::getSessionById(const QString &id, bool load)
 {
+	// The session is still in the list until it has been removed,
+	// but it is already dead and cannot be woken up yet
+	if(isSessionUnavailable(id))
+		return nullptr;
+
 	for(Session *s : m_sessions) {
 		if(s->id() == id || s->idAlias() == id)
 			return s;
 	}
 
+	if(load && !hibernatedSessionId(id).isEmpty())
+		return wakeSession(id);
+
 	if(load && templateLoader() && templateLoader()->exists(id)) {
 		return createFromTemplate(id);
 	}
@@ -207,6 +306,75 @@ Session *SessionServer::getSessionById(const QString &id, bool load)
 	return nullptr;
 }
 
+static QString findSessionId(const QHash<QString, QJsonObject> &sessions, const QString &idOrAlias)
+{
+	for(auto i=sessions.constBegin();i!=sessions.constEnd();++i) {
+		if(i.key() == idOrAlias || i.value()["alias"].toString() == idOrAlias)
+			return i.key();
+	}
+	return QString();
+}
+
+QString SessionServer::hibernatedSessionId(const QString &idOrAlias) const
+{
+	return findSessionId(m_hibernated, idOrAlias);
+}
+
+QString SessionServer::hibernatingSessionId(const QString &idOrAlias) const
+{
+	return findSessionId(m_hibernating, idOrAlias);
+}
+
+bool SessionServer::isSessionUnavailable(const QString &id) const
+{
+	return !hibernatingSessionId(id).isEmpty();
+}
+
+Session *SessionServer::wakeSession(const QString &idOrAlias)
+{
+	const QString id = hibernatedSessionId(idOrAlias);
+	if(id.isEmpty())
+		return nullptr;
+
+	m_hibernated.remove(id);
+
+	Session *session = loadSession(m_sessiondir.absoluteFilePath(FiledHistory::journalFilename(id)));
+	if(!session) {
+		qWarning("Couldn't wake up hibernated session %s", qPrintable(id));
+		emit sessionEnded(id);
+		return nullptr;
+	}
+
+	session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Woke up from hibernation."));
+	return session;
+}
+
+void SessionServer::hibernateIdleSessions()
+{
+	const qint64 hibernationTime = m_config->getConfigTime(config::HibernationTime) * 1000;
+	if(hibernationTime<=0 || !m_useFiledSessions)
+		return;
+
+	for(Session *s : m_sessions) {
+		const QJsonObject description = SessionWorkers::call(s, [s, hibernationTime]() {
+			// Announced sessions are kept loaded so they stay in the public listings
+			if(s->state() != Session::State::Running || s->userCount()>0 || s->lastEventTime() < hibernationTime
+				|| !s->history()->hasFlag(SessionHistory::Persistent) || !s->history()->announcements().isEmpty())
+				return QJsonObject();
+
+			s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Hibernating idle session."));
+			const QJsonObject description = s->getDescription();
+
+			// The files are kept so the session can be loaded again
+			s->killSession(false);
+			return description;
+		});
+
+		if(!description.isEmpty())
+			m_hibernating[s->id()] = description;
+	}
+}
+
 void SessionServer::stopAll()
 {
 	for(ThinServerClient *c : m_clients) {
@@ -215,13 +383,13 @@ void SessionServer::stopAll()
 	}
 
 	for(Session *s : m_sessions)
-		s->killSession(false);
+		SessionWorkers::call(s, [s]() { s->killSession(false); });
 }
 
 void SessionServer::messageAll(const QString &message, bool alert)
 {
 	for(Session *s : m_sessions) {
-		s->messageAll(message, alert);
+		SessionWorkers::call(s, [s, &message, alert]() { s->messageAll(message, alert); });
 	}
 }
 
@@ -234,10 +402,27 @@ void SessionServer::addClient(ThinServerClient *client)
 	client->setRandomLag(m_randomlag);
 #endif
 
+	if(m_config->internalConfig().ioThread) {
+		// One thread does the network I/O of all clients
+		if(!m_ioThread) {
+			m_ioThread = new QThread(this);
+			m_ioThread->setObjectName("network I/O");
+			m_ioThread->start();
+		}
+		client->setIoThread(m_ioThread);
+	}
+
 	m_clients.append(client);
 	connect(client, &Client::destroyed, this, &SessionServer::removeClient);
+	connect(client, &Client::loggedOff, this, [this](Client *c) {
+		// loggedOff may be emitted twice (kick, then disconnect)
+		// Note: this is called in the client's thread, which may be a session worker
+		disconnect(c, &Client::loggedOff, this, nullptr);
+		QMutexLocker lock(&m_trafficMutex);
+		m_closedTraffic.merge(c->trafficStats());
+	}, Qt::DirectConnection);
 
-	emit userCountChanged(m_clients.size());
+	emit userCountChanged(totalUsers());
 
 	auto *login = new LoginHandler(client, this, m_config);
 	connect(this, &SessionServer::sessionChanged, login, &LoginHandler::announceSession);
@@ -245,10 +430,59 @@ void SessionServer::addClient(ThinServerClient *client)
 	login->startLoginProcess();
 }
 
+protocol::TrafficStats SessionServer::trafficStats() const
+{
+	protocol::TrafficStats stats;
+	{
+		QMutexLocker lock(&m_trafficMutex);
+		stats = m_closedTraffic;
+	}
+
+	for(const ThinServerClient *c : m_clients)
+		stats.merge(c->trafficStats());
+
+	if(m_workers) {
+		for(Session *s : m_sessions) {
+			SessionWorkers::call(s, [s, &stats]() {
+				for(const Client *c : s->clients())
+					stats.merge(c->trafficStats());
+			});
+		}
+	}
+
+	return stats;
+}
+
+QVector<int> SessionServer::workerSessionCounts() const
+{
+	return m_workers ? m_workers->sessionCounts() : QVector<int>();
+}
+
+void SessionServer::handOverClient(Client *client, Session *session)
+{
+	if(session->thread() == thread())
+		return;
+
+	// The client now belongs to the session's thread. Since we can no
+	// longer touch it, just keep count of how many there are.
+	auto *c = static_cast<ThinServerClient*>(client);
+	m_clients.removeOne(c);
+	disconnect(c, &Client::destroyed, this, &SessionServer::removeClient);
+
+	++m_sessionClients;
+	connect(c, &Client::destroyed, this, [this]() {
+		--m_sessionClients;
+		emit userCountChanged(totalUsers());
+	});
+
+	c->setParent(nullptr);
+	c->moveToThread(session->thread());
+}
+
 void SessionServer::removeClient(QObject *client)
 {
 	m_clients.removeOne(static_cast<ThinServerClient*>(client));
-	emit userCountChanged(m_clients.size());
+	emit userCountChanged(totalUsers());
 }
 
 /**
@@ -262,23 +496,29 @@ void SessionServer::onSessionAttributeChanged(Session *session)
 {
 	Q_ASSERT(session);
 
-	bool delSession = false;
+	// The signal is queued if the session runs in a worker thread,
+	// in which case the session may have been killed in the meantime
+	if(!m_sessions.contains(session))
+		return;
 
-	if(session->userCount()==0 && session->state() != Session::State::Shutdown) {
-		session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Last user left."));
+	const QJsonObject description = SessionWorkers::call(session, [session]() {
+		if(session->userCount()==0 && session->state() != Session::State::Shutdown) {
+			session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Last user left."));
 
-		// A non-persistent session is deleted when the last user leaves
-		// A persistent session can also be deleted if it doesn't contain a snapshot point.
-		if(!session->history()->hasFlag(SessionHistory::Persistent)) {
-			session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Closing non-persistent session."));
-			delSession = true;
+			// A non-persistent session is deleted when the last user leaves
+			// A persistent session can also be deleted if it doesn't contain a snapshot point.
+			if(!session->history()->hasFlag(SessionHistory::Persistent)) {
+				session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Closing non-persistent session."));
+				session->killSession();
+				return QJsonObject();
+			}
 		}
-	}
 
-	if(delSession)
-		session->killSession();
-	else
-		emit sessionChanged(session->getDescription());
+		return session->getDescription();
+	});
+
+	if(!description.isEmpty())
+		emit sessionChanged(description);
 }
 
 void SessionServer::cleanupSessions()
@@ -287,12 +527,16 @@ void SessionServer::cleanupSessions()
 
 	if(expirationTime>0) {
 		for(Session *s : m_sessions) {
-			if(s->lastEventTime() > expirationTime) {
-				s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
-				s->killSession();
-			}
+			SessionWorkers::call(s, [s, expirationTime]() {
+				if(s->lastEventTime() > expirationTime) {
+					s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
+					s->killSession();
+				}
+			});
 		}
 	}
+
+	hibernateIdleSessions();
 }
 
 JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
@@ -303,8 +547,10 @@ JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStr
 
 	if(!head.isEmpty()) {
 		Session *s = getSessionById(head, false);
+		if(!s)
+			s = wakeSession(head);
 		if(s)
-			return s->callJsonApi(method, tail, request);
+			return SessionWorkers::call(s, [s, method, &tail, &request]() { return s->callJsonApi(method, tail, request); });
 		else
 			return JsonApiNotFound();
 	}
@@ -341,6 +587,15 @@ JsonApiResult SessionServer::callUserJsonApi(JsonApiMethod method, const QString
 		for(const ThinServerClient *c : m_clients)
 			userlist << c->description();
 
+		if(m_workers) {
+			for(Session *s : m_sessions) {
+				SessionWorkers::call(s, [s, &userlist]() {
+					for(const Client *c : s->clients())
+						userlist << c->description();
+				});
+			}
+		}
+
 		return {JsonApiResult::Ok, QJsonDocument(userlist)};
 
 	} else {
@@ -18,11 +18,20 @@
 */
 
 #include "../libshared/net/protover.h"
+#include "../libshared/net/trafficstats.h"
 #include "jsonapi.h"
 #include "sessions.h"
 
 #include <QObject>
 #include <QDir>
+#include <QMutex>
+#include <QVector>
+#include <QHash>
+#include <QJsonObject>
+
+#include <memory>
+
+class QThread;
 
 namespace sessionlisting {
 	class Announcements;
@@ -33,8 +42,11 @@ namespace server {
 class Session;
 class SessionHistory;
 class ThinServerClient;
+class FiledHistory;
+class HistoryCache;
 class ServerConfig;
 class TemplateLoader;
+class SessionWorkers;
 
 /**
  * @brief Session manager
@@ -44,6 +56,7 @@ class SessionServer : public QObject, public Sessions {
 Q_OBJECT
 public:
 	SessionServer(ServerConfig *config, QObject *parent=nullptr);
+	~SessionServer();
 
 	/**
 	 * @brief Enable file backed sessions
@@ -115,15 +128,52 @@ public:
 	 */
 	Session *getSessionById(const QString &id, bool load) override;
 
+	/**
+	 * @brief Is the session being hibernated?
+	 *
+	 * A hibernating session cannot be joined (or its ID reused)
+	 * until its history has been closed.
+	 */
+	bool isSessionUnavailable(const QString &id) const override;
+
 	/**
 	 * @brief Get the total number of connected users
 	 */
-	int totalUsers() const { return m_clients.size(); }
+	int totalUsers() const { return m_clients.size() + m_sessionClients; }
 
 	/**
-	 * @brief Get the number of active sessions
+	 * @brief Get the number of sessions
+	 *
+	 * This includes the hibernated sessions.
+	 */
+	int sessionCount() const { return m_sessions.size() + m_hibernated.size(); }
+
+	/**
+	 * @brief Get the number of hibernated sessions
+	 *
+	 * A persistent session that has been empty and idle for long enough
+	 * is unloaded from memory. It is loaded again when someone joins it.
 	 */
-	int sessionCount() const { return m_sessions.size(); }
+	int hibernatedSessionCount() const { return m_hibernated.size(); }
+
+	/**
+	 * @brief Get the number of sessions running in each worker thread
+	 *
+	 * The list is empty if sessions run in the main thread.
+	 */
+	QVector<int> workerSessionCounts() const;
+
+	/**
+	 * @brief Get the combined traffic statistics of all connections
+	 *
+	 * This includes the connections that have already been closed.
+	 */
+	protocol::TrafficStats trafficStats() const;
+
+	/**
+	 * @brief Get the cache shared by the file backed session histories
+	 */
+	HistoryCache *historyCache() const { return m_historyCache.get(); }
 
 	/**
 	 * @brief Stop all running sessions
@@ -152,6 +202,8 @@ public:
 	//! Like callSessionJsonApi, but for the user list
 	JsonApiResult callUserJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
+	void handOverClient(Client *client, Session *session) override;
+
 signals:
 	/**
 	 * @brief A session was just created
@@ -186,11 +238,18 @@ signals:
 private slots:
 	void removeClient(QObject *client);
 	void onSessionAttributeChanged(Session *session);
+	void removeSession(Session *session);
 	void cleanupSessions();
 
 private:
 	SessionHistory *initHistory(const QString &id, const QString alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder);
 	void initSession(Session *session);
+	void initFiledHistory(FiledHistory *history);
+	Session *loadSession(const QString &journal);
+	void hibernateIdleSessions();
+	QString hibernatedSessionId(const QString &idOrAlias) const;
+	QString hibernatingSessionId(const QString &idOrAlias) const;
+	Session *wakeSession(const QString &idOrAlias);
 
 	sessionlisting::Announcements *m_announcements;
 	ServerConfig *m_config;
@@ -199,7 +258,16 @@ private:
 	bool m_useFiledSessions;
 
 	QList<Session*> m_sessions;
-	QList<ThinServerClient*> m_clients;
+	QList<ThinServerClient*> m_clients; // clients in the login phase (or in sessions running in this thread)
+	QThread *m_ioThread;
+	SessionWorkers *m_workers;
+	int m_sessionClients; // number of clients handed over to worker threads
+	std::shared_ptr<HistoryCache> m_historyCache; // shared with the histories, which may outlive us
+	QHash<QString, QJsonObject> m_hibernated;     // descriptions of the hibernated sessions (by ID)
+	QHash<QString, QJsonObject> m_hibernating;    // sessions shut down for hibernation, but not yet removed
+
+	protocol::TrafficStats m_closedTraffic; // combined stats of closed connections
+	mutable QMutex m_trafficMutex;          // protects m_closedTraffic
 
 #ifndef NDEBUG
 	uint m_randomlag;
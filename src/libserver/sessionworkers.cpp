@@ -0,0 +1,103 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sessionworkers.h"
+#include "session.h"
+#include "client.h"
+
+namespace server {
+
+SessionWorkers::SessionWorkers(int threads)
+{
+	Q_ASSERT(threads > 0);
+
+	for(int i=0;i<threads;++i) {
+		QThread *thread = new QThread;
+		thread->setObjectName(QStringLiteral("session worker %1").arg(i+1));
+		thread->start();
+
+		QObject *context = new QObject;
+		context->moveToThread(thread);
+
+		m_workers << Worker { thread, context, 0 };
+	}
+}
+
+SessionWorkers::~SessionWorkers()
+{
+	for(const Worker &w : m_workers) {
+		w.thread->quit();
+		w.thread->wait();
+		delete w.context;
+		delete w.thread;
+	}
+}
+
+void SessionWorkers::assign(Session *session)
+{
+	Q_ASSERT(!session->parent());
+	Q_ASSERT(!m_assigned.contains(session));
+
+	int best = 0;
+	for(int i=1;i<m_workers.size();++i) {
+		if(m_workers.at(i).sessions < m_workers.at(best).sessions)
+			best = i;
+	}
+
+	++m_workers[best].sessions;
+	m_assigned[session] = best;
+	session->moveToThread(m_workers.at(best).thread);
+}
+
+void SessionWorkers::release(Session *session)
+{
+	const int w = m_assigned.value(session, -1);
+	if(w >= 0) {
+		--m_workers[w].sessions;
+		m_assigned.remove(session);
+	}
+}
+
+void SessionWorkers::destroy(Session *session)
+{
+	const int w = m_assigned.value(session, -1);
+	if(w < 0) {
+		qWarning("SessionWorkers::destroy: session %s not assigned to a worker", qPrintable(session->id()));
+		return;
+	}
+
+	release(session);
+
+	call(m_workers.at(w).context, [session]() {
+		const QList<Client*> clients = session->clients();
+		qDeleteAll(clients);
+		delete session;
+	});
+}
+
+QVector<int> SessionWorkers::sessionCounts() const
+{
+	QVector<int> counts;
+	counts.reserve(m_workers.size());
+	for(const Worker &w : m_workers)
+		counts << w.sessions;
+	return counts;
+}
+
+}
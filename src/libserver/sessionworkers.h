@@ -0,0 +1,123 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_SESSIONWORKERS_H
+#define DP_SERVER_SESSIONWORKERS_H
+
+#include <QObject>
+#include <QSemaphore>
+#include <QThread>
+#include <QTimer>
+#include <QHash>
+#include <QVector>
+
+#include <type_traits>
+
+namespace server {
+
+class Session;
+
+/**
+ * @brief A pool of threads the sessions run in
+ *
+ * Each session, together with the clients that have joined it, lives in one
+ * of the worker threads and processes its messages in that thread's event loop.
+ * Everything else (accepting connections, logins, the JSON API and session
+ * announcements) stays in the main thread, which talks to the sessions via call().
+ *
+ * Code running in a worker thread must never wait for the main thread,
+ * since the main thread may be waiting for it in call().
+ */
+class SessionWorkers {
+public:
+	explicit SessionWorkers(int threads);
+	~SessionWorkers();
+
+	/**
+	 * @brief Move a new session to the worker thread with the fewest sessions
+	 *
+	 * The session must not have a parent.
+	 */
+	void assign(Session *session);
+
+	/**
+	 * @brief Forget about a session that is about to be deleted
+	 */
+	void release(Session *session);
+
+	/**
+	 * @brief Delete a session and its remaining clients in the session's own thread
+	 *
+	 * This is used when the server shuts down.
+	 */
+	void destroy(Session *session);
+
+	//! Get the number of sessions running in each worker thread
+	QVector<int> sessionCounts() const;
+
+	/**
+	 * @brief Call a function in the thread of the given object
+	 *
+	 * If the object lives in the calling thread, the function is called
+	 * directly. Otherwise the caller is blocked until the function has been
+	 * called in the object's thread.
+	 *
+	 * @return the return value of the function
+	 */
+	template<typename Func>
+	static auto call(QObject *context, Func f) -> decltype(f())
+	{
+		if(context->thread() == QThread::currentThread())
+			return f();
+		return blockingCall(context, f, std::is_void<decltype(f())>());
+	}
+
+private:
+	// Note: the functor overload of QMetaObject::invokeMethod would need Qt 5.10
+	template<typename Func>
+	static void blockingCall(QObject *context, Func f, std::true_type)
+	{
+		QSemaphore done;
+		QTimer::singleShot(0, context, [&f, &done]() { f(); done.release(); });
+		done.acquire();
+	}
+
+	template<typename Func>
+	static auto blockingCall(QObject *context, Func f, std::false_type) -> decltype(f())
+	{
+		decltype(f()) result;
+		QSemaphore done;
+		QTimer::singleShot(0, context, [&f, &result, &done]() { result = f(); done.release(); });
+		done.acquire();
+		return result;
+	}
+
+	struct Worker {
+		QThread *thread;
+		QObject *context; // lives in the worker thread
+		int sessions;
+	};
+
+	QVector<Worker> m_workers;
+	QHash<const Session*, int> m_assigned;
+};
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "../../libshared/net/meta.h"
 
 #include <QtTest/QtTest>
+#include <QSignalSpy>
 #include <QTemporaryDir>
 #include <QDir>
 #include <memory>
@@ -275,6 +276,163 @@ private slots:
 		QCOMPARE(lastIdx, 5);
 	}
 
+	void testSerializedBatch()
+	{
+		QString file = makeTestRecording();
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(file)) };
+		QSignalSpy loadedSpy(fh.get(), &SessionHistory::batchLoaded);
+
+		// The last block is still open, so it's not available in serialized form
+		SessionHistory::SerializedBatch batch = fh->getSerializedBatch(-1);
+		QVERIFY(batch.data.isEmpty());
+		QVERIFY(!batch.pending);
+
+		fh->closeBlock();
+		auto testMsg = protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test4")));
+		fh->addMessage(testMsg);
+
+		// Closed block is memory mapped, or loaded in the background
+		// on platforms where mapping is not supported
+		batch = fh->getSerializedBatch(-1);
+		if(batch.pending) {
+			QVERIFY(batch.data.isEmpty());
+			QVERIFY(loadedSpy.wait());
+			batch = fh->getSerializedBatch(-1);
+		}
+
+		// ...and then returned as is
+		QVERIFY(!batch.pending);
+		QCOMPARE(batch.lastIndex, 2);
+
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = fh->getBatch(-1);
+		QCOMPARE(msgs.size(), 3);
+		QByteArray expected;
+		for(const protocol::MessagePtr &msg : msgs) {
+			const protocol::ByteSlice s = msg->serialized();
+			expected.append(s.constData(), s.length());
+		}
+		QCOMPARE(batch.data.toByteArray(), expected);
+
+		// The buffer is shared between callers
+		const SessionHistory::SerializedBatch batch2 = fh->getSerializedBatch(-1);
+		QCOMPARE(batch2.data.constData(), batch.data.constData());
+
+		// Starting in the middle of a block
+		batch = fh->getSerializedBatch(0);
+		QCOMPARE(batch.lastIndex, 2);
+		QCOMPARE(batch.data.length(), expected.length() - msgs.first()->length());
+
+		// Releasing the cache doesn't invalidate buffers still in use
+		fh->cleanupBatches(fh->lastIndex()+1);
+		QCOMPARE(batch2.data.toByteArray(), expected);
+
+		// Second block is the open one
+		batch = fh->getSerializedBatch(2);
+		QVERIFY(batch.data.isEmpty());
+		QVERIFY(!batch.pending);
+		QCOMPARE(batch.lastIndex, 2);
+
+		// ...and neither does destroying the history
+		fh.reset();
+		QCOMPARE(batch2.data.toByteArray(), expected);
+	}
+
+	// Recording writes are committed in groups shortly after they are made
+	void testGroupCommit()
+	{
+		auto id = Ulid::make().toString();
+		std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+
+		QString recfile = m_dir.absoluteFilePath(FiledHistory::journalFilename(id));
+		recfile.replace(".session", ".dprec");
+		const qint64 emptySize = QFileInfo(recfile).size();
+
+		fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test1"))));
+		fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test2"))));
+		QCOMPARE(QFileInfo(recfile).size(), emptySize);
+
+		QTRY_VERIFY(QFileInfo(recfile).size() > emptySize);
+	}
+
+	// A saved block index is used to skip scanning the recording when loading
+	void testBlockIndex()
+	{
+		auto id = Ulid::make().toString();
+		const QString journal = m_dir.absoluteFilePath(FiledHistory::journalFilename(id));
+		QString indexFile = journal;
+		indexFile.replace(".session", ".dpidx");
+
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			fh->addMessage(protocol::MessagePtr(new protocol::UserJoin(1, 0, QByteArray("u1"), QByteArray())));
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test1"))));
+			fh->closeBlock();
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test2"))));
+			fh->closeBlock();
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test3"))));
+		}
+		QVERIFY(QFile::exists(indexFile));
+
+		// Keep a copy of the index to test an index that doesn't cover the whole recording
+		const QString staleIndexFile = indexFile + ".stale";
+		QVERIFY(QFile::copy(indexFile, staleIndexFile));
+
+		protocol::MessageList msgs;
+		int lastIdx;
+
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journal) };
+			QVERIFY(fh.get());
+
+			// A leave message was added for the user still in the session
+			QCOMPARE(fh->lastIndex(), 4);
+
+			std::tie(msgs, lastIdx) = fh->getBatch(-1);
+			QCOMPARE(msgs.size(), 2);
+			QCOMPARE(lastIdx, 1);
+
+			std::tie(msgs, lastIdx) = fh->getBatch(lastIdx);
+			QCOMPARE(msgs.size(), 1);
+			QCOMPARE(lastIdx, 2);
+			QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test2"));
+
+			std::tie(msgs, lastIdx) = fh->getBatch(lastIdx);
+			QCOMPARE(msgs.size(), 2);
+			QCOMPARE(lastIdx, 4);
+			QCOMPARE(msgs.last()->type(), protocol::MSG_USER_LEAVE);
+
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test4"))));
+		}
+
+		// The part of the recording not in the index is scanned
+		QVERIFY(QFile::remove(indexFile));
+		QVERIFY(QFile::rename(staleIndexFile, indexFile));
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journal) };
+			QVERIFY(fh.get());
+			QCOMPARE(fh->lastIndex(), 5);
+
+			// No extra leave message: the user already left in the unindexed part
+			std::tie(msgs, lastIdx) = fh->getBatch(2);
+			QCOMPARE(msgs.size(), 3);
+			QCOMPARE(msgs.last().cast<protocol::Chat>().message(), QString("test4"));
+		}
+
+		// An invalid index is ignored
+		{
+			QFile f(indexFile);
+			QVERIFY(f.open(QFile::WriteOnly));
+			f.write("garbage");
+		}
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journal) };
+			QVERIFY(fh.get());
+			QCOMPARE(fh->lastIndex(), 5);
+		}
+	}
+
 	void testUserLeave()
 	{
 		auto id = Ulid::make().toString();
@@ -0,0 +1,104 @@
+#include "../historycache.h"
+
+#include <QtTest/QtTest>
+#include <memory>
+
+using server::HistoryCache;
+
+class TestHistoryCache: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testLru()
+	{
+		HistoryCache cache(300);
+		const quint64 a = HistoryCache::newOwnerId();
+		const quint64 b = HistoryCache::newOwnerId();
+		QVERIFY(a != b);
+
+		cache.insert(a, 0, QByteArray(100, 'a'));
+		cache.insert(b, 0, QByteArray(100, 'b'));
+		cache.insert(a, 100, QByteArray(100, 'c'));
+		QCOMPARE(cache.stats().residentBytes, qint64(300));
+
+		// Touch the oldest block so the next one is the least recently used
+		QCOMPARE(cache.get(a, 0), QByteArray(100, 'a'));
+
+		cache.insert(b, 100, QByteArray(100, 'd'));
+		QVERIFY(cache.contains(a, 0));
+		QVERIFY(!cache.contains(b, 0));
+		QVERIFY(cache.contains(a, 100));
+		QVERIFY(cache.contains(b, 100));
+
+		QVERIFY(cache.get(b, 0).isEmpty());
+
+		HistoryCache::Stats stats = cache.stats();
+		QCOMPARE(stats.hits, qint64(1));
+		QCOMPARE(stats.misses, qint64(1));
+		QCOMPARE(stats.evictions, qint64(1));
+		QCOMPARE(stats.blocks, qint64(3));
+		QCOMPARE(stats.residentBytes, qint64(300));
+	}
+
+	void testOversized()
+	{
+		// A block bigger than the whole budget is kept until the next insertion
+		HistoryCache cache(100);
+		const quint64 a = HistoryCache::newOwnerId();
+
+		cache.insert(a, 0, QByteArray(50, 'a'));
+		cache.insert(a, 50, QByteArray(200, 'b'));
+		QVERIFY(!cache.contains(a, 0));
+		QVERIFY(cache.contains(a, 50));
+
+		cache.insert(a, 250, QByteArray(10, 'c'));
+		QVERIFY(!cache.contains(a, 50));
+		QCOMPARE(cache.stats().residentBytes, qint64(10));
+	}
+
+	void testRemoveOwner()
+	{
+		HistoryCache cache;
+		const quint64 a = HistoryCache::newOwnerId();
+		const quint64 b = HistoryCache::newOwnerId();
+
+		cache.insert(a, 0, QByteArray(10, 'a'));
+		cache.insert(a, 10, QByteArray(10, 'a'));
+		cache.insert(b, 0, QByteArray(10, 'b'));
+
+		cache.remove(a, 10);
+		QCOMPARE(cache.stats().blocks, qint64(2));
+
+		cache.removeOwner(a);
+		QVERIFY(!cache.contains(a, 0));
+		QVERIFY(cache.contains(b, 0));
+		QCOMPARE(cache.stats().residentBytes, qint64(10));
+	}
+
+	void testBacking()
+	{
+		// Memory not owned by the data is released once nobody uses the data anymore
+		HistoryCache cache;
+		const quint64 a = HistoryCache::newOwnerId();
+
+		std::shared_ptr<QByteArray> memory = std::make_shared<QByteArray>(100, 'a');
+		const std::weak_ptr<QByteArray> backing = memory;
+
+		QByteArray data = QByteArray::fromRawData(memory->constData(), memory->length());
+		cache.insert(a, 0, data, memory);
+		memory.reset();
+
+		cache.remove(a, 0);
+		QVERIFY(!cache.contains(a, 0));
+		QVERIFY(!backing.expired());
+		QCOMPARE(data, QByteArray(100, 'a'));
+
+		data = QByteArray();
+		cache.insert(a, 100, QByteArray(10, 'b'));
+		QVERIFY(backing.expired());
+	}
+};
+
+
+QTEST_MAIN(TestHistoryCache)
+#include "historycache.moc"
@@ -0,0 +1,83 @@
+#include "../sessionserver.h"
+#include "../session.h"
+#include "../filedhistory.h"
+#include "../inmemoryconfig.h"
+#include "../../libshared/util/ulid.h"
+#include "../../libshared/net/meta.h"
+
+#include <QtTest/QtTest>
+#include <QTemporaryDir>
+#include <QDir>
+#include <memory>
+
+using namespace server;
+
+class TestSessionServer: public QObject
+{
+	Q_OBJECT
+private slots:
+	void initTestCase()
+	{
+		QVERIFY(m_tempdir.isValid());
+		m_dir = m_tempdir.path();
+	}
+
+	// Test that an idle session can be hibernated and woken up again,
+	// but not while it is still being shut down
+	void testHibernation()
+	{
+		const QString id = Ulid::make().toString();
+		const QString alias = "hibernation";
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, alias, protocol::ProtocolVersion::current(), "test") };
+			QVERIFY(fh.get());
+			fh->setFlags(SessionHistory::Persistent);
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("hello"))));
+		}
+
+		InMemoryConfig config;
+		config.setConfigString(config::HibernationTime, "1");
+
+		SessionServer server(&config);
+		server.setSessionDir(m_dir);
+		QCOMPARE(server.sessionCount(), 1);
+		QCOMPARE(server.hibernatedSessionCount(), 0);
+
+		QTest::qWait(1100);
+		QMetaObject::invokeMethod(&server, "cleanupSessions");
+
+		// The session has been killed, but its history is still open
+		QVERIFY(server.isSessionUnavailable(id));
+		QVERIFY(server.isSessionUnavailable(alias));
+		QVERIFY(!server.getSessionById(id, true));
+		QVERIFY(!server.getSessionById(alias, true));
+
+		Session *s;
+		QString error;
+		std::tie(s, error) = server.createSession(id, QString(), protocol::ProtocolVersion::current(), "test");
+		QVERIFY(!s);
+		QCOMPARE(error, QString("idInUse"));
+
+		// Once the session has been deleted, it can be woken up
+		QCoreApplication::sendPostedEvents();
+		QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+
+		QVERIFY(!server.isSessionUnavailable(id));
+		QCOMPARE(server.hibernatedSessionCount(), 1);
+		QCOMPARE(server.sessionCount(), 1);
+
+		s = server.getSessionById(alias, true);
+		QVERIFY(s);
+		QCOMPARE(s->id(), id);
+		QCOMPARE(server.hibernatedSessionCount(), 0);
+		QCOMPARE(server.sessionCount(), 1);
+	}
+
+private:
+	QTemporaryDir m_tempdir;
+	QDir m_dir;
+};
+
+
+QTEST_MAIN(TestSessionServer)
+#include "sessionserver.moc"
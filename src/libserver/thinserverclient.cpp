@@ -31,6 +31,23 @@ ThinServerClient::ThinServerClient(QTcpSocket *socket, ServerLog *logger, QObjec
 		this, &ThinServerClient::sendNextHistoryBatch);
 }
 
+void ThinServerClient::sendAhead(const protocol::MessagePtr &msg, int index)
+{
+	if(index <= m_historyPosition)
+		return;
+
+	// Not needed if the message will be sent right away anyway
+	if(m_historyPosition == index - 1 && !messageQueue()->isUploading())
+		return;
+
+	// The message must not overtake the sender's join message
+	if(!messageQueue()->isUserJoinSent(msg->contextId()))
+		return;
+
+	messageQueue()->send(msg);
+	m_sentAhead << index;
+}
+
 void ThinServerClient::sendNextHistoryBatch()
 {
 	// Only enqueue messages for uploading when upload queue is empty
@@ -39,13 +56,71 @@ void ThinServerClient::sendNextHistoryBatch()
 	if(session() == nullptr || messageQueue()->isUploading() || session()->state() != Session::State::Running)
 		return;
 
-	protocol::MessageList batch;
-	int batchLast;
-	std::tie(batch, batchLast) = session()->history()->getBatch(m_historyPosition);
-	m_historyPosition = batchLast;
-	messageQueue()->send(batch);
+	// Closed history blocks are available pre-serialized. The same buffer
+	// is shared by every client catching up, so it is encoded only once.
+	// The block bypasses the pointer movement coalescing of send(), but
+	// MessageQueue::sendBulk(ByteSlice) skips the stale MovePointers.
+	const SessionHistory::SerializedBatch serialized = session()->history()->getSerializedBatch(m_historyPosition);
+
+	if(serialized.pending) {
+		// The block is being read from disk. We'll be called again
+		// when the history emits batchLoaded.
+		return;
+
+	} else if(!serialized.data.isEmpty()) {
+		sendSerializedBatch(serialized.data, serialized.lastIndex);
+		m_historyPosition = serialized.lastIndex;
+
+	} else {
+		protocol::MessageList batch;
+		std::tie(batch, m_historyPosition) = session()->history()->getBatch(m_historyPosition);
+
+		if(!m_sentAhead.isEmpty()) {
+			// Skip the messages that were already sent ahead
+			const int firstIndex = m_historyPosition - batch.size() + 1;
+			protocol::MessageList filtered;
+			filtered.reserve(batch.size());
+			for(int i=0;i<batch.size();++i) {
+				if(!m_sentAhead.contains(firstIndex + i))
+					filtered << batch.at(i);
+			}
+			batch = filtered;
+		}
+
+		messageQueue()->sendBulk(batch);
+	}
+
+	// Indexes the history has passed won't be seen again
+	while(!m_sentAhead.isEmpty() && m_sentAhead.first() <= m_historyPosition)
+		m_sentAhead.removeFirst();
 
 	static_cast<ThinSession*>(session())->cleanupHistoryCache();
 }
 
+void ThinServerClient::sendSerializedBatch(const protocol::ByteSlice &data, int lastIndex)
+{
+	if(m_sentAhead.isEmpty() || m_sentAhead.first() > lastIndex) {
+		messageQueue()->sendBulk(data);
+		return;
+	}
+
+	// Some messages of this block were already sent ahead. Cut them out.
+	QVector<int> offsets;
+	for(int pos=0;pos<data.length();pos += protocol::Message::sniffLength(data.constData() + pos))
+		offsets << pos;
+	offsets << data.length();
+
+	const int firstIndex = lastIndex - (offsets.size() - 1) + 1;
+	int start = 0;
+	for(int i=0;i<offsets.size()-1;++i) {
+		if(m_sentAhead.contains(firstIndex + i)) {
+			if(offsets.at(i) > start)
+				messageQueue()->sendBulk(data.mid(start, offsets.at(i) - start));
+			start = offsets.at(i+1);
+		}
+	}
+	if(start < data.length())
+		messageQueue()->sendBulk(data.mid(start));
+}
+
 }
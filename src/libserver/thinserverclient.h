@@ -22,6 +22,8 @@
 
 #include "client.h"
 
+#include <QVector>
+
 namespace server {
 
 class ThinServerClient : public Client
@@ -38,11 +40,34 @@ public:
 
 	void setHistoryPosition(int pos) { m_historyPosition = pos; }
 
+	/**
+	 * @brief Send an interactive message ahead of the history
+	 *
+	 * If the client is still catching up, chat, laser trail and pointer
+	 * messages are sent right away instead of waiting for the history
+	 * to reach them. This is done only if the client already knows
+	 * the user who sent the message. A message sent ahead is skipped
+	 * when the history reaches it.
+	 *
+	 * @param msg the message
+	 * @param index the history index of the message
+	 */
+	void sendAhead(const protocol::MessagePtr &msg, int index);
+
 public slots:
 	void sendNextHistoryBatch();
 
 private:
+	/**
+	 * @brief Send a pre-serialized history block
+	 *
+	 * Messages already sent ahead are cut out. Pointer movements
+	 * are left in: the message queue drops them from raw blocks.
+	 */
+	void sendSerializedBatch(const protocol::ByteSlice &data, int lastIndex);
+
 	int m_historyPosition;
+	QVector<int> m_sentAhead; // history indexes of messages sent ahead (in ascending order)
 };
 
 }
@@ -59,6 +59,20 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 
 	addedToHistory(msg);
 
+	// Clients still catching up get chat and other interactive messages
+	// right away rather than after the rest of the history.
+	if(state() == State::Running) {
+		switch(msg->type()) {
+		case protocol::MSG_CHAT:
+		case protocol::MSG_LASERTRAIL:
+		case protocol::MSG_MOVEPOINTER:
+			for(Client *c : clients())
+				static_cast<ThinServerClient*>(c)->sendAhead(msg, history()->lastIndex());
+			break;
+		default: break;
+		}
+	}
+
 	// Request auto-reset when threshold is crossed.
 	const uint autoResetThreshold = history()->effectiveAutoResetThreshold();
 	if(autoResetThreshold>0 && m_autoResetRequestStatus == AutoResetState::NotSent && history()->sizeInBytes() > autoResetThreshold) {
@@ -159,6 +173,8 @@ void ThinSession::onClientJoin(Client *client, bool host)
 {
 	connect(history(), &SessionHistory::newMessagesAvailable,
 		static_cast<ThinServerClient*>(client), &ThinServerClient::sendNextHistoryBatch);
+	connect(history(), &SessionHistory::batchLoaded,
+		static_cast<ThinServerClient*>(client), &ThinServerClient::sendNextHistoryBatch);
 
 	if(!host) {
 		// Notify the client how many messages to expect (at least)
@@ -20,6 +20,7 @@
 #define DP_NET_BRUSHES_H
 
 #include "message.h"
+#include "messagepool.h"
 
 #include <QVector>
 #include <QRect>
@@ -109,7 +110,7 @@ public:
  * @brief Draw Classic Brush Dabs
  *
  */
-class DrawDabsClassic : public DrawDabs {
+class DrawDabsClassic : public DrawDabs, public PooledMessage<DrawDabsClassic> {
 public:
 	static const int MAX_DABS = (0xffff - 15) / ClassicBrushDab::LENGTH;
 
@@ -173,7 +174,7 @@ private:
  * @brief Draw Pixel Brush Dabs
  *
  */
-class DrawDabsPixel : public DrawDabs {
+class DrawDabsPixel : public DrawDabs, public PooledMessage<DrawDabsPixel> {
 public:
 	static const int MAX_DABS = (0xffff - 15) / PixelBrushDab::LENGTH;
 
@@ -240,7 +241,7 @@ private:
  * The pen up command signals the end of a stroke. In indirect drawing mode, it causes
  * indirect dabs (by this user) to be merged to their parent layers.
  */
-class PenUp : public ZeroLengthMessage<PenUp> {
+class PenUp : public ZeroLengthMessage<PenUp>, public PooledMessage<PenUp> {
 public:
 	PenUp(uint8_t ctx) : ZeroLengthMessage(MSG_PEN_UP, ctx) {}
 
@@ -52,6 +52,34 @@ int Message::serialize(char *data) const
 	return HEADER_LEN + written;
 }
 
+ByteSlice Message::serialized() const
+{
+	if(m_serialized.isEmpty()) {
+		QByteArray buf(length(), Qt::Uninitialized);
+		serialize(buf.data());
+		m_serialized = ByteSlice(buf);
+	}
+	return m_serialized;
+}
+
+void Message::setContextId(uint8_t userid)
+{
+	if(userid == m_contextid)
+		return;
+
+	m_contextid = userid;
+
+	// Patch the cached serialization rather than discarding it.
+	// This copies the data only if someone else is still holding the old version
+	// or if the message was a slice of a larger buffer.
+	if(!m_serialized.isEmpty()) {
+		QByteArray buf = m_serialized.toByteArray();
+		m_serialized = ByteSlice();
+		buf.data()[3] = char(userid);
+		m_serialized = ByteSlice(buf);
+	}
+}
+
 bool Message::equals(const Message &m) const
 {
 	if(type() != m.type() || contextId() != m.contextId())
@@ -129,6 +157,22 @@ NullableMessageRef Message::deserialize(const uchar *data, int buflen, bool deco
 	return NullableMessageRef(msg);
 }
 
+NullableMessageRef Message::deserialize(const QByteArray &buffer, int offset, int buflen, bool decodeOpaque)
+{
+	Q_ASSERT(offset >= 0 && offset + buflen <= buffer.length());
+	const uchar *data = reinterpret_cast<const uchar*>(buffer.constData()) + offset;
+
+	if(!decodeOpaque && buflen >= HEADER_LEN && data[2] >= 64) {
+		const int len = sniffLength(reinterpret_cast<const char*>(data));
+		if(buflen < len)
+			return nullptr;
+
+		return NullableMessageRef(new OpaqueMessage(ByteSlice(buffer, offset, len)));
+	}
+
+	return deserialize(data, buflen, decodeOpaque);
+}
+
 QString Message::toString() const
 {
 	const Kwargs kw = kwargs();
@@ -23,6 +23,7 @@
 #include <QMap>
 #include <QString>
 #include <QList>
+#include <QByteArray>
 
 namespace protocol {
 
@@ -58,6 +59,7 @@ enum MessageType {
 	MSG_LAYER_DEFAULT,
 	MSG_FILTERED,
 	MSG_EXTENSION, // reserved for non-standard extension use
+	MSG_TRACE_MARK, // latency tracing (relayed, but not stored in the session history)
 
 	// Command messages (opaque)
 	MSG_UNDOPOINT=128,
@@ -100,6 +102,51 @@ typedef QMapIterator<QString,QString> KwargsIterator;
 class MessagePtr;
 class NullableMessageRef;
 
+/**
+ * @brief A read-only view into an implicitly shared byte buffer
+ *
+ * The slice holds a reference to the underlying buffer, so it stays
+ * valid even if the original QByteArray goes away.
+ */
+class ByteSlice {
+public:
+	ByteSlice() : m_offset(0), m_length(0) { }
+	ByteSlice(const QByteArray &buffer) : m_buffer(buffer), m_offset(0), m_length(buffer.length()) { }
+	ByteSlice(const QByteArray &buffer, int offset, int length)
+		: m_buffer(buffer), m_offset(offset), m_length(length)
+	{
+		Q_ASSERT(offset >= 0 && length >= 0 && offset + length <= buffer.length());
+	}
+
+	const char *constData() const { return m_buffer.constData() + m_offset; }
+	int length() const { return m_length; }
+	bool isEmpty() const { return m_length == 0; }
+	char at(int i) const { Q_ASSERT(i>=0 && i<m_length); return m_buffer.at(m_offset + i); }
+
+	//! Get a slice of this slice (sharing the same buffer)
+	ByteSlice mid(int pos, int len=-1) const {
+		if(len < 0)
+			len = m_length - pos;
+		Q_ASSERT(pos >= 0 && pos + len <= m_length);
+		return ByteSlice(m_buffer, m_offset + pos, len);
+	}
+
+	//! Does this slice cover the whole underlying buffer?
+	bool isWhole() const { return m_offset == 0 && m_length == m_buffer.length(); }
+
+	/**
+	 * @brief Get the content of the slice as a QByteArray
+	 *
+	 * The data is copied only if the slice doesn't cover the whole buffer.
+	 */
+	QByteArray toByteArray() const { return isWhole() ? m_buffer : QByteArray(constData(), m_length); }
+
+private:
+	QByteArray m_buffer;
+	int m_offset;
+	int m_length;
+};
+
 class Message {
 	friend class MessagePtr;
 	friend class NullableMessageRef;
@@ -177,7 +224,7 @@ public:
 	 *
 	 * @param userid the new user id
 	 */
-	void setContextId(uint8_t userid) { m_contextid = userid; }
+	void setContextId(uint8_t userid);
 
 	/**
 	 * @brief Get the ID of the layer this command affects
@@ -230,6 +277,21 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the serialized form of this message
+	 *
+	 * The message is serialized on first call and the result is cached.
+	 * The returned buffer is implicitly shared, so the same bytes can
+	 * be handed to every recipient (and the session history) without
+	 * re-encoding or copying the message.
+	 *
+	 * Messages received as opaque data return a slice of the buffer
+	 * they were received in.
+	 *
+	 * @return a buffer of length() bytes
+	 */
+	ByteSlice serialized() const;
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -257,6 +319,21 @@ public:
 	 */
 	static NullableMessageRef deserialize(const uchar *data, int buflen, bool decodeOpaque);
 
+	/**
+	 * @brief deserialize a message from a shared buffer
+	 *
+	 * This works like the above function, except that when opaque messages
+	 * are not decoded, the returned OpaqueMessage references the buffer
+	 * directly rather than copying the data.
+	 *
+	 * @param buffer input data buffer
+	 * @param offset offset of the message in the buffer
+	 * @param buflen maximum length of the message data
+	 * @param decodeOpaque automatically decode opaque messages rather than returning OpaqueMessage
+	 * @return message or 0 if type is unknown
+	 */
+	static NullableMessageRef deserialize(const QByteArray &buffer, int offset, int buflen, bool decodeOpaque);
+
 	/**
 	 * @brief Check if this message has the same content as the other one
 	 * @param m
@@ -314,11 +391,30 @@ protected:
 	 */
 	virtual Kwargs kwargs() const = 0;
 
+	/**
+	 * @brief Discard the cached serialization
+	 *
+	 * This must be called by subclasses whenever the payload is modified.
+	 */
+	void invalidateSerialization() { m_serialized = ByteSlice(); }
+
+	/**
+	 * @brief Prime the serialization cache
+	 *
+	 * This is used by messages that already have their wire format at hand.
+	 * The buffer must contain the complete message, header included.
+	 */
+	void setSerialization(const ByteSlice &data) { m_serialized = data; }
+
+	//! Get the cached serialization without serializing
+	const ByteSlice &cachedSerialization() const { return m_serialized; }
+
 private:
 	const MessageType m_type;
 	MessageUndoState _undone;
 	int m_refcount;
 	uint8_t m_contextid;
+	mutable ByteSlice m_serialized;
 };
 
 typedef QList<MessagePtr> MessageList;
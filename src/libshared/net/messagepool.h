@@ -0,0 +1,145 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_MESSAGEPOOL_H
+#define DP_NET_MESSAGEPOOL_H
+
+#include <cstddef>
+#include <new>
+
+namespace protocol {
+
+/**
+ * @brief A free list of equally sized memory blocks
+ *
+ * Released blocks are kept for reuse instead of being returned to the
+ * system allocator, up to a limit.
+ */
+class MessageFreeList {
+public:
+	//! Maximum number of free blocks to keep around
+	static const int MAX_FREE = 4096;
+
+	explicit MessageFreeList(size_t blockSize)
+		: m_head(nullptr), m_count(0), m_blockSize(blockSize)
+	{ }
+
+	~MessageFreeList()
+	{
+		while(m_head) {
+			Node *n = m_head;
+			m_head = n->next;
+			::operator delete(n);
+		}
+	}
+
+	MessageFreeList(const MessageFreeList&) = delete;
+	MessageFreeList &operator=(const MessageFreeList&) = delete;
+
+	void *take()
+	{
+		if(m_head) {
+			Node *n = m_head;
+			m_head = n->next;
+			--m_count;
+			return n;
+		}
+		return ::operator new(m_blockSize);
+	}
+
+	void give(void *ptr)
+	{
+		if(m_count >= MAX_FREE) {
+			::operator delete(ptr);
+		} else {
+			Node *n = static_cast<Node*>(ptr);
+			n->next = m_head;
+			m_head = n;
+			++m_count;
+		}
+	}
+
+	//! Get the number of free blocks
+	int freeCount() const { return m_count; }
+
+private:
+	struct Node {
+		Node *next;
+	};
+
+	Node *m_head;
+	int m_count;
+	const size_t m_blockSize;
+};
+
+/**
+ * @brief Pooled allocation for frequently used message types
+ *
+ * Message classes that are created and destroyed in large numbers
+ * (e.g. dabs during catch-up or when relaying) inherit from this to
+ * get memory from a per-thread free list rather than the heap.
+ *
+ * A message freed in a different thread than it was allocated in simply
+ * goes to that thread's free list. Subclasses of a pooled class use
+ * the regular allocator.
+ */
+template<class T> class PooledMessage {
+public:
+	static void *operator new(size_t size)
+	{
+		MessageFreeList *list = size == sizeof(T) ? freeList() : nullptr;
+		return list ? list->take() : ::operator new(size);
+	}
+
+	static void operator delete(void *ptr, size_t size)
+	{
+		if(!ptr)
+			return;
+		MessageFreeList *list = size == sizeof(T) ? freeList() : nullptr;
+		if(list)
+			list->give(ptr);
+		else
+			::operator delete(ptr);
+	}
+
+	/**
+	 * @brief Get this thread's free list for this message type
+	 *
+	 * Returns null if the thread is exiting and the list has already been destroyed.
+	 */
+	static MessageFreeList *freeList()
+	{
+		static thread_local ListOwner owner;
+		return s_alive ? &owner.list : nullptr;
+	}
+
+private:
+	struct ListOwner {
+		MessageFreeList list;
+		ListOwner() : list(sizeof(T)) { s_alive = true; }
+		~ListOwner() { s_alive = false; }
+	};
+
+	static thread_local bool s_alive;
+};
+
+template<class T> thread_local bool PooledMessage<T>::s_alive = false;
+
+}
+
+#endif
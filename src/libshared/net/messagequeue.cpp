@@ -19,15 +19,20 @@
 
 #include "messagequeue.h"
 #include "control.h"
+#include "streamcompression.h"
 
 #include <QTcpSocket>
+#include <QSslSocket>
 #include <QDateTime>
 #include <QTimer>
+#include <QThread>
+#include <QSemaphore>
+#include <algorithm>
+#include <iterator>
 #include <cstring>
 
 #ifndef NDEBUG
 #include <QRandomGenerator>
-#include <QThread>
 #endif
 
 namespace protocol {
@@ -35,29 +40,56 @@ namespace protocol {
 // Reserve enough buffer space for one complete message
 static const int MAX_BUF_LEN = 1024*64 + protocol::Message::HEADER_LEN;
 
+// The reception buffer holds several messages so a burst can be read in one go
+static const int RECV_BUF_LEN = MAX_BUF_LEN * 4;
+
+// Limits for the adaptive upload batch size
+static const int MIN_BATCH_SIZE = 1024*16;
+static const int INITIAL_BATCH_SIZE = 1024*64;
+static const int MAX_BATCH_SIZE = 1024*1024;
+
+// Max. number of messages in the interactive lane before pointer messages start getting dropped
+static const int MAX_INTERACTIVE_QUEUE = 256;
+
+// Max. number of upload batches prepared ahead of time for the I/O thread
+static const int MAX_IO_BATCHES = 3;
+
 MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	: QObject(parent), m_socket(socket),
+	  m_io(new QObject(this)), m_ioThreaded(false),
+	  m_receivedPosted(false), m_refillPosted(false), m_writeIdle(true), m_ioBatches(0),
+	  m_batchSize(INITIAL_BATCH_SIZE), m_ioQueuedBytes(0), m_socketBytesToWrite(0),
+	  m_lastRecvTime(0), m_receivedSinceCheck(false), m_ignoreIncoming(false),
+	  m_orderedBytes(0), m_uploadQueueLimit(0),
+	  m_closeWhenReady(false),
+	  m_decodeOpaque(false),
 	  m_pingTimer(nullptr),
-	  m_lastRecvTime(0),
-	  m_idleTimeout(0), m_pingSent(0), m_closeWhenReady(false),
-	  m_ignoreIncoming(false),
-	  m_decodeOpaque(false)
+	  m_idleTimeout(0), m_pingSent(0)
 {
-	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
-	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
+	// Socket signals are handled in the context of the I/O side object,
+	// so they'll be called in the I/O thread if there is one.
+	connect(socket, &QTcpSocket::readyRead, m_io, [this]() { readData(); });
+	m_bytesWrittenConnection = connect(socket, &QTcpSocket::bytesWritten, m_io, [this](qint64 bytes) { dataWritten(bytes); });
 
-	if(socket->inherits("QSslSocket")) {
-		connect(socket, SIGNAL(encrypted()), this, SLOT(sslEncrypted()));
+	if(QSslSocket *sslSocket = qobject_cast<QSslSocket*>(socket)) {
+		connect(sslSocket, &QSslSocket::encrypted, m_io, [this]() { sslEncrypted(); });
 	}
 
-	m_recvbuffer = new char[MAX_BUF_LEN];
-	m_sendbuffer = new char[MAX_BUF_LEN];
+	std::fill(std::begin(m_membershipPending), std::end(m_membershipPending), 0);
+	std::fill(std::begin(m_joinSent), std::end(m_joinSent), false);
+
+	m_recvpos = 0;
 	m_recvbytes = 0;
 	m_sentbytes = 0;
-	m_sendbuflen = 0;
+	m_closeAfterSend = false;
+
+	m_deflater = nullptr;
+	m_inflater = nullptr;
+	m_compressionFlush = CompressionFlush::EveryBatch;
+	m_unflushed = false;
 
-	m_idleTimer = new QTimer(this);
-	connect(m_idleTimer, &QTimer::timeout, this, &MessageQueue::checkIdleTimeout);
+	m_idleTimer = new QTimer(m_io);
+	connect(m_idleTimer, &QTimer::timeout, m_io, [this]() { checkIdleTimeout(); });
 	m_idleTimer->setInterval(1000);
 	m_idleTimer->setSingleShot(false);
 
@@ -66,14 +98,89 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 #endif
 }
 
+MessageQueue::~MessageQueue()
+{
+	if(m_ioThreaded) {
+		// The I/O side (including the socket) must be destroyed in its own thread.
+		// This also waits for anything the I/O thread is doing with us to finish.
+		QObject *io = m_io;
+		QThread *thread = io->thread();
+		bool deleted = false;
+		if(thread->isRunning()) {
+			QSemaphore done;
+			QTimer::singleShot(0, io, [io, &done]() { delete io; done.release(); });
+			deleted = true;
+			while(!done.tryAcquire(1, 100)) {
+				if(!thread->isRunning()) {
+					// The thread stopped before it got to the deletion
+					deleted = done.tryAcquire();
+					break;
+				}
+			}
+		}
+
+		if(!deleted) {
+			// The I/O thread isn't running, so nothing can be using the I/O side anymore
+			delete io;
+		}
+	} else {
+		delete m_io;
+	}
+
+	delete m_deflater;
+	delete m_inflater;
+}
+
+void MessageQueue::moveIoToThread(QThread *thread)
+{
+	Q_ASSERT(thread && thread != QThread::currentThread());
+	if(m_ioThreaded) {
+		qWarning("MessageQueue::moveIoToThread: I/O is already threaded");
+		return;
+	}
+
+	// Needed for queued connections to the socket's signals
+	qRegisterMetaType<QAbstractSocket::SocketState>();
+	qRegisterMetaType<QAbstractSocket::SocketError>();
+
+	m_ioThreaded = true;
+	m_socket->setParent(m_io);
+	m_io->setParent(nullptr);
+	m_io->moveToThread(thread);
+}
+
+void MessageQueue::runInIo(std::function<void()> fn)
+{
+	if(m_ioThreaded)
+		QTimer::singleShot(0, m_io, fn);
+	else
+		fn();
+}
+
+void MessageQueue::disconnectFromHost()
+{
+	runInIo([this]() { m_socket->disconnectFromHost(); });
+}
+
+void MessageQueue::abort()
+{
+	runInIo([this]() { m_socket->abort(); });
+}
+
 void MessageQueue::sslEncrypted()
 {
-	disconnect(m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
-	connect(m_socket, SIGNAL(encryptedBytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
+	disconnect(m_bytesWrittenConnection);
+	m_bytesWrittenConnection = connect(static_cast<QSslSocket*>(m_socket), &QSslSocket::encryptedBytesWritten,
+		m_io, [this](qint64 bytes) { dataWritten(bytes); });
 }
 
 void MessageQueue::checkIdleTimeout()
 {
+	// readData() just flags that something was received, so we don't
+	// need to look at the clock for every read.
+	if(m_receivedSinceCheck.exchange(false))
+		m_lastRecvTime = QDateTime::currentMSecsSinceEpoch();
+
 	if(m_idleTimeout>0 && m_socket->state() == QTcpSocket::ConnectedState && idleTime() > m_idleTimeout) {
 		qWarning("MessageQueue timeout");
 		m_socket->abort();
@@ -82,64 +189,290 @@ void MessageQueue::checkIdleTimeout()
 
 void MessageQueue::setIdleTimeout(qint64 timeout)
 {
-	m_idleTimeout = timeout;
 	m_lastRecvTime = QDateTime::currentMSecsSinceEpoch();
-	if(timeout>0)
-		m_idleTimer->start(1000);
-	else
-		m_idleTimer->stop();
+	m_receivedSinceCheck = false;
+
+	runInIo([this, timeout]() {
+		m_idleTimeout = timeout;
+		if(timeout>0)
+			m_idleTimer->start(1000);
+		else
+			m_idleTimer->stop();
+	});
 }
 
 void MessageQueue::setPingInterval(int msecs)
 {
-	if(!m_pingTimer) {
-		m_pingTimer = new QTimer(this);
-		m_pingTimer->setSingleShot(false);
-		connect(m_pingTimer, SIGNAL(timeout()), this, SLOT(sendPing()));
+	runInIo([this, msecs]() {
+		if(!m_pingTimer) {
+			m_pingTimer = new QTimer(m_io);
+			m_pingTimer->setSingleShot(false);
+			connect(m_pingTimer, &QTimer::timeout, m_io, [this]() { ioSendPing(); });
+		}
+		m_pingTimer->setInterval(msecs);
+		m_pingTimer->start(msecs);
+	});
+}
+
+bool MessageQueue::isPending() const
+{
+	return !m_inbox.isEmpty();
+}
+
+MessagePtr MessageQueue::getPending()
+{
+	const QueuedMessage q = m_inbox.dequeue();
+	m_stats.addResidency(TrafficStats::Received, TrafficStats::now() - q.queued);
+	return q.msg;
+}
+
+bool MessageQueue::enqueue(const MessagePtr &msg, qint64 now)
+{
+	Lane lane;
+	switch(msg->type()) {
+	case MSG_PING:
+		lane = ControlLane;
+		break;
+	case MSG_CHAT:
+	case MSG_PRIVATE_CHAT:
+	case MSG_LASERTRAIL:
+	case MSG_MOVEPOINTER:
+		// These can skip ahead of the ordered queue, but not ahead
+		// of the join message of the user they belong to.
+		if(m_membershipPending[msg->contextId()] == 0) {
+			lane = InteractiveLane;
+			break;
+		}
+		Q_FALLTHROUGH();
+	default:
+		updateMembership(msg->type(), msg->contextId(), false);
+		enqueueOrdered(msg->serialized(), now);
+		return true;
+	}
+
+	QQueue<QueuedMessage> &queue = m_outbox[lane];
+
+	if(lane == InteractiveLane) {
+		if(msg->type() == MSG_MOVEPOINTER) {
+			// Only the latest pointer position matters
+			for(QueuedMessage &queued : queue) {
+				if(queued.msg->type() == MSG_MOVEPOINTER && queued.msg->contextId() == msg->contextId()) {
+					queued = QueuedMessage { msg, now };
+					return false;
+				}
+			}
+		}
+
+		if(queue.size() >= MAX_INTERACTIVE_QUEUE) {
+			// The other end isn't keeping up. Drop the oldest pointer message
+			// to make room. (Chat messages are never dropped.)
+			for(int i=0;i<queue.size();++i) {
+				const MessageType t = queue.at(i).msg->type();
+				if(t == MSG_MOVEPOINTER || t == MSG_LASERTRAIL) {
+					queue.removeAt(i);
+					break;
+				}
+			}
+		}
+	}
+
+	queue.enqueue(QueuedMessage { msg, now });
+	return false;
+}
+
+void MessageQueue::enqueueOrdered(const ByteSlice &data, qint64 now)
+{
+	m_ordered.enqueue(QueuedData { data, now });
+	m_orderedBytes += data.length();
+
+	if(m_uploadQueueLimit > 0 && m_orderedBytes > m_uploadQueueLimit) {
+		// The other end can't keep up at all. Holding on to ever more data
+		// won't help, so give up on the connection.
+		qWarning("MessageQueue: upload queue limit (%d bytes) exceeded", m_uploadQueueLimit);
+		clearOutbox();
+		m_closeWhenReady = true;
+		abort();
 	}
-	m_pingTimer->setInterval(msecs);
-	m_pingTimer->start(msecs);
 }
 
-MessageQueue::~MessageQueue()
+void MessageQueue::updateMembership(int type, uint8_t contextId, bool sent)
 {
-	delete [] m_recvbuffer;
-	delete [] m_sendbuffer;
+	if(type != MSG_USER_JOIN && type != MSG_USER_LEAVE)
+		return;
+
+	if(sent) {
+		if(m_membershipPending[contextId] > 0)
+			--m_membershipPending[contextId];
+		m_joinSent[contextId] = type == MSG_USER_JOIN;
+	} else {
+		++m_membershipPending[contextId];
+	}
 }
 
-bool MessageQueue::isPending() const
+bool MessageQueue::isUserJoinSent(uint8_t contextId) const
 {
-	return !m_inbox.isEmpty();
+	return m_joinSent[contextId] && m_membershipPending[contextId] == 0;
 }
 
-MessagePtr MessageQueue::getPending()
+void MessageQueue::clearOutbox()
+{
+	for(int i=0;i<LANE_COUNT;++i)
+		m_outbox[i].clear();
+	m_ordered.clear();
+	m_orderedBytes = 0;
+	std::fill(std::begin(m_membershipPending), std::end(m_membershipPending), 0);
+}
+
+bool MessageQueue::isOutboxEmpty() const
 {
-	return m_inbox.dequeue();
+	for(int i=0;i<LANE_COUNT;++i) {
+		if(!m_outbox[i].isEmpty())
+			return false;
+	}
+	return m_ordered.isEmpty();
 }
 
 void MessageQueue::send(const MessagePtr &message)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.enqueue(message);
-		if(m_sendbuflen==0)
-			writeData();
+		const qint64 now = TrafficStats::now();
+		if(enqueue(message, now))
+			m_stats.addSerialization(1, TrafficStats::now() - now);
+		feedIo();
 	}
 }
 
 void MessageQueue::send(const MessageList &messages)
 {
 	if(!m_closeWhenReady) {
-		m_outbox << messages;
-		if(m_sendbuflen==0)
-			writeData();
+		const qint64 now = TrafficStats::now();
+		int serialized = 0;
+		for(const MessagePtr &msg : messages) {
+			if(enqueue(msg, now))
+				++serialized;
+			if(m_closeWhenReady)
+				break;
+		}
+		if(serialized>0)
+			m_stats.addSerialization(serialized, TrafficStats::now() - now);
+		feedIo();
+	}
+}
+
+void MessageQueue::sendBulk(const MessageList &messages)
+{
+	send(messages);
+}
+
+void MessageQueue::sendBulk(const ByteSlice &data)
+{
+	if(m_closeWhenReady || data.isEmpty())
+		return;
+
+	// Pointer movements are cut out of the block. The rest is
+	// sent in order as slices of the shared buffer.
+	const qint64 now = TrafficStats::now();
+	int start = 0;
+	int pos = 0;
+	while(pos < data.length() && !m_closeWhenReady) {
+		const int len = Message::sniffLength(data.constData() + pos);
+		const int type = uchar(data.at(pos+2));
+		if(type == MSG_MOVEPOINTER) {
+			if(pos > start)
+				enqueueOrdered(data.mid(start, pos-start), now);
+			start = pos + len;
+		} else {
+			updateMembership(type, uchar(data.at(pos+3)), false);
+		}
+		pos += len;
 	}
+	if(pos > start && !m_closeWhenReady)
+		enqueueOrdered(data.mid(start, pos-start), now);
+
+	feedIo();
+}
+
+void MessageQueue::feedIo()
+{
+	if(m_ioThreaded) {
+		// A few batches are kept ready for the I/O thread, so it can
+		// keep writing even when this thread is busy for a while.
+		// The rest wait in the lanes where they can still be prioritized
+		// and coalesced.
+		bool handedOver = false;
+		while(m_ioBatches < MAX_IO_BATCHES) {
+			OutgoingBatch batch;
+			if(!gatherOutbox(m_batchSize, batch))
+				break;
+			++m_ioBatches;
+			m_outgoing.push(std::move(batch));
+			handedOver = true;
+		}
+
+		if(handedOver && m_writeIdle.exchange(false))
+			QTimer::singleShot(0, m_io, [this]() { writeData(); });
+
+	} else if(m_writeIdle.exchange(false)) {
+		// New messages are written only after the socket has drained what it
+		// already has. writeData gathers the messages itself.
+		writeData();
+	}
+}
+
+void MessageQueue::refillIo()
+{
+	m_refillPosted = false;
+	feedIo();
+}
+
+void MessageQueue::writeIdle()
+{
+	if(!m_writeIdle) {
+		// New messages were already handed over
+		return;
+	}
+
+	if(m_ioBatches > 0) {
+		// A batch was handed over just as the I/O side ran out of work
+		m_writeIdle = false;
+		QTimer::singleShot(0, m_io, [this]() { writeData(); });
+
+	} else if(isOutboxEmpty()) {
+		emit allSent();
+
+	} else {
+		// The socket drained everything we gave it and we still have
+		// more to send: we're limited by the batch size, not the network.
+		m_batchSize = qMin(m_batchSize * 2, MAX_BATCH_SIZE);
+		feedIo();
+	}
+}
+
+void MessageQueue::takeReceived()
+{
+	m_receivedPosted.exchange(false);
+
+	bool gotmessage = false;
+	ReceivedBatch batch;
+	while(m_received.pop(batch)) {
+		for(const MessagePtr &msg : batch.messages) {
+			m_stats.addMessage(TrafficStats::Received, msg->type(), msg->length());
+			m_inbox.enqueue(QueuedMessage { msg, batch.received });
+		}
+		gotmessage = true;
+	}
+
+	if(gotmessage)
+		emit messageAvailable();
 }
 
 void MessageQueue::sendNow(MessagePtr msg)
 {
-	if(!m_closeWhenReady) {
-		m_outbox.prepend(msg);
-		if(m_sendbuflen==0)
+	if(!m_closeAfterSend) {
+		const ByteSlice data = msg->serialized();
+		m_ioQueuedBytes += data.length();
+		m_controlQueue << data;
+		if(m_sendbuffer.isEmpty())
 			writeData();
 	}
 }
@@ -148,10 +481,14 @@ void MessageQueue::sendDisconnect(int reason, const QString &message)
 {
 	send(MessagePtr(new protocol::Disconnect(0, protocol::Disconnect::Reason(reason), message)));
 	m_ignoreIncoming = true;
-	m_recvbytes = 0;
 }
 
 void MessageQueue::sendPing()
+{
+	runInIo([this]() { ioSendPing(); });
+}
+
+void MessageQueue::ioSendPing()
 {
 	if(m_pingSent==0) {
 		m_pingSent = QDateTime::currentMSecsSinceEpoch();
@@ -165,133 +502,278 @@ void MessageQueue::sendPing()
 
 int MessageQueue::uploadQueueBytes() const
 {
-	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes;
-	for(const MessagePtr &msg : m_outbox)
-		total += msg->length();
+	int total = m_socketBytesToWrite + m_ioQueuedBytes + m_orderedBytes;
+	for(int i=0;i<LANE_COUNT;++i) {
+		for(const QueuedMessage &q : m_outbox[i])
+			total += q.msg->length();
+	}
 	return total;
 }
 
 bool MessageQueue::isUploading() const
 {
-	return m_sendbuflen > 0 || m_socket->bytesToWrite() > 0;
+	return !m_writeIdle || m_ioBatches > 0 || !isOutboxEmpty();
 }
 
 qint64 MessageQueue::idleTime() const
 {
+	if(m_receivedSinceCheck)
+		return 0;
 	return QDateTime::currentMSecsSinceEpoch() - m_lastRecvTime;
 }
 
 void MessageQueue::readData() {
-	bool gotmessage = false;
 	int read, totalread=0;
+
+	if(m_ignoreIncoming) {
+		// Nothing received from now on is processed
+		m_recvpos = 0;
+		m_recvbytes = 0;
+	}
+
 	do {
-		// Read as much as fits in to the deserialization buffer
-		read = m_socket->read(m_recvbuffer+m_recvbytes, MAX_BUF_LEN-m_recvbytes);
-		if(read<0) {
-			emit socketError(m_socket->errorString());
-			return;
-		}
+		const qint64 incoming = m_socket->bytesAvailable();
+		if(incoming <= 0)
+			break;
+
+		if(m_inflater && !m_ignoreIncoming) {
+			// Compressed stream: decompress into the deserialization buffer
+			const QByteArray compressed = m_socket->read(qMin(incoming, qint64(RECV_BUF_LEN)));
+			read = compressed.length();
+			m_inflater->setInput(compressed);
+
+			while(m_inflater->hasPendingInput()) {
+				prepareReceiveBuffer(qint64(read) * 4);
+				const int inflated = m_inflater->inflate(m_recvbuffer.data()+m_recvbytes, m_recvbuffer.length()-m_recvbytes);
+				if(inflated<0) {
+					emit socketError(QStringLiteral("Invalid compressed data"));
+					return;
+				}
+				m_recvbytes += inflated;
+				extractMessages();
+			}
 
-		if(m_ignoreIncoming) {
-			// Ignore incoming data mode is used when we're shutting down the connection
-			// but want to clear the upload queue
-			if(read>0)
-				continue;
-			else
+		} else {
+			prepareReceiveBuffer(incoming);
+
+			// Read as much as fits in to the deserialization buffer
+			read = m_socket->read(m_recvbuffer.data()+m_recvbytes, m_recvbuffer.length()-m_recvbytes);
+			if(read<0) {
+				emit socketError(m_socket->errorString());
 				return;
+			}
+
+			if(m_ignoreIncoming) {
+				// Ignore incoming data mode is used when we're shutting down the connection
+				// but want to clear the upload queue
+				if(read>0)
+					continue;
+				else
+					return;
+			}
+
+			m_recvbytes += read;
+			extractMessages();
 		}
 
-		m_recvbytes += read;
+		// All messages extracted from buffer (if there were any):
+		// see if there are more bytes in the socket buffer
+		totalread += read;
+	} while(read>0);
+
+	if(totalread) {
+		m_receivedSinceCheck = true;
+		emit bytesReceived(totalread);
+	}
+
+	if(!m_receiving.isEmpty()) {
+		// Hand the messages over to the owner
+		ReceivedBatch batch;
+		batch.messages = std::move(m_receiving);
+		batch.received = TrafficStats::now();
+		m_received.push(std::move(batch));
+		m_receiving = MessageList();
+
+		if(!m_ioThreaded)
+			takeReceived();
+		else if(!m_receivedPosted.exchange(true))
+			QMetaObject::invokeMethod(this, "takeReceived", Qt::QueuedConnection);
+	}
+}
 
-		// Extract all complete messages
-		int len;
-		while(m_recvbytes >= Message::HEADER_LEN && m_recvbytes >= (len=Message::sniffLength(m_recvbuffer))) {
-			// Whole message received!
-			NullableMessageRef msg = Message::deserialize((const uchar*)m_recvbuffer, m_recvbytes, m_decodeOpaque);
-			if(msg.isNull()) {
-				emit badData(len, (unsigned char)m_recvbuffer[2], (unsigned char)m_recvbuffer[3]);
+void MessageQueue::extractMessages()
+{
+	int len;
+	while(m_recvbytes-m_recvpos >= Message::HEADER_LEN && m_recvbytes-m_recvpos >= (len=Message::sniffLength(m_recvbuffer.constData()+m_recvpos))) {
+		// Whole message received!
+		const char *msgdata = m_recvbuffer.constData() + m_recvpos;
+		NullableMessageRef msg = Message::deserialize(m_recvbuffer, m_recvpos, len, m_decodeOpaque);
+		if(msg.isNull()) {
+			emit badData(len, (unsigned char)msgdata[2], (unsigned char)msgdata[3]);
+
+		} else {
+			 if(msg->type() == MSG_PING) {
+				// Special handling for Ping messages
+				bool isPong = msg.cast<Ping>().isPong();
+
+				if(isPong) {
+					if(m_pingSent==0) {
+						qWarning("Received Pong, but no Ping was sent!");
 
-			} else {
-				 if(msg->type() == MSG_PING) {
-					// Special handling for Ping messages
-					bool isPong = msg.cast<Ping>().isPong();
-
-					if(isPong) {
-						if(m_pingSent==0) {
-							qWarning("Received Pong, but no Ping was sent!");
-
-						} else {
-							qint64 roundtrip = QDateTime::currentMSecsSinceEpoch() - m_pingSent;
-							m_pingSent = 0;
-							emit pingPong(roundtrip);
-						}
 					} else {
-						sendNow(MessagePtr(new Ping(0, true)));
+						qint64 roundtrip = QDateTime::currentMSecsSinceEpoch() - m_pingSent;
+						m_pingSent = 0;
+						emit pingPong(roundtrip);
 					}
-
 				} else {
-					m_inbox.enqueue(MessagePtr::fromNullable(msg));
-					gotmessage = true;
+					sendNow(MessagePtr(new Ping(0, true)));
 				}
+
+			} else {
+				m_receiving.append(MessagePtr::fromNullable(msg));
 			}
+		}
+
+		m_recvpos += len;
+	}
+
+	if(m_recvpos == m_recvbytes) {
+		// Everything consumed: rewind the buffer for free
+		m_recvpos = 0;
+		m_recvbytes = 0;
+	}
+}
 
-			if(len < m_recvbytes) {
-				// Buffer contains more than one message
-				memmove(m_recvbuffer, m_recvbuffer+len, m_recvbytes-len);
+void MessageQueue::prepareReceiveBuffer(qint64 incoming)
+{
+	const int pending = m_recvbytes - m_recvpos;
+
+	if(m_decodeOpaque) {
+		// All messages are decoded and copied out of the buffer,
+		// so the same buffer can be used over and over again.
+		if(m_recvbuffer.isDetached() && m_recvbuffer.length() >= RECV_BUF_LEN) {
+			// Make sure there is room for at least one complete message at the end of the buffer.
+			// Only the trailing partial message (if any) needs to be moved.
+			if(RECV_BUF_LEN - m_recvbytes < MAX_BUF_LEN && m_recvpos > 0) {
+				char *buf = m_recvbuffer.data();
+				memmove(buf, buf+m_recvpos, pending);
+				m_recvbytes = pending;
+				m_recvpos = 0;
 			}
-			m_recvbytes -= len;
+			return;
 		}
 
-		// All messages extracted from buffer (if there were any):
-		// see if there are more bytes in the socket buffer
-		totalread += read;
-	} while(read>0);
+		incoming = RECV_BUF_LEN;
 
-	if(totalread) {
-		m_lastRecvTime = QDateTime::currentMSecsSinceEpoch();
-		emit bytesReceived(totalread);
+	} else {
+		// Opaque messages are slices of the buffer they were received in.
+		// Once they have been taken, the buffer can't be written to anymore
+		// and a new one is needed. It's sized according to the incoming
+		// data so the messages won't keep a mostly empty buffer alive.
+		int needed = pending + int(qMin(incoming, qint64(RECV_BUF_LEN)));
+		if(pending >= Message::HEADER_LEN)
+			needed = qMax(needed, Message::sniffLength(m_recvbuffer.constData()+m_recvpos));
+
+		if(m_recvbuffer.isDetached() && m_recvbuffer.length() - m_recvpos >= needed) {
+			// Nothing was taken from the buffer yet (e.g. a large message is still
+			// being received) and there is enough room left.
+			if(m_recvbuffer.length() - m_recvbytes < needed - pending) {
+				char *buf = m_recvbuffer.data();
+				memmove(buf, buf+m_recvpos, pending);
+				m_recvbytes = pending;
+				m_recvpos = 0;
+			}
+			return;
+		}
+
+		incoming = needed - pending;
 	}
 
-	if(gotmessage)
-		emit messageAvailable();
+	QByteArray buf(pending + int(incoming), Qt::Uninitialized);
+	if(pending>0)
+		memcpy(buf.data(), m_recvbuffer.constData()+m_recvpos, pending);
+
+	m_recvbuffer = buf;
+	m_recvbytes = pending;
+	m_recvpos = 0;
 }
 
 void MessageQueue::dataWritten(qint64 bytes)
 {
 	emit bytesSent(bytes);
 
+	m_socketBytesToWrite = int(m_socket->bytesToWrite());
+
 	// Write more once the buffer is empty
 	if(m_socket->bytesToWrite()==0) {
-		if(m_sendbuflen==0 && m_outbox.isEmpty())
-			emit allSent();
-		else
+		if(!m_sendbuffer.isEmpty() || hasMoreToWrite()) {
+			// The socket drained everything we gave it and we still have
+			// more to send: we're limited by the batch size, not the network.
+			m_batchSize = qMin(m_batchSize * 2, MAX_BATCH_SIZE);
 			writeData();
+
+		} else {
+			// Everything handed to the I/O side has been sent
+			m_writeIdle = true;
+			if(m_ioThreaded)
+				QMetaObject::invokeMethod(this, "writeIdle", Qt::QueuedConnection);
+			else
+				writeIdle();
+		}
 	}
 }
 
+bool MessageQueue::hasMoreToWrite() const
+{
+	// Without an I/O thread, the lanes can be read directly
+	return !m_controlQueue.isEmpty() || !m_outgoing.isEmpty() || (!m_ioThreaded && !isOutboxEmpty());
+}
+
+bool MessageQueue::takeNextBatch(int maxlen)
+{
+	Q_ASSERT(m_sentbytes == 0);
+
+	if(!m_controlQueue.isEmpty()) {
+		m_sendbuffer = m_controlQueue.takeFirst();
+		return true;
+	}
+
+	OutgoingBatch batch;
+	if(m_outgoing.pop(batch)) {
+		// Let the owner prepare the next batch while this one is being written
+		--m_ioBatches;
+		if(!m_refillPosted.exchange(true))
+			QMetaObject::invokeMethod(this, "refillIo", Qt::QueuedConnection);
+		m_sendbuffer = batch.data;
+		m_closeAfterSend = batch.closeAfter;
+		return true;
+	}
+
+	if(!m_ioThreaded && gatherOutbox(maxlen, batch)) {
+		m_sendbuffer = batch.data;
+		m_closeAfterSend = batch.closeAfter;
+		return true;
+	}
+
+	return false;
+}
+
 void MessageQueue::writeData() {
+	// If the socket's own buffer is already filling up, the network can't keep
+	// up with us. Use smaller batches so we don't just pile up data in memory.
+	if(m_socket->bytesToWrite() > m_batchSize)
+		m_batchSize = qMax(m_batchSize / 2, MIN_BATCH_SIZE);
+
+	const int batchSize = m_batchSize;
 	int sentBatch = 0;
 	bool sendMore = true;
 
-	while(sendMore && sentBatch < 1024*64) {
+	while(sendMore && sentBatch < batchSize) {
 		sendMore = false;
-		if(m_sendbuflen==0 && !m_outbox.isEmpty()) {
-			// Upload buffer is empty, but there are messages in the outbox
-			Q_ASSERT(m_sentbytes == 0);
-
-			MessagePtr msg = m_outbox.dequeue();
-			m_sendbuflen = msg->serialize(m_sendbuffer);
-			Q_ASSERT(m_sendbuflen>0);
-			Q_ASSERT(m_sendbuflen <= MAX_BUF_LEN);
-
-			if(msg->type() == protocol::MSG_DISCONNECT) {
-				// Automatically disconnect after Disconnect notification is sent
-				m_closeWhenReady = true;
-				m_outbox.clear();
-			}
-		}
+		if(m_sendbuffer.isEmpty() && !takeNextBatch(batchSize - sentBatch))
+			break;
 
-		if(m_sentbytes < m_sendbuflen) {
+		if(m_sentbytes < m_sendbuffer.length()) {
 #ifndef NDEBUG
 			// Debugging tool: simulate bad network connections by sleeping at odd times
 			if(m_randomlag>0) {
@@ -299,7 +781,21 @@ void MessageQueue::writeData() {
 			}
 #endif
 
-			const int sent = m_socket->write(m_sendbuffer+m_sentbytes, m_sendbuflen-m_sentbytes);
+			int sent;
+			if(m_deflater) {
+				// The whole batch is compressed in one go and the compressed
+				// output is left in the socket's own write buffer.
+				const bool flush = m_compressionFlush == CompressionFlush::EveryBatch || m_closeAfterSend || !hasMoreToWrite();
+				sent = m_sendbuffer.length() - m_sentbytes;
+				const QByteArray compressed = m_deflater->compress(m_sendbuffer.constData()+m_sentbytes, sent, flush);
+				m_unflushed = !flush;
+				if(!compressed.isEmpty() && m_socket->write(compressed) < 0)
+					sent = -1;
+
+			} else {
+				sent = m_socket->write(m_sendbuffer.constData()+m_sentbytes, m_sendbuffer.length()-m_sentbytes);
+			}
+
 			if(sent<0) {
 				// Error
 				emit socketError(m_socket->errorString());
@@ -307,13 +803,14 @@ void MessageQueue::writeData() {
 			}
 			m_sentbytes += sent;
 			sentBatch += sent;
+			m_ioQueuedBytes -= sent;
 
-			Q_ASSERT(m_sentbytes <= m_sendbuflen);
-			if(m_sentbytes >= m_sendbuflen) {
-				// Complete message sent
-				m_sendbuflen=0;
+			Q_ASSERT(m_sentbytes <= m_sendbuffer.length());
+			if(m_sentbytes >= m_sendbuffer.length()) {
+				// Complete batch sent
+				m_sendbuffer = ByteSlice();
 				m_sentbytes=0;
-				if(m_closeWhenReady) {
+				if(m_closeAfterSend) {
 					m_socket->disconnectFromHost();
 
 				} else {
@@ -322,7 +819,185 @@ void MessageQueue::writeData() {
 			}
 		}
 	}
+
+	if(m_unflushed && m_socket->bytesToWrite()==0) {
+		// Nothing left in the socket buffer, so there would be no bytesWritten
+		// signal to continue with. Flush now so the stream doesn't stall.
+		m_unflushed = false;
+		const QByteArray compressed = m_deflater->compress(nullptr, 0, true);
+		if(m_socket->write(compressed) < 0)
+			emit socketError(m_socket->errorString());
+	}
+
+	m_socketBytesToWrite = int(m_socket->bytesToWrite());
+}
+
+bool MessageQueue::isCompressionSupported()
+{
+	return isStreamCompressionSupported();
+}
+
+bool MessageQueue::startCompression(int level, CompressionFlush flush)
+{
+	if(m_deflater) {
+		qWarning("MessageQueue::startCompression: stream is already compressed");
+		return true;
+	}
+
+	if(m_ioThreaded) {
+		qWarning("MessageQueue::startCompression: compression must be started before moving I/O to a thread");
+		return false;
+	}
+
+	if(!isStreamCompressionSupported())
+		return false;
+
+	// The remote end must not send anything after requesting compression
+	// until it has received our reply. Anything received already would
+	// be interpreted the wrong way, so this is a protocol violation.
+	if(m_recvpos != m_recvbytes || !m_inbox.isEmpty() || !m_received.isEmpty()) {
+		qWarning("MessageQueue::startCompression: unexpected data received before compression started");
+		return false;
+	}
+
+	// Everything queued before this point must still go out uncompressed
+	if(m_sentbytes < m_sendbuffer.length())
+		m_socket->write(m_sendbuffer.constData()+m_sentbytes, m_sendbuffer.length()-m_sentbytes);
+	for(const ByteSlice &data : m_controlQueue)
+		m_socket->write(data.constData(), data.length());
+	for(int i=0;i<LANE_COUNT;++i) {
+		for(const QueuedMessage &q : m_outbox[i]) {
+			const ByteSlice data = q.msg->serialized();
+			m_socket->write(data.constData(), data.length());
+			m_stats.addMessage(TrafficStats::Sent, q.msg->type(), data.length());
+		}
+		m_outbox[i].clear();
+	}
+	for(const QueuedData &q : m_ordered) {
+		m_socket->write(q.data.constData(), q.data.length());
+		for(int pos=0;pos<q.data.length();) {
+			const int len = Message::sniffLength(q.data.constData() + pos);
+			const int type = uchar(q.data.at(pos+2));
+			m_stats.addMessage(TrafficStats::Sent, type, len);
+			updateMembership(type, uchar(q.data.at(pos+3)), true);
+			pos += len;
+		}
+	}
+	m_ordered.clear();
+	m_orderedBytes = 0;
+	m_sendbuffer = ByteSlice();
+	m_sentbytes = 0;
+	m_controlQueue.clear();
+	m_ioQueuedBytes = 0;
+	m_socketBytesToWrite = int(m_socket->bytesToWrite());
+
+	m_deflater = new StreamDeflater(level);
+	m_inflater = new StreamInflater;
+	if(!m_deflater->isValid() || !m_inflater->isValid()) {
+		qWarning("MessageQueue::startCompression: couldn't initialize compressor");
+		delete m_deflater;
+		delete m_inflater;
+		m_deflater = nullptr;
+		m_inflater = nullptr;
+		return false;
+	}
+
+	m_compressionFlush = flush;
+	return true;
 }
 
+bool MessageQueue::gatherOutbox(int maxlen, OutgoingBatch &batch)
+{
+	if(isOutboxEmpty())
+		return false;
+
+	// Take messages from the lanes in priority order, followed by the ordered
+	// queue, until the batch is full. The first message is always taken,
+	// even if it's bigger than the limit.
+	QVector<ByteSlice> parts;
+	int batchlen = 0;
+	int serialized = 0;
+	bool disconnect = false;
+	bool full = false;
+	const qint64 now = TrafficStats::now();
+	for(int lane=0;lane<LANE_COUNT && !full;++lane) {
+		QQueue<QueuedMessage> &queue = m_outbox[lane];
+		int count = 0;
+		for(const QueuedMessage &q : queue) {
+			const MessagePtr &msg = q.msg;
+			if(batchlen > 0 && batchlen + msg->length() > maxlen) {
+				full = true;
+				break;
+			}
+			parts << msg->serialized();
+			batchlen += msg->length();
+			m_stats.addMessage(TrafficStats::Sent, msg->type(), msg->length());
+			m_stats.addResidency(TrafficStats::Sent, now - q.queued);
+			++count;
+		}
+		queue.erase(queue.begin(), queue.begin() + count);
+		serialized += count;
+	}
+	if(serialized>0)
+		m_stats.addSerialization(serialized, TrafficStats::now() - now);
+
+	// The ordered queue is already serialized, so whole messages
+	// are sliced off the (possibly shared) buffers without copying.
+	while(!full && !disconnect && !m_ordered.isEmpty()) {
+		QueuedData &q = m_ordered.head();
+		int taken = 0;
+		while(taken < q.data.length()) {
+			const int len = Message::sniffLength(q.data.constData() + taken);
+			if(batchlen > 0 && batchlen + len > maxlen) {
+				full = true;
+				break;
+			}
+			const int type = uchar(q.data.at(taken+2));
+			m_stats.addMessage(TrafficStats::Sent, type, len);
+			m_stats.addResidency(TrafficStats::Sent, now - q.queued);
+			updateMembership(type, uchar(q.data.at(taken+3)), true);
+			taken += len;
+			batchlen += len;
+			if(type == MSG_DISCONNECT) {
+				disconnect = true;
+				break;
+			}
+		}
+
+		m_orderedBytes -= taken;
+		if(taken == q.data.length()) {
+			parts << q.data;
+			m_ordered.dequeue();
+		} else if(taken > 0) {
+			parts << q.data.mid(0, taken);
+			q.data = q.data.mid(taken);
+		}
+	}
+
+	if(parts.size() == 1) {
+		// Just one message or history block: it can be sent as is without copying
+		batch.data = parts.first();
+
+	} else {
+		// Coalesce multiple messages into one contiguous write
+		QByteArray buffer;
+		buffer.reserve(batchlen);
+		for(const ByteSlice &data : parts)
+			buffer.append(data.constData(), data.length());
+		Q_ASSERT(buffer.length() == batchlen);
+		batch.data = ByteSlice(buffer);
+	}
+
+	batch.closeAfter = disconnect;
+	m_ioQueuedBytes += batchlen;
+
+	if(disconnect) {
+		// Automatically disconnect after Disconnect notification is sent
+		m_closeWhenReady = true;
+		clearOutbox();
+	}
+
+	return true;
 }
 
+}
@@ -21,17 +21,33 @@
 #define DP_NET_MSGQUEUE_H
 
 #include "message.h"
+#include "spscqueue.h"
+#include "trafficstats.h"
 
 #include <QQueue>
 #include <QObject>
+#include <atomic>
+#include <functional>
 
 class QTcpSocket;
 class QTimer;
+class QThread;
 
 namespace protocol {
 
+class StreamDeflater;
+class StreamInflater;
+
 /**
  * A wrapper for an IO device for sending and receiving messages.
+ *
+ * The socket I/O side (reading, writing, (de)compression, deserialization
+ * and ping handling) can optionally run in a separate thread. Messages are
+ * exchanged with it through lock-free queues. By default, everything
+ * runs in the thread that owns the MessageQueue.
+ *
+ * When I/O is threaded, the bytesReceived, bytesSent, badData, socketError
+ * and pingPong signals are emitted from the I/O thread.
  */
 class MessageQueue : public QObject {
 Q_OBJECT
@@ -53,6 +69,70 @@ public:
 	 */
 	void setDecodeOpaque(bool d) { m_decodeOpaque = d; }
 
+	/**
+	 * @brief Move socket I/O to a separate thread
+	 *
+	 * Reading, (de)compression, deserialization and writing will then be
+	 * done in the given thread. Ping replies are sent from there too,
+	 * so a busy owner thread won't inflate the measured round trip times.
+	 *
+	 * The socket is moved to the I/O thread as well and the queue takes
+	 * ownership of it. After this, the socket may only be used through its
+	 * signals and the thread safe functions of this class.
+	 * Stream level handshakes (TLS and compression) must be completed
+	 * before calling this.
+	 *
+	 * The thread must be kept running for as long as this queue exists.
+	 * One thread can serve any number of queues.
+	 */
+	void moveIoToThread(QThread *thread);
+
+	//! Is socket I/O done in a separate thread?
+	bool isIoThreaded() const { return m_ioThreaded; }
+
+	/**
+	 * @brief Close the connection once pending data has been written
+	 *
+	 * Unlike sendDisconnect, this does not send a Disconnect message.
+	 * Safe to call when I/O is threaded.
+	 */
+	void disconnectFromHost();
+
+	/**
+	 * @brief Close the connection immediately
+	 *
+	 * Safe to call when I/O is threaded.
+	 */
+	void abort();
+
+	//! When to flush the compressed stream
+	enum class CompressionFlush {
+		EveryBatch, // Flush after every batch of messages (lowest latency)
+		WhenIdle    // Flush only when the upload queue runs empty (best compression)
+	};
+
+	/**
+	 * @brief Is stream compression available in this build?
+	 */
+	static bool isCompressionSupported();
+
+	/**
+	 * @brief Start compressing the stream in both directions
+	 *
+	 * Both ends must switch at the same point in the stream. In practice,
+	 * this means a request/reply handshake after which neither side
+	 * sends anything uncompressed. This must be done before moving
+	 * I/O to a separate thread.
+	 *
+	 * @param level deflate compression level (1-9)
+	 * @param flush flush policy
+	 * @return false if compression is not supported or the remote end sent data too early
+	 */
+	bool startCompression(int level, CompressionFlush flush=CompressionFlush::EveryBatch);
+
+	//! Is the stream compressed?
+	bool isCompressed() const { return m_deflater != nullptr; }
+
 	/**
 	 * @brief Check if there are new messages available
 	 * @return true if getPending will return a message
@@ -67,10 +147,51 @@ public:
 
 	/**
 	 * Enqueue a message for sending.
+	 *
+	 * Chat, laser trail and pointer messages are sent ahead of other
+	 * queued messages, unless a join or leave message of their user is still
+	 * in the queue. Only the latest queued pointer movement of each user is kept.
+	 * All other messages are sent in the order they were queued.
 	 */
 	void send(const MessagePtr &message);
 	void send(const MessageList &messages);
 
+	/**
+	 * @brief Enqueue a batch of session history for sending
+	 *
+	 * This works like send(). The history should be fed in batches
+	 * as the upload queue drains (see allSent), so that a long catch-up
+	 * won't fill up the queue.
+	 */
+	void sendBulk(const MessageList &messages);
+
+	/**
+	 * @brief Enqueue a block of pre-serialized session history for sending
+	 *
+	 * The data must consist of whole serialized messages. The buffer is
+	 * sent without copying, so the same block can be streamed
+	 * to any number of clients at once. Pointer movements in the block
+	 * are stale by the time it is sent and are skipped.
+	 */
+	void sendBulk(const ByteSlice &data);
+
+	/**
+	 * @brief Has the join message of the given user been sent?
+	 *
+	 * Returns false if a join or leave message of the user is still
+	 * waiting in the queue. Messages of a user whose join has been sent
+	 * can safely be sent ahead of the rest of the queue.
+	 */
+	bool isUserJoinSent(uint8_t contextId) const;
+
+	/**
+	 * @brief Set the maximum number of bytes waiting in the ordered queue
+	 *
+	 * If the other end doesn't keep up and the limit is exceeded,
+	 * the connection is aborted. Zero means no limit.
+	 */
+	void setUploadQueueLimit(int bytes) { m_uploadQueueLimit = bytes; }
+
 	/**
 	 * @brief Gracefully disconnect
 	 *
@@ -85,6 +206,9 @@ public:
 
 	/**
 	 * @brief Get the number of bytes in the upload queue
+	 *
+	 * When I/O is threaded, the socket's own buffer is sampled
+	 * by the I/O thread, so this may lag slightly behind.
 	 * @return
 	 */
 	int uploadQueueBytes() const;
@@ -94,8 +218,19 @@ public:
 	 */
 	bool isUploading() const;
 
+	/**
+	 * @brief Get per message type traffic and queueing statistics
+	 *
+	 * The statistics are collected and read in the owner thread, so this
+	 * costs nothing extra when I/O is threaded.
+	 */
+	const TrafficStats &trafficStats() const { return m_stats; }
+
 	/**
 	 * @brief Get the number of milliseconds since the last message sent by the remote end
+	 *
+	 * Reception time is sampled by the once-per-second idle check, so this
+	 * has about a second's resolution.
 	 */
 	qint64 idleTime() const;
 
@@ -175,38 +310,117 @@ signals:
 	void pingPong(qint64 roundtripTime);
 
 private slots:
-	void readData();
-	void dataWritten(qint64);
-	void sslEncrypted();
-	void checkIdleTimeout();
+	// Owner side (called from the I/O thread through queued calls)
+	void takeReceived();
+	void writeIdle();
+	void refillIo();
 
 private:
-	void sendNow(MessagePtr msg);
-
+	// A message waiting in the inbox or the outbox
+	struct QueuedMessage {
+		MessagePtr msg;
+		qint64 queued; // time the message entered the queue (TrafficStats::now())
+	};
+
+	// Serialized session history waiting in the outbox
+	struct QueuedData {
+		ByteSlice data;
+		qint64 queued;
+	};
+
+	// A batch of messages handed over from the I/O side
+	struct ReceivedBatch {
+		MessageList messages;
+		qint64 received = 0;
+	};
+
+	// A batch of serialized messages handed over to the I/O side
+	struct OutgoingBatch {
+		ByteSlice data;
+		bool closeAfter = false; // batch ends with a Disconnect message
+	};
+
+	// Send queue lanes in priority order. These are sent ahead of the ordered queue.
+	enum Lane {
+		ControlLane,     // ping/pong
+		InteractiveLane, // chat, laser trails and pointer movement
+		LANE_COUNT
+	};
+
+	// Owner side
+	bool enqueue(const MessagePtr &msg, qint64 now);
+	void enqueueOrdered(const ByteSlice &data, qint64 now);
+	void updateMembership(int type, uint8_t contextId, bool sent);
+	void clearOutbox();
+	bool isOutboxEmpty() const;
+	bool gatherOutbox(int maxlen, OutgoingBatch &batch);
+	void feedIo();
+	void runInIo(std::function<void()> fn);
+
+	// I/O side
+	void readData();
+	void dataWritten(qint64 bytes);
 	void writeData();
+	bool takeNextBatch(int maxlen);
+	bool hasMoreToWrite() const;
+	void sendNow(MessagePtr msg);
+	void ioSendPing();
+	void prepareReceiveBuffer(qint64 incoming);
+	void extractMessages();
+	void sslEncrypted();
+	void checkIdleTimeout();
 
 	QTcpSocket *m_socket;
+	QObject *m_io;           // context object for the I/O side (a child of this queue until moved to the I/O thread)
+	bool m_ioThreaded;
+
+	// Shared between the owner and the I/O side
+	SpscQueue<ReceivedBatch> m_received;   // I/O -> owner
+	SpscQueue<OutgoingBatch> m_outgoing;   // owner -> I/O
+	std::atomic<bool> m_receivedPosted;    // a takeReceived call is pending
+	std::atomic<bool> m_refillPosted;      // a refillIo call is pending
+	std::atomic<bool> m_writeIdle;         // I/O side has nothing to write and the socket has drained
+	std::atomic<int> m_ioBatches;          // batches handed to the I/O side, not yet taken for writing
+	std::atomic<int> m_batchSize;          // max. number of bytes to write per writeData call
+	std::atomic<int> m_ioQueuedBytes;      // bytes handed to the I/O side, not yet written to the socket
+	std::atomic<int> m_socketBytesToWrite; // bytes in the socket's own write buffer
+	std::atomic<qint64> m_lastRecvTime;
+	std::atomic<bool> m_receivedSinceCheck;
+	std::atomic<bool> m_ignoreIncoming;
+
+	// Owner side
+	QQueue<QueuedMessage> m_inbox;  // pending messages
+	QQueue<QueuedMessage> m_outbox[LANE_COUNT]; // messages that can be sent ahead of the ordered queue
+	QQueue<QueuedData> m_ordered;   // serialized messages and session history (sent in order after the lanes)
+	int m_orderedBytes;             // size of the ordered queue
+	int m_uploadQueueLimit;
+	quint16 m_membershipPending[256]; // number of queued join/leave messages per user
+	bool m_joinSent[256];            // join message of the user has been sent
+	TrafficStats m_stats;
+	bool m_closeWhenReady;
+	bool m_decodeOpaque;
 
-	char *m_recvbuffer; // raw message reception buffer
-	char *m_sendbuffer; // raw message upload buffer
-	int m_recvbytes;    // number of bytes in reception buffer
-	int m_sentbytes;    // number of bytes in upload buffer already sent
-	int m_sendbuflen;   // length of the data in the upload buffer
-
-	QQueue<MessagePtr> m_inbox;  // pending messages
-	QQueue<MessagePtr> m_outbox; // messages to be sent
+	// I/O side
+	QByteArray m_recvbuffer; // raw message reception buffer (opaque messages may reference this)
+	ByteSlice m_sendbuffer;  // serialized message(s) being uploaded
+	int m_recvpos;           // start of the unprocessed data in the reception buffer
+	int m_recvbytes;         // end of the received data in the reception buffer
+	int m_sentbytes;         // number of bytes in upload buffer already sent
+	bool m_closeAfterSend;   // disconnect once the upload buffer has been sent
+	QList<ByteSlice> m_controlQueue; // ping and pong messages (sent ahead of everything else)
+	MessageList m_receiving; // messages extracted in the current read
+
+	StreamDeflater *m_deflater;
+	StreamInflater *m_inflater;
+	CompressionFlush m_compressionFlush;
+	bool m_unflushed;        // compressor may be holding back some data
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
-	qint64 m_lastRecvTime;
+	QMetaObject::Connection m_bytesWrittenConnection;
 	qint64 m_idleTimeout;
 	qint64 m_pingSent;
 
-	bool m_closeWhenReady;
-	bool m_ignoreIncoming;
-
-	bool m_decodeOpaque;
-
 #ifndef NDEBUG
 	uint m_randomlag;
 #endif
@@ -21,7 +21,9 @@
 #include "textmode.h"
 
 #include <cstring>
+#include <chrono>
 #include <QtEndian>
+#include <QStringList>
 
 namespace protocol {
 
@@ -305,4 +307,102 @@ DefaultLayer *DefaultLayer::fromText(uint8_t ctx, const Kwargs &kwargs)
 		);
 }
 
+TraceMark *TraceMark::deserialize(uint8_t ctx, const uchar *data, uint len)
+{
+	if(len < 4 || (len-4) % 9 != 0 || (len-4) / 9 > uint(MAX_STAMPS))
+		return nullptr;
+
+	const quint32 id = qFromBigEndian<quint32>(data);
+	const uint count = (len-4) / 9;
+
+	QVector<Stamp> stamps;
+	stamps.reserve(count);
+	for(uint i=0;i<count;++i) {
+		const uchar *ptr = data + 4 + i*9;
+		if(ptr[0] >= STAGE_COUNT)
+			return nullptr;
+		stamps << Stamp { Stage(ptr[0]), qFromBigEndian<qint64>(ptr+1) };
+	}
+
+	return new TraceMark(ctx, id, stamps);
+}
+
+int TraceMark::payloadLength() const
+{
+	return 4 + m_stamps.size() * 9;
+}
+
+int TraceMark::serializePayload(uchar *data) const
+{
+	uchar *ptr = data;
+	qToBigEndian(m_traceId, ptr); ptr += 4;
+	for(const Stamp &s : m_stamps) {
+		*(ptr++) = s.stage;
+		qToBigEndian(s.time, ptr); ptr += 8;
+	}
+	return ptr - data;
+}
+
+qint64 TraceMark::timestamp()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+		).count();
+}
+
+QString TraceMark::stageName(Stage stage)
+{
+	switch(stage) {
+	case PenEvent: return QStringLiteral("pen");
+	case DabsTaken: return QStringLiteral("dabs");
+	case ServerRelay: return QStringLiteral("server");
+	case Received: return QStringLiteral("received");
+	case Executed: return QStringLiteral("executed");
+	case Painted: return QStringLiteral("painted");
+	case STAGE_COUNT: break;
+	}
+	return QString();
+}
+
+TraceMark *TraceMark::stamped(Stage stage, qint64 time) const
+{
+	QVector<Stamp> stamps = m_stamps;
+	if(stamps.size() < MAX_STAMPS)
+		stamps << Stamp { stage, time };
+	return new TraceMark(contextId(), m_traceId, stamps);
+}
+
+Kwargs TraceMark::kwargs() const
+{
+	QStringList stamps;
+	for(const Stamp &s : m_stamps)
+		stamps << QStringLiteral("%1:%2").arg(int(s.stage)).arg(s.time);
+
+	Kwargs kw;
+	kw["id"] = QString::number(m_traceId);
+	kw["stamps"] = stamps.join(',');
+	return kw;
+}
+
+TraceMark *TraceMark::fromText(uint8_t ctx, const Kwargs &kwargs)
+{
+	QVector<Stamp> stamps;
+#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
+	const QStringList parts = kwargs["stamps"].split(',', QString::SkipEmptyParts);
+#else
+	const QStringList parts = kwargs["stamps"].split(',', Qt::SkipEmptyParts);
+#endif
+	for(const QString &part : parts) {
+		const int sep = part.indexOf(':');
+		if(sep < 0)
+			return nullptr;
+		const int stage = part.left(sep).toInt();
+		if(stage < 0 || stage >= STAGE_COUNT || stamps.size() >= MAX_STAMPS)
+			return nullptr;
+		stamps << Stamp { Stage(stage), part.mid(sep+1).toLongLong() };
+	}
+
+	return new TraceMark(ctx, kwargs["id"].toUInt(), stamps);
+}
+
 }
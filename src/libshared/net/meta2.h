@@ -20,9 +20,11 @@
 #define DP_NET_META_OPAQUE_H
 
 #include "message.h"
+#include "messagepool.h"
 
 #include <QString>
 #include <QList>
+#include <QVector>
 
 namespace protocol {
 
@@ -63,7 +65,7 @@ private:
  * Note. This is a META message, since this is used for a temporary visual effect only,
  * and thus doesn't affect the actual canvas content.
  */
-class MovePointer : public Message {
+class MovePointer : public Message, public PooledMessage<MovePointer> {
 public:
 	MovePointer(uint8_t ctx, int32_t x, int32_t y)
 		: Message(MSG_MOVEPOINTER, ctx), m_x(x), m_y(y)
@@ -217,6 +219,70 @@ private:
 	uint16_t m_id;
 };
 
+/**
+ * @brief Stroke latency tracing mark
+ *
+ * When latency tracing is enabled, a client occasionally sends one of these
+ * just before the drawing commands of a stroke. The mark carries a trace ID
+ * and a list of timestamps of the stages the stroke has passed through.
+ * The server adds its own timestamp and relays the mark to everyone without
+ * storing it in the session history. Receiving clients then time the
+ * execution and display of the next drawing command from the same user.
+ *
+ * Timestamps are wall clock time, so comparing stages recorded on different
+ * computers requires their clocks to be in sync.
+ */
+class TraceMark : public Message {
+public:
+	enum Stage : uint8_t {
+		PenEvent,    // input event received by the drawing tool
+		DabsTaken,   // brush engine produced the dabs
+		ServerRelay, // server relayed the mark
+		Received,    // first drawing command after the mark was received
+		Executed,    // that command was executed by the state tracker
+		Painted,     // the canvas was repainted after the execution
+		STAGE_COUNT
+	};
+
+	struct Stamp {
+		Stage stage;
+		qint64 time; // microseconds since the epoch
+	};
+
+	static const int MAX_STAMPS = 16;
+
+	TraceMark(uint8_t ctx, quint32 traceId, const QVector<Stamp> &stamps)
+		: Message(MSG_TRACE_MARK, ctx), m_traceId(traceId), m_stamps(stamps)
+	{
+		Q_ASSERT(stamps.size() <= MAX_STAMPS);
+	}
+
+	static TraceMark *deserialize(uint8_t ctx, const uchar *data, uint len);
+	static TraceMark *fromText(uint8_t ctx, const Kwargs &kwargs);
+
+	//! Get the current time in the format used by the stamps
+	static qint64 timestamp();
+
+	//! Get the name of a tracing stage
+	static QString stageName(Stage stage);
+
+	quint32 traceId() const { return m_traceId; }
+	const QVector<Stamp> &stamps() const { return m_stamps; }
+
+	//! Get a copy of this mark with a stamp added
+	TraceMark *stamped(Stage stage, qint64 time) const;
+
+	QString messageName() const override { return QStringLiteral("tracemark"); }
+
+protected:
+	int payloadLength() const override;
+	int serializePayload(uchar *data) const override;
+	Kwargs kwargs() const override;
+
+private:
+	quint32 m_traceId;
+	QVector<Stamp> m_stamps;
+};
 
 }
 
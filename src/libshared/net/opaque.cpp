@@ -27,25 +27,35 @@
 #include "undo.h"
 #include "recording.h"
 
+#include <QtEndian>
+
 #include <cstring>
 
 namespace protocol {
 
 OpaqueMessage::OpaqueMessage(MessageType type, uint8_t ctx, const uchar *payload, int payloadLen)
-	: Message(type, ctx), m_length(payloadLen)
+	: Message(type, ctx)
 {
 	Q_ASSERT(type >= 64);
-	if(payloadLen>0) {
-		m_payload = new uchar[payloadLen];
-		memcpy(m_payload, payload, payloadLen);
-	} else {
-		m_payload = nullptr;
-	}
+	Q_ASSERT(payloadLen <= 0xffff);
+
+	QByteArray wire(HEADER_LEN + payloadLen, Qt::Uninitialized);
+	uchar *data = reinterpret_cast<uchar*>(wire.data());
+	qToBigEndian(quint16(payloadLen), data);
+	data[2] = type;
+	data[3] = ctx;
+	if(payloadLen>0)
+		memcpy(data + HEADER_LEN, payload, payloadLen);
+
+	setSerialization(ByteSlice(wire));
 }
 
-OpaqueMessage::~OpaqueMessage()
+OpaqueMessage::OpaqueMessage(const ByteSlice &wire)
+	: Message(MessageType(uchar(wire.at(2))), uchar(wire.at(3)))
 {
-	delete []m_payload;
+	Q_ASSERT(type() >= 64);
+	Q_ASSERT(wire.length() == sniffLength(wire.constData()));
+	setSerialization(wire);
 }
 
 NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uchar *data, uint len)
@@ -63,6 +73,7 @@ NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uc
 	case MSG_LAYER_ACL: msg = LayerACL::deserialize(ctx, data, len); break;
 	case MSG_FEATURE_LEVELS: msg = FeatureAccessLevels::deserialize(ctx, data, len); break;
 	case MSG_LAYER_DEFAULT: msg = DefaultLayer::deserialize(ctx, data, len); break;
+	case MSG_TRACE_MARK: msg = TraceMark::deserialize(ctx, data, len); break;
 	case MSG_FILTERED: return Filtered::deserialize(ctx, data, len);
 
 	case MSG_CANVAS_RESIZE: msg = CanvasResize::deserialize(ctx, data, len); break;
@@ -95,27 +106,28 @@ NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uc
 
 NullableMessageRef OpaqueMessage::decode() const
 {
-	return decode(type(), contextId(), m_payload, m_length);
+	return decode(type(), contextId(), payload(), payloadLength());
 }
 
 int OpaqueMessage::payloadLength() const
 {
-	return m_length;
+	return cachedSerialization().length() - HEADER_LEN;
 }
 
 int OpaqueMessage::serializePayload(uchar *data) const
 {
-	memcpy(data, m_payload, m_length);
-	return m_length;
+	const int len = payloadLength();
+	memcpy(data, payload(), len);
+	return len;
 }
 
 bool OpaqueMessage::payloadEquals(const Message &m) const
 {
 	const OpaqueMessage &om = static_cast<const OpaqueMessage&>(m);
-	if(m_length != om.m_length)
+	if(payloadLength() != om.payloadLength())
 		return false;
 
-	return memcmp(m_payload, om.m_payload, m_length) == 0;
+	return memcmp(payload(), om.payload(), payloadLength()) == 0;
 }
 
 }
@@ -20,6 +20,7 @@
 #define DP_NET_OPAQUE_H
 
 #include "message.h"
+#include "messagepool.h"
 
 #include <QByteArray>
 
@@ -32,11 +33,18 @@ namespace protocol {
  * to decode these, though.
  *
  */
-class OpaqueMessage : public Message
+class OpaqueMessage : public Message, public PooledMessage<OpaqueMessage>
 {
 public:
 	OpaqueMessage(MessageType type, uint8_t ctx, const uchar *payload, int payloadLen);
-	~OpaqueMessage();
+
+	/**
+	 * @brief Construct an opaque message from its wire format
+	 *
+	 * The slice must contain one complete message, header included.
+	 * The data is not copied.
+	 */
+	explicit OpaqueMessage(const ByteSlice &wire);
 	OpaqueMessage(const OpaqueMessage &m) = delete;
 	OpaqueMessage &operator=(const OpaqueMessage &m) = delete;
 
@@ -57,8 +65,9 @@ protected:
 	Kwargs kwargs() const override { return Kwargs(); }
 
 private:
-	uchar *m_payload;
-	int m_length;
+	// The message is stored in wire format in the serialization cache,
+	// so relaying it never needs to re-encode anything.
+	const uchar *payload() const { return reinterpret_cast<const uchar*>(cachedSerialization().constData()) + HEADER_LEN; }
 };
 
 }
@@ -0,0 +1,102 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_SPSCQUEUE_H
+#define DP_NET_SPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+namespace protocol {
+
+/**
+ * @brief A lock-free single producer, single consumer queue
+ *
+ * One thread may push and one (other) thread may pop at the same time
+ * without locking. The queue is unbounded.
+ *
+ * Values are moved in and out of the queue. Note that the queue does nothing to
+ * make the values themselves thread safe: the producer must not keep a reference
+ * to anything it pushed into the queue that isn't safe to share between threads.
+ */
+template<typename T> class SpscQueue {
+public:
+	SpscQueue()
+		: m_head(new Node), m_tail(m_head)
+	{ }
+
+	~SpscQueue()
+	{
+		while(m_head) {
+			Node *n = m_head->next.load(std::memory_order_relaxed);
+			delete m_head;
+			m_head = n;
+		}
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue &operator=(const SpscQueue&) = delete;
+
+	//! Add a value to the end of the queue (producer side)
+	void push(T &&value)
+	{
+		Node *n = new Node;
+		n->value = std::move(value);
+		m_tail->next.store(n, std::memory_order_release);
+		m_tail = n;
+	}
+
+	/**
+	 * @brief Take the first value from the queue (consumer side)
+	 * @return false if the queue was empty
+	 */
+	bool pop(T &value)
+	{
+		Node *next = m_head->next.load(std::memory_order_acquire);
+		if(!next)
+			return false;
+
+		// The next node becomes the new (empty) head
+		value = std::move(next->value);
+		next->value = T();
+		delete m_head;
+		m_head = next;
+		return true;
+	}
+
+	//! Is the queue empty? (consumer side)
+	bool isEmpty() const
+	{
+		return m_head->next.load(std::memory_order_acquire) == nullptr;
+	}
+
+private:
+	struct Node {
+		std::atomic<Node*> next;
+		T value;
+
+		Node() : next(nullptr), value() { }
+	};
+
+	Node *m_head; // consumer's end: always an already consumed node
+	Node *m_tail; // producer's end
+};
+
+}
+
+#endif
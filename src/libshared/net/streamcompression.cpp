@@ -0,0 +1,186 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "streamcompression.h"
+
+#include <QtGlobal>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace protocol {
+
+#ifdef HAVE_ZLIB
+
+bool isStreamCompressionSupported()
+{
+	return true;
+}
+
+struct StreamDeflater::Private {
+	z_stream zs;
+	bool valid;
+};
+
+StreamDeflater::StreamDeflater(int level)
+	: d(new Private)
+{
+	d->zs.zalloc = Z_NULL;
+	d->zs.zfree = Z_NULL;
+	d->zs.opaque = Z_NULL;
+	d->valid = deflateInit(&d->zs, qBound(1, level, 9)) == Z_OK;
+}
+
+StreamDeflater::~StreamDeflater()
+{
+	if(d->valid)
+		deflateEnd(&d->zs);
+	delete d;
+}
+
+bool StreamDeflater::isValid() const
+{
+	return d->valid;
+}
+
+QByteArray StreamDeflater::compress(const char *data, int len, bool flush)
+{
+	Q_ASSERT(d->valid);
+
+	QByteArray out;
+
+	d->zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	d->zs.avail_in = len;
+
+	// Usually one round is enough, since deflateBound gives the worst case output size
+	int chunk = int(deflateBound(&d->zs, len)) + 16;
+	do {
+		const int pos = out.size();
+		out.resize(pos + chunk);
+		d->zs.next_out = reinterpret_cast<Bytef*>(out.data() + pos);
+		d->zs.avail_out = chunk;
+
+		const int ret = deflate(&d->zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		Q_ASSERT(ret != Z_STREAM_ERROR);
+		Q_UNUSED(ret);
+
+		out.resize(pos + chunk - int(d->zs.avail_out));
+		chunk = 4096;
+	} while(d->zs.avail_out == 0);
+
+	Q_ASSERT(d->zs.avail_in == 0);
+	return out;
+}
+
+struct StreamInflater::Private {
+	z_stream zs;
+	QByteArray input;
+	bool valid;
+	bool outputPending;
+};
+
+StreamInflater::StreamInflater()
+	: d(new Private)
+{
+	d->zs.zalloc = Z_NULL;
+	d->zs.zfree = Z_NULL;
+	d->zs.opaque = Z_NULL;
+	d->zs.next_in = Z_NULL;
+	d->zs.avail_in = 0;
+	d->outputPending = false;
+	d->valid = inflateInit(&d->zs) == Z_OK;
+}
+
+StreamInflater::~StreamInflater()
+{
+	if(d->valid)
+		inflateEnd(&d->zs);
+	delete d;
+}
+
+bool StreamInflater::isValid() const
+{
+	return d->valid;
+}
+
+void StreamInflater::setInput(const QByteArray &data)
+{
+	Q_ASSERT(!hasPendingInput());
+	d->input = data;
+	d->zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(d->input.constData()));
+	d->zs.avail_in = d->input.length();
+}
+
+bool StreamInflater::hasPendingInput() const
+{
+	return d->zs.avail_in > 0 || d->outputPending;
+}
+
+int StreamInflater::inflate(char *out, int len)
+{
+	Q_ASSERT(d->valid);
+	Q_ASSERT(len > 0);
+
+	d->zs.next_out = reinterpret_cast<Bytef*>(out);
+	d->zs.avail_out = len;
+
+	const int ret = ::inflate(&d->zs, Z_SYNC_FLUSH);
+	if(ret != Z_OK && ret != Z_BUF_ERROR) {
+		// The stream is never ended, so Z_STREAM_END is an error too
+		d->zs.avail_in = 0;
+		d->outputPending = false;
+		return -1;
+	}
+
+	// If the output buffer was filled, there may be more output waiting
+	d->outputPending = d->zs.avail_out == 0;
+
+	if(!hasPendingInput())
+		d->input = QByteArray();
+
+	return len - int(d->zs.avail_out);
+}
+
+#else
+
+bool isStreamCompressionSupported()
+{
+	return false;
+}
+
+struct StreamDeflater::Private { };
+
+StreamDeflater::StreamDeflater(int level) : d(nullptr) { Q_UNUSED(level); }
+StreamDeflater::~StreamDeflater() { }
+bool StreamDeflater::isValid() const { return false; }
+QByteArray StreamDeflater::compress(const char *, int, bool) { return QByteArray(); }
+
+struct StreamInflater::Private { };
+
+StreamInflater::StreamInflater() : d(nullptr) { }
+StreamInflater::~StreamInflater() { }
+bool StreamInflater::isValid() const { return false; }
+void StreamInflater::setInput(const QByteArray &) { }
+bool StreamInflater::hasPendingInput() const { return false; }
+int StreamInflater::inflate(char *, int) { return -1; }
+
+#endif
+
+}
@@ -0,0 +1,105 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_STREAMCOMPRESSION_H
+#define DP_NET_STREAMCOMPRESSION_H
+
+#include <QByteArray>
+
+namespace protocol {
+
+/**
+ * @brief Is stream compression available in this build?
+ */
+bool isStreamCompressionSupported();
+
+/**
+ * @brief Deflate compressor for one direction of a connection
+ *
+ * The compression state (dictionary) is kept for the lifetime of
+ * the stream, so repetitive messages compress very well.
+ */
+class StreamDeflater {
+public:
+	//! Create a compressor with the given compression level (1-9)
+	explicit StreamDeflater(int level);
+	~StreamDeflater();
+
+	StreamDeflater(const StreamDeflater&) = delete;
+	StreamDeflater &operator=(const StreamDeflater&) = delete;
+
+	bool isValid() const;
+
+	/**
+	 * @brief Compress data
+	 *
+	 * If flush is false, the compressor may keep the data buffered
+	 * to achieve a better compression ratio.
+	 *
+	 * @param data data to compress
+	 * @param len length of the data
+	 * @param flush make everything compressed so far decodable by the receiver
+	 * @return compressed data (may be empty)
+	 */
+	QByteArray compress(const char *data, int len, bool flush);
+
+private:
+	struct Private;
+	Private *d;
+};
+
+/**
+ * @brief Deflate decompressor for one direction of a connection
+ */
+class StreamInflater {
+public:
+	StreamInflater();
+	~StreamInflater();
+
+	StreamInflater(const StreamInflater&) = delete;
+	StreamInflater &operator=(const StreamInflater&) = delete;
+
+	bool isValid() const;
+
+	/**
+	 * @brief Set the next chunk of compressed data
+	 *
+	 * The previous input must have been fully consumed.
+	 */
+	void setInput(const QByteArray &data);
+
+	//! Is there still input (or output) left to process?
+	bool hasPendingInput() const;
+
+	/**
+	 * @brief Decompress data into the given buffer
+	 *
+	 * @param out output buffer
+	 * @param len length of the output buffer
+	 * @return number of bytes written or -1 if the input is invalid
+	 */
+	int inflate(char *out, int len);
+
+private:
+	struct Private;
+	Private *d;
+};
+
+}
+
+#endif
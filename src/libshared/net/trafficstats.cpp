@@ -0,0 +1,221 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trafficstats.h"
+#include "message.h"
+
+#include <QJsonArray>
+
+#include <chrono>
+#include <cstring>
+
+namespace protocol {
+
+LatencyHistogram::LatencyHistogram()
+	: m_count(0), m_total(0), m_max(0)
+{
+	memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+void LatencyHistogram::add(qint64 nsecs)
+{
+	if(nsecs < 0)
+		nsecs = 0;
+
+	qint64 usecs = nsecs / 1000;
+	int b = 0;
+	while(usecs > 0 && b < BUCKETS-1) {
+		usecs >>= 1;
+		++b;
+	}
+
+	++m_buckets[b];
+	++m_count;
+	m_total += nsecs;
+	m_max = qMax(m_max, nsecs);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+	for(int i=0;i<BUCKETS;++i)
+		m_buckets[i] += other.m_buckets[i];
+	m_count += other.m_count;
+	m_total += other.m_total;
+	m_max = qMax(m_max, other.m_max);
+}
+
+qint64 LatencyHistogram::percentile(double p) const
+{
+	if(m_count == 0)
+		return 0;
+
+	const qint64 target = qMax(qint64(1), qint64(m_count * p + 0.5));
+	qint64 seen = 0;
+	for(int i=0;i<BUCKETS;++i) {
+		seen += m_buckets[i];
+		if(seen >= target)
+			return bucketLimit(i);
+	}
+	return bucketLimit(BUCKETS-1);
+}
+
+QJsonObject LatencyHistogram::toJson() const
+{
+	// Buckets are listed up to the last non-empty one
+	int last = BUCKETS-1;
+	while(last >= 0 && m_buckets[last] == 0)
+		--last;
+
+	QJsonArray buckets;
+	for(int i=0;i<=last;++i)
+		buckets << m_buckets[i];
+
+	return QJsonObject {
+		{"count", m_count},
+		{"totalUs", m_total / 1000},
+		{"maxUs", m_max / 1000},
+		{"p50Us", percentile(0.5)},
+		{"p99Us", percentile(0.99)},
+		{"buckets", buckets}
+	};
+}
+
+TrafficStats::TrafficStats()
+	: m_serializedMessages(0), m_serializationTime(0)
+{
+	memset(m_messages, 0, sizeof(m_messages));
+	memset(m_bytes, 0, sizeof(m_bytes));
+}
+
+qint64 TrafficStats::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+		).count();
+}
+
+QString TrafficStats::typeName(int type)
+{
+	switch(type) {
+	case MSG_COMMAND: return QStringLiteral("command");
+	case MSG_DISCONNECT: return QStringLiteral("disconnect");
+	case MSG_PING: return QStringLiteral("ping");
+	case MSG_USER_JOIN: return QStringLiteral("join");
+	case MSG_USER_LEAVE: return QStringLiteral("leave");
+	case MSG_SESSION_OWNER: return QStringLiteral("owner");
+	case MSG_CHAT: return QStringLiteral("chat");
+	case MSG_TRUSTED_USERS: return QStringLiteral("trusted");
+	case MSG_SOFTRESET: return QStringLiteral("softreset");
+	case MSG_PRIVATE_CHAT: return QStringLiteral("pm");
+	case MSG_INTERVAL: return QStringLiteral("interval");
+	case MSG_LASERTRAIL: return QStringLiteral("laser");
+	case MSG_MOVEPOINTER: return QStringLiteral("movepointer");
+	case MSG_MARKER: return QStringLiteral("marker");
+	case MSG_USER_ACL: return QStringLiteral("useracl");
+	case MSG_LAYER_ACL: return QStringLiteral("layeracl");
+	case MSG_FEATURE_LEVELS: return QStringLiteral("featureaccess");
+	case MSG_LAYER_DEFAULT: return QStringLiteral("defaultlayer");
+	case MSG_FILTERED: return QStringLiteral("filtered");
+	case MSG_TRACE_MARK: return QStringLiteral("tracemark");
+	case MSG_UNDOPOINT: return QStringLiteral("undopoint");
+	case MSG_CANVAS_RESIZE: return QStringLiteral("resize");
+	case MSG_LAYER_CREATE: return QStringLiteral("newlayer");
+	case MSG_LAYER_ATTR: return QStringLiteral("layerattr");
+	case MSG_LAYER_RETITLE: return QStringLiteral("retitlelayer");
+	case MSG_LAYER_ORDER: return QStringLiteral("layerorder");
+	case MSG_LAYER_DELETE: return QStringLiteral("deletelayer");
+	case MSG_LAYER_VISIBILITY: return QStringLiteral("layervisibility");
+	case MSG_PUTIMAGE: return QStringLiteral("putimage");
+	case MSG_FILLRECT: return QStringLiteral("fillrect");
+	case MSG_PEN_UP: return QStringLiteral("penup");
+	case MSG_ANNOTATION_CREATE: return QStringLiteral("newannotation");
+	case MSG_ANNOTATION_RESHAPE: return QStringLiteral("reshapeannotation");
+	case MSG_ANNOTATION_EDIT: return QStringLiteral("editannotation");
+	case MSG_ANNOTATION_DELETE: return QStringLiteral("deleteannotation");
+	case MSG_REGION_MOVE: return QStringLiteral("moveregion");
+	case MSG_PUTTILE: return QStringLiteral("puttile");
+	case MSG_CANVAS_BACKGROUND: return QStringLiteral("background");
+	case MSG_DRAWDABS_CLASSIC: return QStringLiteral("classicdabs");
+	case MSG_DRAWDABS_PIXEL: return QStringLiteral("pixeldabs");
+	case MSG_DRAWDABS_PIXEL_SQUARE: return QStringLiteral("squarepixeldabs");
+	case MSG_UNDO: return QStringLiteral("undo");
+	default: return QStringLiteral("type%1").arg(type);
+	}
+}
+
+void TrafficStats::addSerialization(int messages, qint64 nsecs)
+{
+	m_serializedMessages += messages;
+	m_serializationTime += nsecs;
+}
+
+void TrafficStats::merge(const TrafficStats &other)
+{
+	for(int d=0;d<2;++d) {
+		for(int i=0;i<256;++i) {
+			m_messages[d][i] += other.m_messages[d][i];
+			m_bytes[d][i] += other.m_bytes[d][i];
+		}
+		m_residency[d].merge(other.m_residency[d]);
+	}
+	m_serializedMessages += other.m_serializedMessages;
+	m_serializationTime += other.m_serializationTime;
+}
+
+qint64 TrafficStats::totalMessages(Direction dir) const
+{
+	qint64 total = 0;
+	for(int i=0;i<256;++i)
+		total += m_messages[dir][i];
+	return total;
+}
+
+qint64 TrafficStats::totalBytes(Direction dir) const
+{
+	qint64 total = 0;
+	for(int i=0;i<256;++i)
+		total += m_bytes[dir][i];
+	return total;
+}
+
+QJsonObject TrafficStats::toJson() const
+{
+	QJsonObject types;
+	for(int i=0;i<256;++i) {
+		if(m_messages[Received][i] == 0 && m_messages[Sent][i] == 0)
+			continue;
+
+		types[typeName(i)] = QJsonObject {
+			{"received", m_messages[Received][i]},
+			{"receivedBytes", m_bytes[Received][i]},
+			{"sent", m_messages[Sent][i]},
+			{"sentBytes", m_bytes[Sent][i]}
+		};
+	}
+
+	return QJsonObject {
+		{"types", types},
+		{"inboxResidency", m_residency[Received].toJson()},
+		{"outboxResidency", m_residency[Sent].toJson()},
+		{"serialized", m_serializedMessages},
+		{"serializationUs", m_serializationTime / 1000}
+	};
+}
+
+}
@@ -0,0 +1,158 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_TRAFFICSTATS_H
+#define DP_NET_TRAFFICSTATS_H
+
+#include <QtGlobal>
+#include <QJsonObject>
+
+namespace protocol {
+
+/**
+ * @brief A histogram of durations with power of two buckets
+ *
+ * Bucket 0 counts durations under one microsecond and bucket N
+ * durations of 2^(N-1) to 2^N microseconds. The last bucket also
+ * counts everything longer than that.
+ */
+class LatencyHistogram {
+public:
+	static const int BUCKETS = 26; // the last regular bucket ends at ~33 seconds
+
+	LatencyHistogram();
+
+	//! Add a sample
+	void add(qint64 nsecs);
+
+	//! Add all the samples of another histogram to this one
+	void merge(const LatencyHistogram &other);
+
+	//! Total number of samples
+	qint64 count() const { return m_count; }
+
+	//! Sum of all samples in nanoseconds
+	qint64 total() const { return m_total; }
+
+	//! The longest sample in nanoseconds
+	qint64 max() const { return m_max; }
+
+	//! Number of samples in the given bucket
+	qint64 bucket(int i) const { return m_buckets[i]; }
+
+	//! Upper bound of the given bucket in microseconds
+	static qint64 bucketLimit(int i) { return qint64(1) << i; }
+
+	/**
+	 * @brief Estimate a percentile
+	 *
+	 * @param p percentile (0.0 - 1.0)
+	 * @return upper bound of the bucket the percentile falls into (in microseconds)
+	 */
+	qint64 percentile(double p) const;
+
+	QJsonObject toJson() const;
+
+private:
+	qint64 m_buckets[BUCKETS];
+	qint64 m_count;
+	qint64 m_total;
+	qint64 m_max;
+};
+
+/**
+ * @brief Per message type traffic statistics of a connection
+ *
+ * This is a plain value class: the MessageQueue keeps one up to date
+ * in its owner thread and hands out copies of it.
+ *
+ * Messages handled entirely by the MessageQueue itself (pings and pongs)
+ * are not counted.
+ */
+class TrafficStats {
+public:
+	enum Direction {
+		Received,
+		Sent
+	};
+
+	TrafficStats();
+
+	//! Get a monotonic timestamp in nanoseconds
+	static qint64 now();
+
+	//! Get a human readable name for a message type
+	static QString typeName(int type);
+
+	//! Count a message
+	void addMessage(Direction dir, int type, int bytes)
+	{
+		m_messages[dir][type & 0xff] += 1;
+		m_bytes[dir][type & 0xff] += bytes;
+	}
+
+	/**
+	 * @brief Record how long a message spent in the MessageQueue
+	 *
+	 * For received messages, this is the time from being read from the socket
+	 * to being taken out with getPending(). For sent messages, it's the time
+	 * from being enqueued to being serialized for writing.
+	 */
+	void addResidency(Direction dir, qint64 nsecs) { m_residency[dir].add(nsecs); }
+
+	//! Record the time taken to serialize a batch of outgoing messages
+	void addSerialization(int messages, qint64 nsecs);
+
+	//! Add the counts of another connection to these
+	void merge(const TrafficStats &other);
+
+	qint64 messages(Direction dir, int type) const { return m_messages[dir][type & 0xff]; }
+	qint64 bytes(Direction dir, int type) const { return m_bytes[dir][type & 0xff]; }
+
+	//! Total number of messages in the given direction
+	qint64 totalMessages(Direction dir) const;
+
+	//! Total number of message bytes in the given direction
+	qint64 totalBytes(Direction dir) const;
+
+	const LatencyHistogram &residency(Direction dir) const { return m_residency[dir]; }
+
+	//! Number of messages serialized for sending
+	qint64 serializedMessages() const { return m_serializedMessages; }
+
+	//! Time spent serializing messages in nanoseconds
+	qint64 serializationTime() const { return m_serializationTime; }
+
+	/**
+	 * @brief Get the statistics in a form suitable for the JSON API
+	 *
+	 * Message types that were not seen at all are left out.
+	 */
+	QJsonObject toJson() const;
+
+private:
+	qint64 m_messages[2][256];
+	qint64 m_bytes[2][256];
+	LatencyHistogram m_residency[2];
+	qint64 m_serializedMessages;
+	qint64 m_serializationTime;
+};
+
+}
+
+#endif
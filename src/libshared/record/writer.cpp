@@ -21,7 +21,6 @@
 #include "header.h"
 #include "../net/recording.h"
 
-#include <QVarLengthArray>
 #include <QDateTime>
 #include <QFile>
 #include <QTimer>
@@ -138,10 +137,8 @@ bool Writer::writeMessage(const protocol::Message &msg)
 	Q_ASSERT(m_file->isOpen());
 
 	if(m_encoding == Encoding::Binary) {
-		QVarLengthArray<char> buf(msg.length());
-		const int len = msg.serialize(buf.data());
-		Q_ASSERT(len == buf.length());
-		if(m_file->write(buf.data(), len) != len)
+		const protocol::ByteSlice buf = msg.serialized();
+		if(m_file->write(buf.constData(), buf.length()) != buf.length())
 			return false;
 
 	} else {
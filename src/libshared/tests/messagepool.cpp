@@ -0,0 +1,124 @@
+#include "../net/brushes.h"
+#include "../net/meta2.h"
+#include "../net/opaque.h"
+#include "../net/undo.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+
+// A subclass with a different size than its parent bypasses the pool.
+// This is used as the baseline in the allocation benchmark.
+class HeapPenUp : public PenUp {
+public:
+	HeapPenUp(uint8_t ctx) : PenUp(ctx), m_padding(0) { }
+private:
+	int m_padding;
+};
+
+class TestMessagePool: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testReuse()
+	{
+		MessageFreeList *list = PooledMessage<MovePointer>::freeList();
+		QVERIFY(list);
+
+		Message *first = new MovePointer(1, 2, 3);
+		const int freeCount = list->freeCount();
+		delete first;
+		QCOMPARE(list->freeCount(), freeCount + 1);
+
+		// The freed block should be reused for the next message of the same type
+		Message *second = new MovePointer(4, 5, 6);
+		QCOMPARE(second, first);
+		QCOMPARE(list->freeCount(), freeCount);
+		QVERIFY(second->equals(MovePointer(4, 5, 6)));
+		delete second;
+
+		// Differently sized subclasses use the regular heap
+		const int penFree = PooledMessage<PenUp>::freeList()->freeCount();
+		delete new HeapPenUp(1);
+		QCOMPARE(PooledMessage<PenUp>::freeList()->freeCount(), penFree);
+	}
+
+	void benchmarkAllocation_data()
+	{
+		QTest::addColumn<bool>("pooled");
+		QTest::newRow("heap") << false;
+		QTest::newRow("pooled") << true;
+	}
+
+	void benchmarkAllocation()
+	{
+		QFETCH(bool, pooled);
+		MessageList list;
+		list.reserve(MESSAGES);
+
+		QBENCHMARK {
+			for(int i=0;i<MESSAGES;++i)
+				list << MessagePtr(pooled ? new PenUp(1) : new HeapPenUp(1));
+			list.clear();
+		}
+	}
+
+	void benchmarkCatchup()
+	{
+		// Decoding a session history full of dabs
+		const QByteArray buffer = makeHistory();
+		MessageList list;
+		list.reserve(MESSAGES * 2);
+
+		QBENCHMARK {
+			int pos = 0;
+			while(pos < buffer.length()) {
+				const int len = Message::sniffLength(buffer.constData() + pos);
+				list << MessagePtr::fromNullable(Message::deserialize(reinterpret_cast<const uchar*>(buffer.constData()) + pos, len, true));
+				pos += len;
+			}
+			list.clear();
+		}
+	}
+
+	void benchmarkFanout()
+	{
+		// Relaying opaque messages to a number of clients, like the server does
+		const QByteArray buffer = makeHistory();
+		const int CLIENTS = 8;
+		MessageList outboxes[CLIENTS];
+
+		QBENCHMARK {
+			int pos = 0;
+			while(pos < buffer.length()) {
+				const int len = Message::sniffLength(buffer.constData() + pos);
+				const MessagePtr msg = MessagePtr::fromNullable(Message::deserialize(buffer, pos, len, false));
+				for(int i=0;i<CLIENTS;++i)
+					outboxes[i] << msg;
+				pos += len;
+			}
+			for(int i=0;i<CLIENTS;++i)
+				outboxes[i].clear();
+		}
+	}
+
+private:
+	static const int MESSAGES = 10000;
+
+	static QByteArray makeHistory()
+	{
+		QByteArray buffer;
+		for(int i=0;i<MESSAGES;++i) {
+			const DrawDabsPixel dabs(DabShape::Round, 1, 0x0101, i, i, 0xff000000, 0x10,
+				PixelBrushDabVector() << PixelBrushDab {1, 1, 10, 255} << PixelBrushDab {1, 1, 10, 255});
+			const PenUp penup(1);
+			buffer.append(dabs.serialized().toByteArray());
+			buffer.append(penup.serialized().toByteArray());
+		}
+		return buffer;
+	}
+};
+
+
+QTEST_MAIN(TestMessagePool)
+#include "messagepool.moc"
@@ -1,5 +1,6 @@
 #include "../net/messagequeue.h"
 #include "../net/meta.h"
+#include "../net/meta2.h"
 
 #include <QtTest/QtTest>
 #include <QTcpSocket>
@@ -171,6 +172,382 @@ private slots:
 		loopUntil(allReceived);
 	}
 
+	void testBatchedSend()
+	{
+		auto mq = getMsgQueue();
+
+		// Enough data to span several upload batches
+		const int sendCount = 2000;
+		const QByteArray padding(200, 'x');
+
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, padding, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived) + padding);
+				if(++countReceived == sendCount)
+					allReceived = true;
+				QVERIFY(countReceived <= sendCount);
+			}
+		});
+
+		for(int i=0;i<sendCount;++i)
+			mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(i) + padding)));
+
+		loopUntil(allReceived);
+		QCOMPARE(mq->uploadQueueBytes(), 0);
+	}
+
+	void testCompressedSend()
+	{
+		if(!MessageQueue::isCompressionSupported())
+			QSKIP("Compression not supported");
+
+		auto mq = getMsgQueue();
+
+		// The echo server sends our compressed stream right back to us
+		QVERIFY(mq->startCompression(6));
+		QVERIFY(mq->isCompressed());
+
+		const int sendCount = 500;
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived));
+				if(++countReceived == sendCount)
+					allReceived = true;
+				QVERIFY(countReceived <= sendCount);
+			}
+		});
+
+		for(int i=0;i<sendCount;++i)
+			mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(i))));
+
+		loopUntil(allReceived);
+	}
+
+	void testTrafficStats()
+	{
+		auto mq = getMsgQueue();
+
+		const int sendCount = 50;
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				mq->getPending();
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		int chatBytes = 0;
+		for(int i=0;i<sendCount-1;++i) {
+			MessagePtr msg(new Chat(0, 0, 0, QByteArray::number(i)));
+			chatBytes += msg->length();
+			mq->send(msg);
+		}
+		MessagePtr pointer(new MovePointer(1, 10, 20));
+		mq->send(pointer);
+
+		loopUntil(allReceived);
+
+		// The echo server sends everything back, so both directions should match
+		const TrafficStats &stats = mq->trafficStats();
+		for(const TrafficStats::Direction dir : {TrafficStats::Sent, TrafficStats::Received}) {
+			QCOMPARE(stats.messages(dir, MSG_CHAT), qint64(sendCount-1));
+			QCOMPARE(stats.bytes(dir, MSG_CHAT), qint64(chatBytes));
+			QCOMPARE(stats.messages(dir, MSG_MOVEPOINTER), qint64(1));
+			QCOMPARE(stats.totalMessages(dir), qint64(sendCount));
+			QCOMPARE(stats.totalBytes(dir), qint64(chatBytes + pointer->length()));
+			QCOMPARE(stats.residency(dir).count(), qint64(sendCount));
+		}
+		QCOMPARE(stats.serializedMessages(), qint64(sendCount));
+
+		const QJsonObject json = stats.toJson();
+		QCOMPARE(json["types"].toObject()["chat"].toObject()["sent"].toInt(), sendCount-1);
+		QVERIFY(!json["types"].toObject().contains("penup"));
+	}
+
+	void testLatencyHistogram()
+	{
+		LatencyHistogram h;
+		QCOMPARE(h.percentile(0.5), qint64(0));
+
+		h.add(500);         // under 1us: bucket 0
+		h.add(1500);        // 1us: bucket 1
+		h.add(3000000);     // 3ms: bucket 12 (2048-4096us)
+		h.add(qint64(1) << 50); // way off the scale: last bucket
+
+		QCOMPARE(h.count(), qint64(4));
+		QCOMPARE(h.bucket(0), qint64(1));
+		QCOMPARE(h.bucket(1), qint64(1));
+		QCOMPARE(h.bucket(12), qint64(1));
+		QCOMPARE(h.bucket(LatencyHistogram::BUCKETS-1), qint64(1));
+		QCOMPARE(h.max(), qint64(1) << 50);
+
+		QCOMPARE(h.percentile(0.5), qint64(2));
+		QCOMPARE(h.percentile(0.75), qint64(4096));
+	}
+
+	void testPriorityLanes()
+	{
+		auto mq = getMsgQueue();
+		mq->setDecodeOpaque(true);
+
+		// Queue up more history than can be sent in one go
+		const int historyCount = 2000;
+		const QByteArray padding(200, 'x');
+		MessageList history;
+		for(int i=0;i<historyCount;++i)
+			history << MessagePtr(new UserJoin(0, 0, QByteArray::number(i) + padding, QByteArray()));
+		mq->sendBulk(history);
+
+		// Only the latest pointer position of each user should be sent
+		const int queued = mq->uploadQueueBytes();
+		mq->send(MessagePtr(new MovePointer(1, 10, 10)));
+		mq->send(MessagePtr(new MovePointer(2, 20, 20)));
+		mq->send(MessagePtr(new MovePointer(1, 30, 30)));
+		QCOMPARE(mq->uploadQueueBytes(), queued + 2 * MovePointer(1, 0, 0).length());
+
+		// Other messages must not overtake the history
+		mq->send(MessagePtr(new UserLeave(5)));
+
+		int historyReceived = 0;
+		int pointersReceived = 0;
+		int historyBeforePointers = -1;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				if(got->type() == MSG_MOVEPOINTER) {
+					const MovePointer &mp = got.cast<MovePointer>();
+					QCOMPARE(mp.x(), mp.contextId() == 1 ? 30 : 20);
+					++pointersReceived;
+					historyBeforePointers = historyReceived;
+				} else if(got->type() == MSG_USER_LEAVE) {
+					QCOMPARE(historyReceived, historyCount);
+					allReceived = true;
+				} else {
+					QCOMPARE(got->type(), MSG_USER_JOIN);
+					QCOMPARE(got.cast<UserJoin>().name(), QString::number(historyReceived) + padding);
+					++historyReceived;
+				}
+			}
+		});
+
+		loopUntil(allReceived);
+		QCOMPARE(pointersReceived, 2);
+
+		// Pointers should have overtaken the rest of the history
+		QVERIFY(historyBeforePointers < historyCount);
+	}
+
+	void testJoinOrdering()
+	{
+		auto mq = getMsgQueue();
+		mq->setDecodeOpaque(true);
+
+		// User 1 joins at the end of a long history
+		const int historyCount = 2000;
+		const QByteArray padding(200, 'x');
+		MessageList history;
+		for(int i=0;i<historyCount;++i)
+			history << MessagePtr(new UserJoin(0, 0, QByteArray::number(i) + padding, QByteArray()));
+		history << MessagePtr(new UserJoin(1, 0, QByteArray("one"), QByteArray()));
+		mq->sendBulk(history);
+		QVERIFY(!mq->isUserJoinSent(1));
+
+		// User 1's messages must wait for the join, but user 2's may go ahead
+		mq->send(MessagePtr(new Chat(1, 0, 0, QByteArray("hello"))));
+		mq->send(MessagePtr(new MovePointer(1, 10, 10)));
+		mq->send(MessagePtr(new MovePointer(2, 20, 20)));
+
+		int historyReceived = 0;
+		bool joined = false;
+		bool gotChat = false;
+		bool gotPointer = false;
+		int historyBeforeUser2 = -1;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				if(got->contextId() == 1) {
+					if(got->type() == MSG_USER_JOIN) {
+						QCOMPARE(historyReceived, historyCount);
+						joined = true;
+					} else if(got->type() == MSG_CHAT) {
+						QVERIFY(joined);
+						gotChat = true;
+					} else {
+						QCOMPARE(got->type(), MSG_MOVEPOINTER);
+						QVERIFY(gotChat);
+						gotPointer = true;
+					}
+				} else if(got->contextId() == 2) {
+					historyBeforeUser2 = historyReceived;
+				} else {
+					++historyReceived;
+				}
+			}
+		});
+
+		loopUntil(gotPointer);
+		QVERIFY(historyBeforeUser2 < historyCount);
+		QVERIFY(mq->isUserJoinSent(1));
+		QVERIFY(!mq->isUserJoinSent(2));
+	}
+
+	void testUploadQueueLimit()
+	{
+		auto s = getConnection();
+		QVERIFY(s->waitForConnected());
+		MessageQueue mq(s.get());
+		mq.setUploadQueueLimit(1024 * 64);
+
+		bool disconnected = false;
+		connect(s.get(), &QTcpSocket::disconnected, [&disconnected]() {
+			disconnected = true;
+		});
+
+		const QByteArray padding(200, 'x');
+		for(int i=0;i<2000;++i)
+			mq.send(MessagePtr(new UserJoin(0, 0, QByteArray::number(i) + padding, QByteArray())));
+
+		loopUntil(disconnected);
+	}
+
+	void testSerializedBulk()
+	{
+		// A block of history larger than one upload batch
+		const int historyCount = 2000;
+		const QByteArray padding(200, 'x');
+		QByteArray block;
+		int chatBytes = 0;
+		for(int i=0;i<historyCount;++i) {
+			const ByteSlice data = MessagePtr(new Chat(0, 0, 0, QByteArray::number(i) + padding))->serialized();
+			block.append(data.constData(), data.length());
+			chatBytes += data.length();
+
+			// Stale pointer movements are skipped
+			if(i % 100 == 0) {
+				const ByteSlice pointer = MessagePtr(new MovePointer(1, i, i))->serialized();
+				block.append(pointer.constData(), pointer.length());
+			}
+		}
+
+		// The same block can be streamed to several clients at once
+		auto mq1 = getMsgQueue();
+		auto mq2 = getMsgQueue();
+		mq1->setDecodeOpaque(true);
+		mq2->setDecodeOpaque(true);
+
+		int received1 = 0, received2 = 0;
+		bool allReceived1 = false, allReceived2 = false;
+
+		auto receiver = [padding, historyCount](MessageQueue *mq, int &received, bool &allReceived) {
+			return [mq, padding, historyCount, &received, &allReceived]() {
+				while(mq->isPending()) {
+					MessagePtr got = mq->getPending();
+					QCOMPARE(got->type(), MSG_CHAT);
+					QCOMPARE(got.cast<Chat>().message(), QString::number(received) + padding);
+					if(++received == historyCount)
+						allReceived = true;
+				}
+			};
+		};
+		connect(mq1.get(), &MessageQueue::messageAvailable, receiver(mq1.get(), received1, allReceived1));
+		connect(mq2.get(), &MessageQueue::messageAvailable, receiver(mq2.get(), received2, allReceived2));
+
+		mq1->sendBulk(ByteSlice(block));
+		mq2->sendBulk(ByteSlice(block, 0, block.length()));
+		QCOMPARE(mq1->uploadQueueBytes(), chatBytes);
+
+		loopUntil(allReceived1);
+		loopUntil(allReceived2);
+
+		QCOMPARE(mq1->trafficStats().messages(TrafficStats::Sent, MSG_CHAT), qint64(historyCount));
+		QCOMPARE(mq1->trafficStats().bytes(TrafficStats::Sent, MSG_CHAT), qint64(chatBytes));
+		QCOMPARE(mq1->trafficStats().messages(TrafficStats::Sent, MSG_MOVEPOINTER), qint64(0));
+	}
+
+	void testThreadedIo()
+	{
+		QThread ioThread;
+		ioThread.start();
+
+		{
+			// The socket should be connected before moving it to the I/O thread
+			auto s = getConnection();
+			QVERIFY(s->waitForConnected());
+			std::unique_ptr<MessageQueue> mq { new MessageQueue(s.get()) };
+			s->setParent(mq.get());
+			s.release();
+
+			mq->moveIoToThread(&ioThread);
+			QVERIFY(mq->isIoThreaded());
+
+			const int sendCount = 500;
+			int countReceived = 0;
+			bool allReceived = false;
+
+			connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+				while(mq->isPending()) {
+					MessagePtr got = mq->getPending();
+					QCOMPARE(got->type(), MSG_CHAT);
+					QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived));
+					if(++countReceived == sendCount)
+						allReceived = true;
+					QVERIFY(countReceived <= sendCount);
+				}
+			});
+
+			for(int i=0;i<sendCount;++i)
+				mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(i))));
+
+			loopUntil(allReceived);
+
+			// The echoed ping is answered by the I/O thread and the echoed pong completes the round trip
+			bool gotPong = false;
+			connect(mq.get(), &MessageQueue::pingPong, this, [&gotPong]() { gotPong = true; });
+			mq->sendPing();
+			loopUntil(gotPong);
+		}
+
+		ioThread.quit();
+		ioThread.wait();
+	}
+
+	void testDeleteAfterIoThreadStopped()
+	{
+		QThread ioThread;
+		ioThread.start();
+
+		auto s = getConnection();
+		QVERIFY(s->waitForConnected());
+		std::unique_ptr<MessageQueue> mq { new MessageQueue(s.get()) };
+		s->setParent(mq.get());
+		s.release();
+
+		mq->moveIoToThread(&ioThread);
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray("hello"))));
+
+		ioThread.quit();
+		ioThread.wait();
+
+		// Must not block waiting for the stopped thread
+		mq.reset();
+	}
+
 	void testSendDisconnect()
 	{
 		auto s = getConnection();
@@ -8,6 +8,7 @@
 #include "../net/undo.h"
 #include "../net/brushes.h"
 #include "../net/textmode.h"
+#include "../net/opaque.h"
 
 #include <QtTest/QtTest>
 
@@ -43,6 +44,9 @@ private slots:
 		QTest::newRow("layeracl") << (Message*)new LayerACL(13, 0x1122, 0x01, 0x02, QList<uint8_t>() << 3 << 4 << 5);
 		QTest::newRow("featureaccess") << (Message*)new FeatureAccessLevels(14, (const uint8_t*)"\0\1\2\3\0\1\2\3\0");
 		QTest::newRow("defaultlayer") << (Message*)new DefaultLayer(14, 0x1401);
+		QTest::newRow("tracemark") << (Message*)new TraceMark(14, 0x11223344, QVector<TraceMark::Stamp>()
+			<< TraceMark::Stamp { TraceMark::PenEvent, 1500000000000000LL }
+			<< TraceMark::Stamp { TraceMark::DabsTaken, 1500000000000123LL });
 
 		QTest::newRow("undopoint") << (Message*)new UndoPoint(15);
 		QTest::newRow("canvasresize") << (Message*)new CanvasResize(16, -0xfff, 0xaaa, -0xbbb, 0xccc);
@@ -128,6 +132,60 @@ private slots:
 		QVERIFY(unwrapped->equals(*original));
 	}
 
+	void testSerializedCache()
+	{
+		MessagePtr msg(new SessionOwner(1, QList<uint8_t>() << 1 << 2));
+
+		QByteArray expected(msg->length(), 0);
+		msg->serialize(expected.data());
+
+		const QByteArray first = msg->serialized().toByteArray();
+		QCOMPARE(first, expected);
+
+		// Changing the context ID patches the cache without touching earlier copies
+		msg->setContextId(2);
+		QCOMPARE(first, expected);
+		QCOMPARE(int(msg->serialized().at(3)), 2);
+
+		// Modifying the payload invalidates the cache
+		msg.cast<SessionOwner>().setIds(QList<uint8_t>() << 3);
+		expected = QByteArray(msg->length(), 0);
+		msg->serialize(expected.data());
+		QCOMPARE(msg->serialized().toByteArray(), expected);
+
+		// Opaque messages are stored in wire format to begin with
+		const QByteArray resize = CanvasResize(1, 2, 3, 4, 5).serialized().toByteArray();
+		NullableMessageRef opaque = Message::deserialize(reinterpret_cast<const uchar*>(resize.constData()), resize.length(), false);
+		QVERIFY(!opaque.isNull());
+		QCOMPARE(opaque->serialized().toByteArray(), resize);
+		opaque->setContextId(9);
+		QCOMPARE(int(opaque->serialized().at(3)), 9);
+		QVERIFY(opaque.cast<OpaqueMessage>().decode()->equals(CanvasResize(9, 2, 3, 4, 5)));
+	}
+
+	void testSharedBufferDeserialization()
+	{
+		const QByteArray first = PenUp(1).serialized().toByteArray();
+		const QByteArray second = CanvasResize(2, 1, 2, 3, 4).serialized().toByteArray();
+		const QByteArray buffer = first + second;
+
+		// Opaque messages should reference the buffer rather than copy it
+		NullableMessageRef msg = Message::deserialize(buffer, first.length(), second.length(), false);
+		QVERIFY(!msg.isNull());
+		QCOMPARE(msg->type(), MSG_CANVAS_RESIZE);
+		QVERIFY(msg->serialized().constData() == buffer.constData() + first.length());
+		QCOMPARE(msg->serialized().toByteArray(), second);
+		QVERIFY(msg.cast<OpaqueMessage>().decode()->equals(CanvasResize(2, 1, 2, 3, 4)));
+
+		// Decoded messages work as before
+		msg = Message::deserialize(buffer, 0, buffer.length(), true);
+		QVERIFY(!msg.isNull());
+		QVERIFY(msg->equals(PenUp(1)));
+
+		// Incomplete messages are rejected
+		QVERIFY(Message::deserialize(buffer, first.length(), second.length()-1, false).isNull());
+	}
+
 	void testLayerOrderSanitation_data()
 	{
 		QTest::addColumn<IdList>("reorder");
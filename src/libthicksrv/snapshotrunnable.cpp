@@ -0,0 +1,56 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "snapshotrunnable.h"
+
+#include "../libclient/canvas/aclfilter.h"
+#include "../libclient/canvas/loader.h"
+#include "../libclient/core/layerstack.h"
+
+namespace server {
+
+SnapshotRunnable::SnapshotRunnable(uint8_t contextId, const paintcore::LayerStack *layers, const canvas::AclFilter *aclFilter, int defaultLayer, const QString &pinnedMessage, QObject *parent)
+	: QObject(parent),
+	  m_layerstack(layers->clone(this)),
+	  m_aclfilter(aclFilter->clone(this)),
+	  m_pinnedMessage(pinnedMessage),
+	  m_defaultLayer(defaultLayer),
+	  m_contextId(contextId)
+{
+	setAutoDelete(false);
+}
+
+void SnapshotRunnable::run()
+{
+	{
+		auto loader = canvas::SnapshotLoader(
+				m_contextId,
+				m_layerstack,
+				m_aclfilter
+		);
+
+		loader.setDefaultLayer(m_defaultLayer);
+		loader.setPinnedMessage(m_pinnedMessage);
+
+		m_messages = loader.loadInitCommands();
+	}
+
+	emit snapshotReady();
+}
+
+}
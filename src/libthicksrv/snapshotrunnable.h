@@ -0,0 +1,73 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SERVER_SNAPSHOTRUNNABLE_H
+#define DP_SERVER_SNAPSHOTRUNNABLE_H
+
+#include "../libshared/net/message.h"
+
+#include <QObject>
+#include <QRunnable>
+
+namespace paintcore {
+	class LayerStack;
+}
+
+namespace canvas {
+	class AclFilter;
+}
+
+namespace server {
+
+/**
+ * @brief A runnable for generating a session snapshot in a background thread
+ *
+ * When constructed, a copy of the layerstack and the ACL filter is made.
+ *
+ * The generated messages must only be taken once snapshotReady has been emitted.
+ * Message reference counts are not thread safe, so the runnable is not
+ * auto-deleted: the receiver should take the messages and then delete
+ * the runnable in the main thread.
+ */
+class SnapshotRunnable : public QObject, public QRunnable
+{
+	Q_OBJECT
+public:
+	SnapshotRunnable(uint8_t contextId, const paintcore::LayerStack *layers, const canvas::AclFilter *aclFilter, int defaultLayer, const QString &pinnedMessage, QObject *parent=nullptr);
+
+	void run() override;
+
+	//! Get the generated snapshot
+	protocol::MessageList messages() const { return m_messages; }
+
+signals:
+	//! Emitted once the snapshot has been generated
+	void snapshotReady();
+
+private:
+	paintcore::LayerStack *m_layerstack;
+	canvas::AclFilter *m_aclfilter;
+	protocol::MessageList m_messages;
+	QString m_pinnedMessage;
+	int m_defaultLayer;
+	uint8_t m_contextId;
+};
+
+}
+
+#endif
@@ -0,0 +1,139 @@
+#include "../thicksession.h"
+#include "../../libserver/inmemoryconfig.h"
+#include "../../libserver/announcements.h"
+#include "../../libshared/net/layer.h"
+#include "../../libshared/net/meta.h"
+#include "../../libshared/net/undo.h"
+
+#include <QtTest/QtTest>
+#include <QThreadPool>
+
+using namespace protocol;
+
+// Exposes the protected parts of the session so it can be driven without clients
+class TestSession : public server::ThickSession
+{
+public:
+	TestSession(server::ServerConfig *config, sessionlisting::Announcements *announcements)
+		: ThickSession(config, announcements, "test", QString(), "tester")
+	{ }
+
+	void start() { switchState(State::Running); }
+	void add(Message *msg) { addToHistory(MessagePtr(msg)); }
+	void reset(const MessageList &resetImage) { history()->reset(resetImage); onSessionReset(); }
+};
+
+class TestThickSession: public QObject
+{
+	Q_OBJECT
+private slots:
+	void init()
+	{
+		m_config = new server::InMemoryConfig(this);
+		m_announcements = new sessionlisting::Announcements(m_config, this);
+	}
+
+	void cleanup()
+	{
+		delete m_announcements;
+		delete m_config;
+	}
+
+	void testJoinFromSnapshot()
+	{
+		TestSession session(m_config, m_announcements);
+		session.start();
+		fillUntilSnapshot(session, 64);
+
+		// The snapshot has been generated, but undos can still reach past it
+		waitForSnapshot();
+		QVERIFY(countOf(session.catchupMessages(), MSG_CHAT) > 0);
+		QCOMPARE(session.catchupMessages().first().cast<CanvasResize>().right(), 64);
+
+		// An undo made after the snapshot point must not be dropped
+		const int lastIndex = session.history()->lastIndex();
+		session.add(new Undo(1, 0, false));
+		QCOMPARE(session.history()->lastIndex(), lastIndex + 1);
+
+		// The new snapshot is switched to once it is out of undo reach
+		for(int i=0;i<=UNDO_DEPTH_LIMIT+2 && countOf(session.catchupMessages(), MSG_CHAT) > 0;++i)
+			session.add(new UndoPoint(1));
+
+		const MessageList catchup = session.catchupMessages();
+		QCOMPARE(countOf(catchup, MSG_CHAT), 0);
+		QCOMPARE(countOf(catchup, MSG_UNDO), 1);
+		QCOMPARE(countOf(catchup, MSG_UNDOPOINT), UNDO_DEPTH_LIMIT + 1);
+		QCOMPARE(countOf(catchup, MSG_LAYER_CREATE), 1);
+		QVERIFY(session.history()->sizeInBytes() < 1024 * 1024);
+	}
+
+	void testResetDuringSnapshot()
+	{
+		TestSession session(m_config, m_announcements);
+		session.start();
+		fillUntilSnapshot(session, 64);
+
+		// Reset while the snapshot is still being generated
+		const MessageList resetImage {
+			MessagePtr(new CanvasResize(1, 0, 32, 32, 0)),
+			MessagePtr(new LayerCreate(1, 0x0101, 0, 0, 0, "reset"))
+		};
+		session.reset(resetImage);
+
+		// The stale snapshot must not replace the reset image
+		waitForSnapshot();
+		for(int i=0;i<UNDO_DEPTH_LIMIT+2;++i)
+			session.add(new UndoPoint(1));
+
+		const MessageList catchup = session.catchupMessages();
+		QCOMPARE(catchup.size(), resetImage.size() + UNDO_DEPTH_LIMIT + 2);
+		QCOMPARE(catchup.first().cast<CanvasResize>().right(), 32);
+		QCOMPARE(countOf(catchup, MSG_CHAT), 0);
+
+		// A new snapshot can still be made after the reset
+		fillUntilSnapshot(session, 32);
+		waitForSnapshot();
+		for(int i=0;i<=UNDO_DEPTH_LIMIT;++i)
+			session.add(new UndoPoint(1));
+
+		QCOMPARE(countOf(session.catchupMessages(), MSG_CHAT), 0);
+		QCOMPARE(countOf(session.catchupMessages(), MSG_UNDOPOINT), UNDO_DEPTH_LIMIT + 1);
+	}
+
+private:
+	// Add enough history to trigger a new snapshot
+	void fillUntilSnapshot(TestSession &session, int canvasSize)
+	{
+		if(session.history()->sizeInBytes() == 0) {
+			session.add(new CanvasResize(1, 0, canvasSize, canvasSize, 0));
+			session.add(new LayerCreate(1, 0x0101, 0, 0, 0, "layer"));
+		}
+
+		const int lastIndex = session.history()->lastIndex();
+		while(session.history()->lastIndex() - lastIndex < 2 || session.history()->sizeInBytes() <= 1024 * 1024)
+			session.add(new Chat(1, 0, 0, QByteArray(60000, 'x')));
+	}
+
+	void waitForSnapshot()
+	{
+		QThreadPool::globalInstance()->waitForDone();
+		QCoreApplication::sendPostedEvents();
+	}
+
+	static int countOf(const MessageList &msgs, MessageType type)
+	{
+		int count = 0;
+		for(const MessagePtr &msg : msgs) {
+			if(msg->type() == type)
+				++count;
+		}
+		return count;
+	}
+
+	server::InMemoryConfig *m_config;
+	sessionlisting::Announcements *m_announcements;
+};
+
+
+QTEST_MAIN(TestThickSession)
+#include "thicksession.moc"
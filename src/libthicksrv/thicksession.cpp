@@ -18,6 +18,7 @@
 */
 
 #include "thicksession.h"
+#include "snapshotrunnable.h"
 
 #include "../libserver/inmemoryhistory.h"
 #include "../libserver/serverlog.h"
@@ -25,6 +26,7 @@
 
 #include "../libshared/net/control.h"
 #include "../libshared/net/meta.h"
+#include "../libshared/net/undo.h"
 
 #include "../libclient/canvas/aclfilter.h"
 #include "../libclient/canvas/statetracker.h"
@@ -32,8 +34,14 @@
 #include "../libclient/canvas/loader.h"
 #include "../libclient/core/layerstack.h"
 
+#include <QThreadPool>
+
 namespace server {
 
+// A new snapshot is generated when the history following the previous
+// snapshot grows bigger than the snapshot itself, but at least this big.
+static const uint MIN_SNAPSHOT_INTERVAL = 1024 * 1024;
+
 ThickSession::ThickSession(ServerConfig *config, sessionlisting::Announcements *announcements, const QString &id, const QString &idAlias, const QString &founder, QObject *parent)
 	: Session(
 		new InMemoryHistory(id, idAlias, protocol::ProtocolVersion::current(), founder),
@@ -92,11 +100,14 @@ void ThickSession::addToHistory(protocol::MessagePtr msg)
 	}
 
 	// Execute commands only in self-contained mode.
-	if(msg->isCommand() && m_statetracker->parent() == this)
+	if(msg->isCommand() && isSelfContained())
 		m_statetracker->receiveCommand(msg);
 
 	addedToHistory(msg);
 
+	if(m_snapshotPending && msg->type() == protocol::MSG_UNDOPOINT)
+		++m_undoPointsSinceNextSnapshot;
+
 	if(state() == State::Initialization) {
 		// Send to everyone except the initializing user
 		for(Client *client : clients()) {
@@ -107,7 +118,88 @@ void ThickSession::addToHistory(protocol::MessagePtr msg)
 	} else {
 		for(Client *client : clients())
 			client->sendDirectMessage(msg);
+
+		if(isSelfContained() && state() == State::Running) {
+			if(!m_nextSnapshot.isEmpty() && m_undoPointsSinceNextSnapshot > protocol::UNDO_DEPTH_LIMIT)
+				switchSnapshot();
+			else if(!m_snapshotPending && history()->sizeInBytes() > qMax(m_resetImageSize, MIN_SNAPSHOT_INTERVAL))
+				startSnapshot();
+		}
+	}
+}
+
+bool ThickSession::isSelfContained() const
+{
+	return m_statetracker->parent() == this;
+}
+
+void ThickSession::startSnapshot()
+{
+	m_snapshotPending = true;
+	m_nextSnapshotIndex = history()->lastIndex();
+	m_undoPointsSinceNextSnapshot = 0;
+
+	const protocol::MessageList stateMessages = serverSideStateMessages();
+
+	auto *runnable = new SnapshotRunnable(
+		m_statetracker->localId(),
+		m_statetracker->image(),
+		m_aclfilter,
+		m_defaultLayer,
+		m_pinnedMessage
+	);
+
+	const int generation = m_snapshotGeneration;
+	connect(runnable, &SnapshotRunnable::snapshotReady, this, [this, runnable, generation, stateMessages]() {
+		if(generation != m_snapshotGeneration)
+			return; // session was reset while the snapshot was being generated
+
+		m_nextSnapshot = stateMessages + runnable->messages();
+
+		// An undo can reach back UNDO_DEPTH_LIMIT undo points. Once that many
+		// have been made after the snapshot point, nothing preceding it is reachable.
+		if(m_undoPointsSinceNextSnapshot > protocol::UNDO_DEPTH_LIMIT)
+			switchSnapshot();
+	});
+	connect(runnable, &SnapshotRunnable::snapshotReady, runnable, &QObject::deleteLater);
+
+	QThreadPool::globalInstance()->start(runnable);
+}
+
+void ThickSession::switchSnapshot()
+{
+	Q_ASSERT(m_snapshotPending && !m_nextSnapshot.isEmpty());
+
+	const protocol::MessageList snapshot = m_nextSnapshot;
+	m_nextSnapshot = protocol::MessageList();
+	m_snapshotPending = false;
+
+	if(state() == State::Shutdown)
+		return;
+
+	protocol::MessageList tail;
+	int lastBatchIndex=0;
+	std::tie(tail, lastBatchIndex) = history()->getBatch(m_nextSnapshotIndex);
+
+	Q_ASSERT(lastBatchIndex == history()->lastIndex()); // InMemoryHistory always returns the whole history
+
+	if(!history()->reset(tail)) {
+		log(Log()
+			.about(Log::Level::Warn, Log::Topic::Status)
+			.message("Couldn't replace the history with a new snapshot")
+		   );
+		return;
 	}
+
+	m_resetImage = snapshot;
+	m_resetImageSize = 0;
+	for(const auto &msg : snapshot)
+		m_resetImageSize += msg->length();
+
+	log(Log()
+		.about(Log::Level::Info, Log::Topic::Status)
+		.message(QStringLiteral("Updated snapshot. Image size is %1 MB, followed by %2 messages").arg(m_resetImageSize / 1024.0 / 1024.0, 0, 'f', 2).arg(tail.size()))
+	   );
 }
 
 void ThickSession::onSessionReset()
@@ -120,6 +212,20 @@ void ThickSession::onSessionReset()
 
 	history()->reset(protocol::MessageList());
 
+	if(isSelfContained()) {
+		// The reset image is the new snapshot. A snapshot still being generated
+		// predates the reset and will be discarded.
+		m_resetImage = msgs;
+		m_resetImageSize = 0;
+		for(const auto &msg : msgs)
+			m_resetImageSize += msg->length();
+
+		++m_snapshotGeneration;
+		m_snapshotPending = false;
+		m_nextSnapshot = protocol::MessageList();
+		m_undoPointsSinceNextSnapshot = 0;
+	}
+
 	// Reset ACL filter state
 	m_aclfilter->reset(m_statetracker->localId(), false);
 	for(const auto &msg : msgs)
@@ -141,16 +247,9 @@ void ThickSession::onClientJoin(Client *client, bool host)
 	if(host)
 		return;
 
-	directToAll(protocol::MessagePtr(new protocol::SoftResetPoint(m_statetracker->localId())));
-	internalReset();
-
-	protocol::MessageList msgs;
-	int lastBatchIndex=0;
-	std::tie(msgs, lastBatchIndex) = history()->getBatch(-1);
-
-	Q_ASSERT(lastBatchIndex == history()->lastIndex()); // InMemoryHistory always returns the whole history
-
-	history()->reset(protocol::MessageList());
+	// The joining user gets the current snapshot and everything that
+	// has happened since. Existing users are not disturbed.
+	const protocol::MessageList msgs = catchupMessages();
 
 	protocol::ServerReply catchup;
 	catchup.type = protocol::ServerReply::CATCHUP;
@@ -160,6 +259,17 @@ void ThickSession::onClientJoin(Client *client, bool host)
 	client->sendDirectMessage(msgs);
 }
 
+protocol::MessageList ThickSession::catchupMessages() const
+{
+	protocol::MessageList msgs;
+	int lastBatchIndex=0;
+	std::tie(msgs, lastBatchIndex) = history()->getBatch(-1);
+
+	Q_ASSERT(lastBatchIndex == history()->lastIndex()); // InMemoryHistory always returns the whole history
+
+	return m_resetImage + msgs;
+}
+
 void ThickSession::internalReset()
 {
 	auto loader =  canvas::SnapshotLoader(
@@ -44,6 +44,13 @@ public:
 
 	bool supportsAutoReset() const override { return false; }
 
+	/**
+	 * @brief Get the messages a joining user is sent
+	 *
+	 * This is the current snapshot and the history following it.
+	 */
+	protocol::MessageList catchupMessages() const;
+
 protected:
 	ThickSession(ServerConfig *config, sessionlisting::Announcements *announcements, canvas::StateTracker *statetracker, const canvas::AclFilter *aclFilter, const QString &id, const QString &idAlias, const QString &founder, QObject *parent=nullptr);
 
@@ -56,12 +63,31 @@ protected:
 	canvas::StateTracker *stateTracker() { return m_statetracker; }
 
 private:
+	//! Is this session running its own state tracker?
+	bool isSelfContained() const;
+
+	//! Start generating a new snapshot in the background
+	void startSnapshot();
+
+	//! Replace the current snapshot with the next one and drop the history preceding it
+	void switchSnapshot();
+
 	canvas::StateTracker *m_statetracker;
 	canvas::AclFilter *m_aclfilter;
 
+	// The current snapshot. Joining users receive this plus the history that follows it.
 	protocol::MessageList m_resetImage;
 	uint m_resetImageSize = 0;
 
+	// The next snapshot. Joining users don't get the undo history preceding
+	// a snapshot, so it replaces the current one only once no undo can reach
+	// past its history index anymore.
+	protocol::MessageList m_nextSnapshot;
+	int m_nextSnapshotIndex = -1;
+	int m_undoPointsSinceNextSnapshot = 0;
+	int m_snapshotGeneration = 0;
+	bool m_snapshotPending = false; // next snapshot is being generated or waiting to be switched to
+
 	QString m_pinnedMessage;
 	int m_defaultLayer = 0;
 };
@@ -34,6 +34,8 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QTimer>
+#include <QThread>
+#include <QCoreApplication>
 
 namespace server {
 
@@ -130,9 +132,26 @@ bool Database::openFile(const QString &path)
 	return true;
 }
 
+QSqlDatabase Database::threadConnection(const QSqlDatabase &db)
+{
+	QThread *thread = QThread::currentThread();
+	const QCoreApplication *app = QCoreApplication::instance();
+	if(!app || thread == app->thread())
+		return db;
+
+	const QString name = QStringLiteral("%1-%2").arg(db.connectionName()).arg(quintptr(thread));
+	if(QSqlDatabase::contains(name))
+		return QSqlDatabase::database(name);
+
+	QSqlDatabase clone = QSqlDatabase::cloneDatabase(db, name);
+	if(!clone.open())
+		qWarning("Unable to open database connection for thread %s", qPrintable(thread->objectName()));
+	return clone;
+}
+
 void Database::setConfigValue(ConfigKey key, const QString &value)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("INSERT OR REPLACE INTO settings VALUES (?, ?)");
 	q.bindValue(0, key.name);
 	q.bindValue(1, value);
@@ -141,7 +160,7 @@ void Database::setConfigValue(ConfigKey key, const QString &value)
 
 QString Database::getConfigValue(const ConfigKey key, bool &found) const
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("SELECT value FROM settings WHERE key=?");
 	q.bindValue(0, key.name);
 	q.exec();
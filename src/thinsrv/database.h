@@ -22,6 +22,8 @@
 
 #include "../libserver/serverconfig.h"
 
+class QSqlDatabase;
+
 namespace server {
 
 /**
@@ -60,6 +62,15 @@ public:
 	QJsonObject updateAccount(int id, const QJsonObject &update);
 	bool deleteAccount(int id);
 
+	/**
+	 * @brief Get a connection to the database usable in the current thread
+	 *
+	 * Qt's database connections may only be used in the thread that created
+	 * them. In the main thread, this returns the given connection. Other
+	 * threads (session workers) get a clone of their own.
+	 */
+	static QSqlDatabase threadConnection(const QSqlDatabase &db);
+
 private slots:
 	void dailyTasks();
 
@@ -18,6 +18,7 @@
 */
 
 #include "dblog.h"
+#include "database.h"
 
 #include <QSqlQuery>
 #include <QMetaEnum>
@@ -69,7 +70,7 @@ QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after,
 		params << offset;
 	}
 
-	QSqlQuery q(m_db);
+	QSqlQuery q(Database::threadConnection(m_db));
 	q.prepare(sql);
 	for(int i=0;i<params.size();++i)
 		q.bindValue(i, params.at(i));
@@ -95,7 +96,7 @@ QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after,
 
 void DbLog::storeMessage(const Log &entry)
 {
-	QSqlQuery q(m_db);
+	QSqlQuery q(Database::threadConnection(m_db));
 	q.prepare("INSERT INTO serverlog (timestamp, level, topic, user, session, message) VALUES (?, ?, ?, ?, ?, ?)");
 	q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
 	q.bindValue(1, int(entry.level()));
@@ -22,6 +22,7 @@
 #include "../../libshared/util/passwordhash.h"
 
 #include <QFileInfo>
+#include <QMutexLocker>
 
 namespace server {
 
@@ -164,6 +165,7 @@ QString ConfigFile::getConfigValue(const ConfigKey key, bool &found) const
 
 bool ConfigFile::isAddressBanned(const QHostAddress &addr) const
 {
+	QMutexLocker lock(&m_configMutex);
 	if(isModified())
 		reloadFile();
 
@@ -191,11 +193,13 @@ bool ConfigFile::isAllowedAnnouncementUrl(const QUrl &url) const
 	if(!getConfigBool(config::AnnounceWhiteList))
 		return true;
 
+	QMutexLocker lock(&m_configMutex);
 	return m_announcewhitelist.contains(url);
 }
 
 RegisteredUser ConfigFile::getUserAccount(const QString &username, const QString &password) const
 {
+	QMutexLocker lock(&m_configMutex);
 	if(m_users.contains(username)) {
 		const User &u = m_users[username];
 		if(u.password.startsWith("*")) {
@@ -146,6 +146,22 @@ bool start() {
 	QCommandLineOption reportUrlOption(QStringList() << "report-url", "Abuse report handler URL", "url");
 	parser.addOption(reportUrlOption);
 
+	// --io-thread
+	QCommandLineOption ioThreadOption(QStringList() << "io-thread", "Do client network I/O in a separate thread");
+	parser.addOption(ioThreadOption);
+
+	// --worker-threads <count>
+	QCommandLineOption workerThreadsOption(QStringList() << "worker-threads", "Run sessions in this many threads", "count", "0");
+	parser.addOption(workerThreadsOption);
+
+	// --history-cache-mb <size>
+	QCommandLineOption historyCacheOption(QStringList() << "history-cache-mb", "Memory budget for cached session history blocks (0 for no limit)", "size", "0");
+	parser.addOption(historyCacheOption);
+
+	// --history-sync <none|periodic|ms>
+	QCommandLineOption historySyncOption(QStringList() << "history-sync", "When to sync session files to disk (none, periodic or minimum time between syncs in milliseconds)", "policy", "none");
+	parser.addOption(historySyncOption);
+
 	// Parse
 	parser.process(*QCoreApplication::instance());
 
@@ -185,6 +201,42 @@ bool start() {
 	icfg.extAuthUrl = parser.value(extAuthOption);
 #endif
 	icfg.reportUrl = parser.value(reportUrlOption);
+	icfg.ioThread = parser.isSet(ioThreadOption);
+
+	{
+		bool ok;
+		icfg.workerThreads = parser.value(workerThreadsOption).toInt(&ok);
+		if(!ok || icfg.workerThreads<0 || icfg.workerThreads>256) {
+			qCritical("Invalid worker thread count %s", qPrintable(parser.value(workerThreadsOption)));
+			return false;
+		}
+	}
+
+	{
+		bool ok;
+		const int size = parser.value(historyCacheOption).toInt(&ok);
+		if(!ok || size<0) {
+			qCritical("Invalid history cache size %s", qPrintable(parser.value(historyCacheOption)));
+			return false;
+		}
+		icfg.historyCacheSize = qint64(size) * 1024 * 1024;
+	}
+
+	{
+		const QString policy = parser.value(historySyncOption);
+		if(policy == "none") {
+			icfg.historySyncInterval = -1;
+		} else if(policy == "periodic") {
+			icfg.historySyncInterval = 30 * 1000;
+		} else {
+			bool ok;
+			icfg.historySyncInterval = policy.toInt(&ok);
+			if(!ok || icfg.historySyncInterval<0) {
+				qCritical("Invalid history sync policy %s", qPrintable(policy));
+				return false;
+			}
+		}
+	}
 
 	if(parser.isSet(announcePortOption)) {
 		bool ok;
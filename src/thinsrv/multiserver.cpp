@@ -24,6 +24,7 @@
 
 #include "../libserver/session.h"
 #include "../libserver/sessionserver.h"
+#include "../libserver/historycache.h"
 #include "../libserver/thinserverclient.h"
 #include "../libserver/serverconfig.h"
 #include "../libserver/serverlog.h"
@@ -375,6 +376,7 @@ JsonApiResult MultiServer::serverJsonApi(JsonApiMethod method, const QStringList
 		config::EnablePersistence,
 		config::ArchiveMode,
 		config::IdleTimeLimit,
+		config::HibernationTime,
 		config::ServerTitle,
 		config::WelcomeMessage,
 		config::PrivateUserList,
@@ -391,6 +393,7 @@ JsonApiResult MultiServer::serverJsonApi(JsonApiMethod method, const QStringList
 #endif
 		config::LogPurgeDays,
 		config::AllowCustomAvatars,
+		config::CompressionLevel,
 		config::AbuseReport,
 		config::ReportToken
 	};
@@ -431,6 +434,18 @@ JsonApiResult MultiServer::statusJsonApi(JsonApiMethod method, const QStringList
 {
 	Q_UNUSED(request);
 
+	if(path.size() == 1 && path.first() == "traffic") {
+		if(method != JsonApiMethod::Get)
+			return JsonApiBadMethod();
+		return JsonApiResult { JsonApiResult::Ok, QJsonDocument(m_sessions->trafficStats().toJson()) };
+	}
+
+	if(path.size() == 1 && path.first() == "historycache") {
+		if(method != JsonApiMethod::Get)
+			return JsonApiBadMethod();
+		return JsonApiResult { JsonApiResult::Ok, QJsonDocument(m_sessions->historyCache()->stats().toJson()) };
+	}
+
 	if(!path.isEmpty())
 		return JsonApiNotFound();
 
@@ -440,8 +455,18 @@ JsonApiResult MultiServer::statusJsonApi(JsonApiMethod method, const QStringList
 	QJsonObject result;
 	result["started"] = m_started.toString("yyyy-MM-dd HH:mm:ss");
 	result["sessions"] = m_sessions->sessionCount();
+	result["hibernatedSessions"] = m_sessions->hibernatedSessionCount();
 	result["maxSessions"] = m_config->getConfigInt(config::SessionCountLimit);
 	result["users"] = m_sessions->totalUsers();
+
+	const QVector<int> workerSessions = m_sessions->workerSessionCounts();
+	if(!workerSessions.isEmpty()) {
+		QJsonArray workers;
+		for(int count : workerSessions)
+			workers << count;
+		result["workerSessions"] = workers;
+	}
+
 	QString localhost = m_config->internalConfig().localHostname;
 	if(localhost.isEmpty())
 		localhost = WhatIsMyIp::guessLocalAddress();